@@ -0,0 +1,227 @@
+#include "Aggregation.h"
+#include "EntityCodec.h"
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include <algorithm>
+#include <cmath>
+
+extern "C" {
+    #include "xxhash.h"
+}
+
+namespace webofdata {
+
+    using namespace rapidjson;
+
+    HyperLogLog::HyperLogLog(int precision) : _precision(precision), _registers((size_t) 1 << precision, 0) {}
+
+    void HyperLogLog::Add(uint64_t hash) {
+        auto index = hash >> (64 - _precision);
+        auto rest = hash << _precision;
+        // position of the first set bit of the rest, one past the last possible when none is set
+        auto rank = (uint8_t) (rest == 0 ? 64 - _precision + 1 : __builtin_clzll(rest) + 1);
+        if (rank > _registers[index]) {
+            _registers[index] = rank;
+        }
+    }
+
+    void HyperLogLog::Merge(const HyperLogLog &other) {
+        for (size_t i = 0; i < _registers.size() && i < other._registers.size(); i++) {
+            _registers[i] = std::max(_registers[i], other._registers[i]);
+        }
+    }
+
+    double HyperLogLog::Estimate() const {
+        auto m = (double) _registers.size();
+        double sum = 0;
+        size_t zeros = 0;
+        for (auto r : _registers) {
+            sum += std::ldexp(1.0, -r);
+            if (r == 0) zeros++;
+        }
+
+        auto estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        // small cardinalities are counted more closely from the empty registers
+        if (estimate <= 2.5 * m && zeros > 0) {
+            estimate = m * std::log(m / (double) zeros);
+        }
+        return estimate;
+    }
+
+    AggregationPartial::AggregationPartial(const AggregationSpec &spec)
+            : _groups(spec.groupBy.size()), _distinct(spec.distinct.size()) {
+        _properties.insert(_properties.end(), spec.groupBy.begin(), spec.groupBy.end());
+        _properties.insert(_properties.end(), spec.distinct.begin(), spec.distinct.end());
+    }
+
+    // the member named by the property or null, names are quoted
+    static const JsonMember *FindMember(const vector<JsonMember> &members, const string &property) {
+        for (auto const &member : members) {
+            if (member.name.length == property.length() + 2 &&
+                memcmp(member.name.data + 1, property.data(), property.length()) == 0) {
+                return &member;
+            }
+        }
+        return nullptr;
+    }
+
+    void AggregationPartial::Add(const vector<JsonMember> &members, const AggregationSpec &spec) {
+        _entities++;
+
+        for (size_t i = 0; i < spec.groupBy.size(); i++) {
+            // entities without the property are counted under null
+            auto member = FindMember(members, spec.groupBy[i]);
+            _elements.clear();
+            if (member == nullptr) {
+                _elements.push_back(JsonSpan{"null", 4});
+            } else if (member->value.length > 0 && member->value.data[0] == '[') {
+                EntityMerger::ScanElements(member->value.data, member->value.length, _elements);
+            } else {
+                _elements.push_back(member->value);
+            }
+            for (auto const &element : _elements) {
+                _groups[i][string(element.data, element.length)]++;
+            }
+        }
+
+        for (size_t i = 0; i < spec.distinct.size(); i++) {
+            auto member = FindMember(members, spec.distinct[i]);
+            if (member == nullptr) continue;
+            _elements.clear();
+            if (member->value.length > 0 && member->value.data[0] == '[') {
+                EntityMerger::ScanElements(member->value.data, member->value.length, _elements);
+            } else {
+                _elements.push_back(member->value);
+            }
+            for (auto const &element : _elements) {
+                _distinct[i].Add(XXH64(element.data, element.length, 0));
+            }
+        }
+    }
+
+    void AggregationPartial::Add(const rocksdb::Slice &entity, const vector<string> &names,
+                                 const unordered_map<string, int> &numbers, const AggregationSpec &spec) {
+        _members.clear();
+        if (EntityCodec::IsBinary(entity)) {
+            if (!EntityCodec::FindMembers(entity, _properties, names, numbers, _values, _members)) return;
+        } else if (!EntityMerger::ScanMembers(entity.data(), entity.size(), _members)) {
+            return;
+        }
+        Add(_members, spec);
+    }
+
+    void AggregationPartial::Merge(const AggregationPartial &other) {
+        _entities += other._entities;
+        for (size_t i = 0; i < _groups.size(); i++) {
+            for (auto const &group : other._groups[i]) {
+                _groups[i][group.first] += group.second;
+            }
+        }
+        for (size_t i = 0; i < _distinct.size(); i++) {
+            _distinct[i].Merge(other._distinct[i]);
+        }
+    }
+
+    string AggregationPartial::ToJson(const AggregationSpec &spec) const {
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("entities");
+        writer.Uint64(_entities);
+
+        writer.Key("groups");
+        writer.StartObject();
+        for (size_t i = 0; i < spec.groupBy.size(); i++) {
+            // largest first, ties in value order so the result is stable
+            vector<pair<const string *, uint64_t>> ordered;
+            for (auto const &group : _groups[i]) {
+                ordered.emplace_back(&group.first, group.second);
+            }
+            auto top = std::min(spec.top, ordered.size());
+            std::partial_sort(ordered.begin(), ordered.begin() + top, ordered.end(), [](const pair<const string *, uint64_t> &a,
+                                                                                        const pair<const string *, uint64_t> &b) {
+                return a.second != b.second ? a.second > b.second : *a.first < *b.first;
+            });
+
+            writer.Key(spec.groupBy[i].data(), (SizeType) spec.groupBy[i].size());
+            writer.StartObject();
+            writer.Key("values");
+            writer.Uint64(ordered.size());
+            writer.Key("top");
+            writer.StartArray();
+            for (size_t g = 0; g < top; g++) {
+                writer.StartObject();
+                writer.Key("value");
+                writer.RawValue(ordered[g].first->data(), ordered[g].first->size(), kStringType);
+                writer.Key("count");
+                writer.Uint64(ordered[g].second);
+                writer.EndObject();
+            }
+            writer.EndArray();
+            writer.EndObject();
+        }
+        writer.EndObject();
+
+        writer.Key("distinct");
+        writer.StartObject();
+        for (size_t i = 0; i < spec.distinct.size(); i++) {
+            writer.Key(spec.distinct[i].data(), (SizeType) spec.distinct[i].size());
+            writer.Uint64((uint64_t) std::llround(_distinct[i].Estimate()));
+        }
+        writer.EndObject();
+
+        writer.EndObject();
+        return string(buffer.GetString(), buffer.GetSize());
+    }
+
+    void AggregationJob::Finish(State state, const string &resultOrError) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _state = state;
+        if (state == Failed) {
+            _error = resultOrError;
+        } else {
+            _result = resultOrError;
+        }
+    }
+
+    AggregationJob::State AggregationJob::GetState() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _state;
+    }
+
+    string AggregationJob::GetStatusJson() {
+        static const char *StateNames[] = {"running", "completed", "cancelled", "failed"};
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("id");
+        writer.String(id.data(), (SizeType) id.size());
+        writer.Key("dataset");
+        writer.String(dataset.data(), (SizeType) dataset.size());
+        writer.Key("state");
+        writer.String(StateNames[_state]);
+
+        writer.Key("progress");
+        writer.StartObject();
+        writer.Key("ranges");
+        writer.Uint64(ranges);
+        writer.Key("ranges-scanned");
+        writer.Uint64(rangesScanned);
+        writer.Key("entities-scanned");
+        writer.Uint64(entitiesScanned);
+        writer.EndObject();
+
+        if (_state == Completed) {
+            writer.Key("result");
+            writer.RawValue(_result.data(), _result.size(), kObjectType);
+        }
+        if (_state == Failed) {
+            writer.Key("error");
+            writer.String(_error.data(), (SizeType) _error.size());
+        }
+        writer.EndObject();
+        return string(buffer.GetString(), buffer.GetSize());
+    }
+}
@@ -0,0 +1,269 @@
+#include "Compression.h"
+#include <cstring>
+#include <sstream>
+
+namespace webofdata {
+
+    using namespace std;
+
+    static string Trim(const string &s) {
+        auto start = s.find_first_not_of(" \t");
+        if (start == string::npos) return "";
+        auto end = s.find_last_not_of(" \t");
+        return s.substr(start, end - start + 1);
+    }
+
+    ContentCoding ParseContentCoding(const string &contentEncoding) {
+        auto coding = Trim(contentEncoding);
+        if (coding.empty() || coding == "identity") return ContentCoding::Identity;
+        if (coding == "gzip" || coding == "x-gzip") return ContentCoding::Gzip;
+        if (coding == "zstd") return ContentCoding::Zstd;
+        return ContentCoding::Unsupported;
+    }
+
+    ContentCoding NegotiateContentCoding(const string &acceptEncoding, const CompressionLevels &levels) {
+        bool gzip = false;
+        bool zstd = false;
+
+        // e.g. "gzip, deflate, zstd;q=0.5" - a coding is only refused with q=0
+        std::stringstream ss(acceptEncoding);
+        string item;
+        while (std::getline(ss, item, ',')) {
+            auto parameters = item.find(';');
+            auto coding = Trim(item.substr(0, parameters));
+            if (parameters != string::npos) {
+                auto q = item.find("q=", parameters);
+                if (q != string::npos && strtod(item.data() + q + 2, nullptr) <= 0) continue;
+            }
+
+            if (coding == "zstd") zstd = true;
+            if (coding == "gzip" || coding == "x-gzip") gzip = true;
+        }
+
+        if (zstd && levels.zstd > 0) return ContentCoding::Zstd;
+        if (gzip && levels.gzip > 0) return ContentCoding::Gzip;
+        return ContentCoding::Identity;
+    }
+
+    const char *ContentCodingName(ContentCoding coding) {
+        switch (coding) {
+            case ContentCoding::Gzip:
+                return "gzip";
+            case ContentCoding::Zstd:
+                return "zstd";
+            default:
+                return "identity";
+        }
+    }
+
+    //----------------------------------------------------
+    // DecompressingStreamBuf
+    //----------------------------------------------------
+
+    DecompressingStreamBuf::DecompressingStreamBuf(std::istream &source, ContentCoding coding, size_t bufferSize)
+            : _source(source), _coding(coding), _in(bufferSize), _out(bufferSize) {
+        _inAvailable = 0;
+        _inPosition = 0;
+        _sourceEnded = false;
+        _frameEnded = true; // an empty body is not a truncated one
+        _outputPending = false;
+        _zstd = nullptr;
+        memset(&_zstream, 0, sizeof(_zstream));
+
+        if (_coding == ContentCoding::Gzip) {
+            // 16 + MAX_WBITS selects the gzip wrapper rather than raw zlib
+            if (inflateInit2(&_zstream, 16 + MAX_WBITS) != Z_OK) {
+                throw CompressionException("Unable to initialise gzip decompression");
+            }
+        } else if (_coding == ContentCoding::Zstd) {
+            _zstd = ZSTD_createDStream();
+            if (_zstd == nullptr || ZSTD_isError(ZSTD_initDStream(_zstd))) {
+                throw CompressionException("Unable to initialise zstd decompression");
+            }
+        } else {
+            throw CompressionException("Unsupported content coding");
+        }
+
+        setg(_out.data(), _out.data(), _out.data());
+    }
+
+    DecompressingStreamBuf::~DecompressingStreamBuf() {
+        if (_coding == ContentCoding::Gzip) {
+            inflateEnd(&_zstream);
+        }
+        if (_zstd != nullptr) {
+            ZSTD_freeDStream(_zstd);
+        }
+    }
+
+    bool DecompressingStreamBuf::FillInput() {
+        if (_sourceEnded) return false;
+
+        _source.read(_in.data(), _in.size());
+        auto read = (size_t) _source.gcount();
+        if (read == 0) {
+            _sourceEnded = true;
+            return false;
+        }
+
+        _inAvailable = read;
+        _inPosition = 0;
+        return true;
+    }
+
+    size_t DecompressingStreamBuf::Decompress() {
+        if (_coding == ContentCoding::Gzip) {
+            _zstream.next_in = (Bytef *) _in.data() + _inPosition;
+            _zstream.avail_in = (uInt) (_inAvailable - _inPosition);
+            _zstream.next_out = (Bytef *) _out.data();
+            _zstream.avail_out = (uInt) _out.size();
+
+            auto ret = inflate(&_zstream, Z_NO_FLUSH);
+            auto consumed = (_inAvailable - _inPosition) - _zstream.avail_in;
+            _inPosition += consumed;
+
+            if (ret == Z_STREAM_END) {
+                // gzip bodies may be several concatenated members
+                inflateReset(&_zstream);
+                _frameEnded = true;
+            } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+                if (consumed > 0) _frameEnded = false;
+            } else {
+                throw CompressionException(string("Error in gzip body: ") + (_zstream.msg ? _zstream.msg : "unknown"));
+            }
+
+            return _out.size() - _zstream.avail_out;
+        }
+
+        ZSTD_inBuffer in = {_in.data() + _inPosition, _inAvailable - _inPosition, 0};
+        ZSTD_outBuffer out = {_out.data(), _out.size(), 0};
+        auto ret = ZSTD_decompressStream(_zstd, &out, &in);
+        if (ZSTD_isError(ret)) {
+            throw CompressionException(string("Error in zstd body: ") + ZSTD_getErrorName(ret));
+        }
+
+        _inPosition += in.pos;
+        if (in.pos > 0 || out.pos > 0) {
+            _frameEnded = ret == 0;
+        }
+        return out.pos;
+    }
+
+    DecompressingStreamBuf::int_type DecompressingStreamBuf::underflow() {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        while (true) {
+            // a full output buffer means the decoder may still hold data without needing more input
+            if (_inPosition == _inAvailable && !_outputPending) {
+                if (!FillInput()) {
+                    if (!_frameEnded) {
+                        throw CompressionException("Compressed body is truncated");
+                    }
+                    return traits_type::eof();
+                }
+            }
+
+            auto produced = Decompress();
+            _outputPending = produced == _out.size();
+            if (produced > 0) {
+                setg(_out.data(), _out.data(), _out.data() + produced);
+                return traits_type::to_int_type(*gptr());
+            }
+        }
+    }
+
+    //----------------------------------------------------
+    // CompressingStreamWriter
+    //----------------------------------------------------
+
+    CompressingStreamWriter::CompressingStreamWriter(unique_ptr<EntityStreamWriter> inner, ContentCoding coding, int level)
+            : _inner(std::move(inner)), _coding(coding), _out(64 * 1024) {
+        _closed = false;
+        _zstd = nullptr;
+        memset(&_zstream, 0, sizeof(_zstream));
+
+        if (_coding == ContentCoding::Gzip) {
+            if (deflateInit2(&_zstream, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw CompressionException("Unable to initialise gzip compression");
+            }
+        } else if (_coding == ContentCoding::Zstd) {
+            _zstd = ZSTD_createCStream();
+            if (_zstd == nullptr || ZSTD_isError(ZSTD_initCStream(_zstd, level))) {
+                throw CompressionException("Unable to initialise zstd compression");
+            }
+        } else {
+            throw CompressionException("Unsupported content coding");
+        }
+    }
+
+    CompressingStreamWriter::~CompressingStreamWriter() {
+        if (_coding == ContentCoding::Gzip) {
+            deflateEnd(&_zstream);
+        }
+        if (_zstd != nullptr) {
+            ZSTD_freeCStream(_zstd);
+        }
+    }
+
+    void CompressingStreamWriter::Compress(const char *data, size_t length, Mode mode) {
+        if (_closed || _inner->IsCancelled()) return;
+
+        if (_coding == ContentCoding::Gzip) {
+            int flush = mode == Mode::Continue ? Z_NO_FLUSH : (mode == Mode::Flush ? Z_SYNC_FLUSH : Z_FINISH);
+            _zstream.next_in = (Bytef *) data;
+            _zstream.avail_in = (uInt) length;
+            do {
+                _zstream.next_out = (Bytef *) _out.data();
+                _zstream.avail_out = (uInt) _out.size();
+                if (deflate(&_zstream, flush) == Z_STREAM_ERROR) {
+                    throw CompressionException("Error compressing gzip response");
+                }
+                auto have = _out.size() - _zstream.avail_out;
+                if (have > 0) {
+                    _inner->WriteJson(_out.data(), (int) have);
+                }
+            } while (_zstream.avail_out == 0);
+            return;
+        }
+
+        ZSTD_inBuffer in = {data, length, 0};
+        while (in.pos < in.size) {
+            ZSTD_outBuffer out = {_out.data(), _out.size(), 0};
+            auto ret = ZSTD_compressStream(_zstd, &out, &in);
+            if (ZSTD_isError(ret)) {
+                throw CompressionException(string("Error compressing zstd response: ") + ZSTD_getErrorName(ret));
+            }
+            if (out.pos > 0) {
+                _inner->WriteJson(_out.data(), (int) out.pos);
+            }
+        }
+
+        if (mode != Mode::Continue) {
+            size_t remaining;
+            do {
+                ZSTD_outBuffer out = {_out.data(), _out.size(), 0};
+                remaining = mode == Mode::Flush ? ZSTD_flushStream(_zstd, &out) : ZSTD_endStream(_zstd, &out);
+                if (ZSTD_isError(remaining)) {
+                    throw CompressionException(string("Error compressing zstd response: ") + ZSTD_getErrorName(remaining));
+                }
+                if (out.pos > 0) {
+                    _inner->WriteJson(_out.data(), (int) out.pos);
+                }
+            } while (remaining > 0);
+        }
+    }
+
+    void CompressingStreamWriter::Flush() {
+        Compress(nullptr, 0, Mode::Flush);
+        _inner->Flush();
+    }
+
+    void CompressingStreamWriter::Close() {
+        if (_closed) return;
+        Compress(nullptr, 0, Mode::End);
+        _closed = true;
+        _inner->Close();
+    }
+}
@@ -0,0 +1,259 @@
+#include "EntityCodec.h"
+#include <rapidjson/reader.h>
+#include <rapidjson/memorystream.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include <cstring>
+
+namespace webofdata {
+
+    using namespace rapidjson;
+
+    static void AppendVarint(string &output, uint64_t value) {
+        while (value >= 0x80) {
+            output.push_back((char) (value | 0x80));
+            value >>= 7;
+        }
+        output.push_back((char) value);
+    }
+
+    static bool ReadVarint(const char *&p, const char *end, uint64_t &value) {
+        value = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            auto byte = (uint8_t) *p++;
+            value |= (uint64_t) (byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        return false;
+    }
+
+    static uint32_t ReadUint32(const char *p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    // sax handler writing the binary form as the json is read, container headers patched at their end
+    class BinaryEncodingHandler : public BaseReaderHandler<UTF8<>, BinaryEncodingHandler> {
+    private:
+        string &_output;
+        const function<uint32_t(const char *, size_t)> &_intern;
+        vector<size_t> _open;
+
+        bool Start(char tag) {
+            _output.push_back(tag);
+            _open.push_back(_output.size());
+            _output.append(8, '\0');
+            return true;
+        }
+
+        bool End(SizeType count) {
+            auto header = _open.back();
+            _open.pop_back();
+            auto length = (uint32_t) (_output.size() - header - 8);
+            auto elements = (uint32_t) count;
+            memcpy(&_output[header], &elements, sizeof(elements));
+            memcpy(&_output[header + 4], &length, sizeof(length));
+            return true;
+        }
+
+    public:
+        BinaryEncodingHandler(string &output, const function<uint32_t(const char *, size_t)> &intern)
+                : _output(output), _intern(intern) {}
+
+        bool Null() { _output.push_back('n'); return true; }
+        bool Bool(bool b) { _output.push_back(b ? 't' : 'f'); return true; }
+        bool Int(int i) { return Int64(i); }
+        bool Uint(unsigned u) { return Int64(u); }
+
+        bool Int64(int64_t i) {
+            _output.push_back('i');
+            AppendVarint(_output, ((uint64_t) i << 1) ^ (uint64_t) (i >> 63));
+            return true;
+        }
+
+        bool Uint64(uint64_t u) {
+            if (u > (uint64_t) INT64_MAX) return Double((double) u);
+            return Int64((int64_t) u);
+        }
+
+        bool Double(double d) {
+            _output.push_back('d');
+            _output.append((const char *) &d, sizeof(d));
+            return true;
+        }
+
+        bool String(const char *str, SizeType length, bool) {
+            _output.push_back('s');
+            AppendVarint(_output, length);
+            _output.append(str, length);
+            return true;
+        }
+
+        bool Key(const char *str, SizeType length, bool) {
+            AppendVarint(_output, _intern(str, length));
+            return true;
+        }
+
+        bool StartObject() { return Start('o'); }
+        bool EndObject(SizeType count) { return End(count); }
+        bool StartArray() { return Start('a'); }
+        bool EndArray(SizeType count) { return End(count); }
+    };
+
+    bool EntityCodec::Encode(const char *json, size_t length, const function<uint32_t(const char *, size_t)> &intern,
+                             string &output) {
+        output.clear();
+        output.push_back(Marker);
+
+        // an entity is an object, its first non blank byte
+        size_t start = 0;
+        while (start < length && (json[start] == ' ' || json[start] == '\t' || json[start] == '\n' || json[start] == '\r')) start++;
+        if (start == length || json[start] != '{') return false;
+
+        BinaryEncodingHandler handler(output, intern);
+        Reader reader;
+        MemoryStream stream(json, length);
+        // full precision so a double written back is the one read
+        return !reader.Parse<kParseFullPrecisionFlag>(stream, handler).IsError();
+    }
+
+    // past the value at p, false if it runs off the end
+    static bool SkipValue(const char *&p, const char *end) {
+        if (p >= end) return false;
+        uint64_t length;
+        switch (*p++) {
+            case 'n':
+            case 't':
+            case 'f':
+                return true;
+            case 'i':
+                return ReadVarint(p, end, length);
+            case 'd':
+                p += 8;
+                return p <= end;
+            case 's':
+                if (!ReadVarint(p, end, length)) return false;
+                p += length;
+                return p <= end;
+            case 'o':
+            case 'a':
+                if (end - p < 8) return false;
+                p += 8 + ReadUint32(p + 4);
+                return p <= end;
+            default:
+                return false;
+        }
+    }
+
+    static bool WriteValue(const char *&p, const char *end, const vector<string> &names, Writer<StringBuffer> &writer) {
+        if (p >= end) return false;
+        uint64_t value;
+        switch (*p++) {
+            case 'n':
+                return writer.Null();
+            case 't':
+                return writer.Bool(true);
+            case 'f':
+                return writer.Bool(false);
+            case 'i': {
+                if (!ReadVarint(p, end, value)) return false;
+                return writer.Int64((int64_t) (value >> 1) ^ -(int64_t) (value & 1));
+            }
+            case 'd': {
+                if (end - p < 8) return false;
+                double d;
+                memcpy(&d, p, sizeof(d));
+                p += 8;
+                return writer.Double(d);
+            }
+            case 's': {
+                if (!ReadVarint(p, end, value) || (uint64_t) (end - p) < value) return false;
+                writer.String(p, (SizeType) value);
+                p += value;
+                return true;
+            }
+            case 'o':
+            case 'a': {
+                auto isObject = p[-1] == 'o';
+                if (end - p < 8) return false;
+                auto count = ReadUint32(p);
+                p += 8;
+                isObject ? writer.StartObject() : writer.StartArray();
+                for (uint32_t i = 0; i < count; i++) {
+                    if (isObject) {
+                        if (!ReadVarint(p, end, value) || value >= names.size()) return false;
+                        writer.Key(names[value].data(), (SizeType) names[value].size());
+                    }
+                    if (!WriteValue(p, end, names, writer)) return false;
+                }
+                return isObject ? writer.EndObject(count) : writer.EndArray(count);
+            }
+            default:
+                return false;
+        }
+    }
+
+    bool EntityCodec::ToJson(const rocksdb::Slice &value, const vector<string> &names, string &json) {
+        if (!IsBinary(value)) return false;
+        return ValueToJson(rocksdb::Slice(value.data() + 1, value.size() - 1), names, json);
+    }
+
+    bool EntityCodec::FindProperty(const rocksdb::Slice &value, uint32_t name, rocksdb::Slice &encodedValue) {
+        auto p = value.data();
+        auto end = p + value.size();
+        if (value.size() < 10 || p[0] != Marker || p[1] != 'o') return false;
+        auto count = ReadUint32(p + 2);
+        p += 10;
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t member;
+            if (!ReadVarint(p, end, member)) return false;
+            auto start = p;
+            if (!SkipValue(p, end)) return false;
+            if (member == name) {
+                encodedValue = rocksdb::Slice(start, p - start);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool EntityCodec::ValueToJson(const rocksdb::Slice &encodedValue, const vector<string> &names, string &json) {
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        auto p = encodedValue.data();
+        if (!WriteValue(p, p + encodedValue.size(), names, writer)) return false;
+        json.append(buffer.GetString(), buffer.GetSize());
+        return true;
+    }
+
+    bool EntityCodec::FindMembers(const rocksdb::Slice &value, const vector<string> &properties, const vector<string> &names,
+                                  const unordered_map<string, int> &numbers, string &json, vector<JsonMember> &members) {
+        // offsets of each name and value, the spans are made once json has stopped growing
+        thread_local vector<size_t> offsets;
+        offsets.clear();
+        json.clear();
+        members.clear();
+
+        for (auto const &property : properties) {
+            auto number = numbers.find(property);
+            rocksdb::Slice encodedValue;
+            // a name never numbered is in no binary entity
+            if (number == numbers.end() || !FindProperty(value, (uint32_t) number->second, encodedValue)) continue;
+            offsets.push_back(json.size());
+            json.push_back('"');
+            json.append(property);
+            json.push_back('"');
+            offsets.push_back(json.size());
+            if (!ValueToJson(encodedValue, names, json)) return false;
+        }
+        offsets.push_back(json.size());
+
+        for (size_t i = 0; i + 2 < offsets.size(); i += 2) {
+            members.push_back(JsonMember{JsonSpan{json.data() + offsets[i], offsets[i + 1] - offsets[i]},
+                                         JsonSpan{json.data() + offsets[i + 1], offsets[i + 2] - offsets[i + 1]}});
+        }
+        return true;
+    }
+}
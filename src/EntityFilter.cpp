@@ -0,0 +1,141 @@
+#include "EntityFilter.h"
+#include "EntityCodec.h"
+#include <algorithm>
+
+namespace webofdata {
+
+    bool EntityFilter::ParseCondition(const string &expression, string &property, PropertyCondition &condition) {
+        auto opStart = expression.find_first_of("=<>");
+        property = expression.substr(0, opStart);
+        if (property.empty()) return false;
+        if (opStart == string::npos) {
+            condition.op = PropertyCondition::Exists;
+            return true;
+        }
+
+        auto valueStart = opStart + 1;
+        auto c = expression[opStart];
+        auto orEqual = valueStart < expression.length() && expression[valueStart] == '=';
+        if (c == '=') {
+            condition.op = PropertyCondition::Equals;
+        } else if (c == '<') {
+            condition.op = orEqual ? PropertyCondition::LessOrEqual : PropertyCondition::Less;
+        } else {
+            condition.op = orEqual ? PropertyCondition::GreaterOrEqual : PropertyCondition::Greater;
+        }
+        if (c != '=' && orEqual) valueStart++;
+
+        auto value = expression.substr(valueStart);
+        if (PropertyIndex::EncodeValue(IndexValueType::Number, value, condition.encoded)) {
+            condition.type = IndexValueType::Number;
+        } else if (PropertyIndex::EncodeValue(IndexValueType::Date, value, condition.encoded)) {
+            condition.type = IndexValueType::Date;
+        } else {
+            condition.type = IndexValueType::String;
+            PropertyIndex::EncodeValue(IndexValueType::String, value, condition.encoded);
+        }
+        return true;
+    }
+
+    bool EntityFilter::Meets(const PropertyCondition &condition, const JsonSpan &value) {
+        if (condition.op == PropertyCondition::Exists) {
+            return !(value.length == 4 && memcmp(value.data, "null", 4) == 0);
+        }
+
+        _elements.clear();
+        if (value.length > 0 && value.data[0] == '[') {
+            if (!EntityMerger::ScanElements(value.data, value.length, _elements)) return false;
+        } else {
+            _elements.push_back(value);
+        }
+
+        for (auto const &element : _elements) {
+            if (!PropertyIndex::EncodeJsonValue(element.data, element.length, condition.type, _encoded)) continue;
+            auto order = _encoded.compare(condition.encoded);
+            switch (condition.op) {
+                case PropertyCondition::Equals: if (order == 0) return true; break;
+                case PropertyCondition::Less: if (order < 0) return true; break;
+                case PropertyCondition::LessOrEqual: if (order <= 0) return true; break;
+                case PropertyCondition::Greater: if (order > 0) return true; break;
+                case PropertyCondition::GreaterOrEqual: if (order >= 0) return true; break;
+                default: break;
+            }
+        }
+        return false;
+    }
+
+    // true if the quoted member name is the property
+    static bool IsNamed(const JsonMember &member, const string &property) {
+        return member.name.length == property.length() + 2 &&
+               memcmp(member.name.data + 1, property.data(), property.length()) == 0;
+    }
+
+    bool EntityFilter::MeetsConditions(const vector<JsonMember> &members) {
+        for (auto const &condition : _conditions) {
+            auto member = std::find_if(members.begin(), members.end(), [&](const JsonMember &m) {
+                return IsNamed(m, condition.property);
+            });
+            if (member == members.end() || !Meets(condition, member->value)) return false;
+        }
+        return true;
+    }
+
+    bool EntityFilter::Apply(const rocksdb::Slice &entity, rocksdb::Slice &output) {
+        output = entity;
+        if (IsEmpty()) return true;
+
+        _members.clear();
+        if (!EntityMerger::ScanMembers(entity.data(), entity.size(), _members)) return false;
+        if (!MeetsConditions(_members)) return false;
+        return Project(_members, output);
+    }
+
+    bool EntityFilter::Apply(const rocksdb::Slice &entity, const vector<string> &names,
+                             const unordered_map<string, int> &numbers, rocksdb::Slice &output) {
+        if (!EntityCodec::IsBinary(entity)) return Apply(entity, output);
+        if (!Meets(entity, names, numbers)) return false;
+
+        _decoded.clear();
+        if (!EntityCodec::ToJson(entity, names, _decoded)) return false;
+        output = rocksdb::Slice(_decoded);
+        if (_fields.empty()) return true;
+
+        _members.clear();
+        if (!EntityMerger::ScanMembers(_decoded.data(), _decoded.size(), _members)) return false;
+        return Project(_members, output);
+    }
+
+    bool EntityFilter::Meets(const rocksdb::Slice &entity, const vector<string> &names,
+                             const unordered_map<string, int> &numbers) {
+        if (_conditions.empty()) return true;
+
+        _members.clear();
+        if (EntityCodec::IsBinary(entity)) {
+            if (!EntityCodec::FindMembers(entity, _conditionProperties, names, numbers, _values, _members)) return false;
+        } else if (!EntityMerger::ScanMembers(entity.data(), entity.size(), _members)) {
+            return false;
+        }
+        return MeetsConditions(_members);
+    }
+
+    bool EntityFilter::Project(const vector<JsonMember> &members, rocksdb::Slice &output) {
+        if (_fields.empty()) return true;
+
+        _projected.assign("{");
+        for (auto const &member : members) {
+            auto keep = member.name.length > 1 && member.name.data[1] == '@';
+            for (size_t i = 0; i < _fields.size() && !keep; i++) {
+                keep = IsNamed(member, _fields[i]);
+            }
+            if (!keep) continue;
+
+            if (_projected.size() > 1) _projected.push_back(',');
+            _projected.append(member.name.data, member.name.length);
+            _projected.push_back(':');
+            _projected.append(member.value.data, member.value.length);
+        }
+        _projected.push_back('}');
+        output = rocksdb::Slice(_projected);
+        return true;
+    }
+}
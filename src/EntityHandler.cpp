@@ -2,58 +2,8 @@
 
 namespace webofdata {
 
-    std::string httpStart("http");
-
-    string EntityHandler::AssertResourceId(string localResourceName) {
-
-        auto it = _localResourceToIdIndex.find(localResourceName);
-        if (it != _localResourceToIdIndex.end()) {
-            return it->second;
-        }
-
-        if (localResourceName.compare(0, httpStart.length(), httpStart) == 0) {
-            // find last hash or slash
-            auto foundAt = localResourceName.find_last_of('#');
-            if (foundAt != std::string::npos) {
-                // get prefix
-                auto prefix = localResourceName.substr(0, foundAt + 1);
-                auto name = localResourceName.substr(foundAt + 1);
-                // lookup expansion in namespace index
-                int nsid = AssertPrefixId(prefix);
-
-                auto rid = "ns" + std::to_string(nsid) + string(":") + name;
-                _localResourceToIdIndex[localResourceName] = rid;
-                return rid;
-            }
-
-            foundAt = localResourceName.find_last_of('/');
-            if (foundAt != std::string::npos) {
-                auto prefix = localResourceName.substr(0, foundAt + 1);
-                auto name = localResourceName.substr(foundAt + 1);
-                // lookup expansion in namespace index
-                int nsid = AssertPrefixId(prefix);
-                auto rid = "ns" + std::to_string(nsid) + string(":") + name;
-                _localResourceToIdIndex[localResourceName] = rid;
-                return rid;
-            }
-        }
-
-        // check if it contains a :
-        auto colonLocation = localResourceName.find_first_of(':');
-        if (colonLocation != std::string::npos) {
-            string prefix = localResourceName.substr(0, colonLocation);
-            string name = localResourceName.substr(colonLocation);
-            int nsid = AssertPrefixId(prefix);
-            auto rid = "ns" + std::to_string(nsid) + string(":") + name;
-            _localResourceToIdIndex[localResourceName] = rid;
-            return rid;
-        } else {
-            // resolve against context
-            int nsid = AssertPrefixId(this->_contextDefaultPrefix);
-            auto rid = "ns" + std::to_string(nsid) + string(":") + localResourceName;
-            _localResourceToIdIndex[localResourceName] = rid;
-            return rid;
-        }
+    static bool StartsWithHttp(const char *uri, size_t length) {
+        return length >= 4 && strncmp(uri, "http", 4) == 0;
     }
 
     int EntityHandler::AssertPrefixId(string prefix) {
@@ -67,97 +17,126 @@ namespace webofdata {
         }
     }
 
-    string EntityHandler::AssertPropertyId(string localProperty) {
+    int EntityHandler::ResolvePrefixId(const NamespaceTrie &trie, const char *prefix, size_t length) {
+        auto nsid = trie.Find(prefix, length);
+        if (nsid != -1) return nsid;
+        return AssertPrefixId(string(prefix, length));
+    }
 
-        auto it = _localPropertyToIdIndex.find(localProperty);
-        if (it != _localPropertyToIdIndex.end()) {
-            return it->second;
+    int EntityHandler::GetContextDefaultPrefixId() {
+        if (_contextDefaultPrefixId == -1) {
+            _contextDefaultPrefixId = AssertPrefixId(_contextDefaultPrefix);
         }
+        return _contextDefaultPrefixId;
+    }
 
-        if (localProperty.compare(0, httpStart.length(), httpStart) == 0) {
-            // find last hash or slash
-            auto foundAt = localProperty.find_last_of('#');
-            if (foundAt != std::string::npos) {
-                // get prefix
-                auto prefix = localProperty.substr(0, foundAt);
-                auto name = localProperty.substr(foundAt);
-                // lookup expansion in namespace index
-                int nsid = AssertPrefixId(prefix);
-                auto pid = "ns" + std::to_string(nsid) + string(":") + name;
-                _localPropertyToIdIndex[localProperty] = pid;
-                return pid;
+    const string& EntityHandler::AssertResourceId(const char *uri, size_t length) {
+        auto trie = _store->GetNamespaceTrie();
+
+        if (StartsWithHttp(uri, length)) {
+            // the namespace runs up to and including the last hash, or failing that the last slash
+            auto match = trie->MatchLastSeparator(uri, length);
+            if (match.separator != std::string::npos) {
+                auto nameOffset = match.separator + 1;
+                int nsid = match.prefixId;
+                if (nsid == -1) {
+                    nsid = AssertPrefixId(string(uri, nameOffset));
+                }
+                WriteNamespacedId(_idBuffer, nsid, uri + nameOffset, length - nameOffset);
+                return _idBuffer;
             }
+        }
+
+        // check if it contains a :
+        auto colon = (const char *) memchr(uri, ':', length);
+        if (colon != nullptr) {
+            size_t colonLocation = colon - uri;
+            int nsid = ResolvePrefixId(*trie, uri, colonLocation);
+            WriteNamespacedId(_idBuffer, nsid, uri + colonLocation, length - colonLocation);
+        } else {
+            // resolve against context
+            WriteNamespacedId(_idBuffer, GetContextDefaultPrefixId(), uri, length);
+        }
+        return _idBuffer;
+    }
 
-            foundAt = localProperty.find_last_of('/');
-            if (foundAt != std::string::npos) {
-                auto prefix = localProperty.substr(0, foundAt);
-                auto name = localProperty.substr(foundAt);
-                // lookup expansion in namespace index
-                int nsid = AssertPrefixId(prefix);
-                auto pid = "ns" + std::to_string(nsid) + string(":") + name;
-                _localPropertyToIdIndex[localProperty] = pid;
-                return pid;
+    const string& EntityHandler::AssertPropertyId(const char *uri, size_t length) {
+        auto trie = _store->GetNamespaceTrie();
+
+        if (StartsWithHttp(uri, length)) {
+            // for properties the separator stays with the name
+            auto match = trie->MatchLastSeparator(uri, length);
+            if (match.separator != std::string::npos) {
+                int nsid = match.baseId;
+                if (nsid == -1) {
+                    nsid = AssertPrefixId(string(uri, match.separator));
+                }
+                WriteNamespacedId(_idBuffer, nsid, uri + match.separator, length - match.separator);
+                return _idBuffer;
             }
         }
 
         // check if it contains a :
-        auto colonLocation = localProperty.find_first_of(':');
-        if (colonLocation != std::string::npos) {
-            string prefix = localProperty.substr(0, colonLocation);
-            string name = localProperty.substr(colonLocation + 1);
-            int nsid = AssertPrefixId(prefix);
-            auto rid = "ns" + std::to_string(nsid) + string(":") + name;
-            _localPropertyToIdIndex[localProperty] = rid;
-            return rid;
+        auto colon = (const char *) memchr(uri, ':', length);
+        if (colon != nullptr) {
+            size_t colonLocation = colon - uri;
+            int nsid = ResolvePrefixId(*trie, uri, colonLocation);
+            WriteNamespacedId(_idBuffer, nsid, uri + colonLocation + 1, length - colonLocation - 1);
         } else {
             // resolve againt context
-            int nsid = AssertPrefixId(this->_contextDefaultPrefix);
-            auto rid = "ns" + std::to_string(nsid) + string(":") + localProperty;
-            _localPropertyToIdIndex[localProperty] = rid;
-            return rid;
+            WriteNamespacedId(_idBuffer, GetContextDefaultPrefixId(), uri, length);
         }
+        return _idBuffer;
     }
 
     void EntityHandler::WriteKey() {
-        _writer->Key(_currentNsKey.data());
+        _writer->Key(_currentNsKey.data(), (SizeType) _currentNsKey.length());
     }
 
     bool EntityHandler::Null() {
+        if (_inContinuationEntity) return true;
         _writer->Null();
         return true;
     }
 
     bool EntityHandler::Bool(bool b) {
+        if (_inContinuationEntity) return true;
         _writer->Bool(b);
         return true;
     }
 
     bool EntityHandler::Int(int i) {
+        if (_inContinuationEntity) return true;
         _writer->Int(i);
         return true;
     }
 
     bool EntityHandler::Uint(unsigned u) {
+        if (_inContinuationEntity) return true;
         _writer->Uint(u);
         return true;
     }
 
     bool EntityHandler::Int64(int64_t i) {
+        if (_inContinuationEntity) return true;
         _writer->Int64(i);
         return true;
     }
 
     bool EntityHandler::Uint64(uint64_t u) {
+        if (_inContinuationEntity) return true;
         _writer->Uint64(u);
         return true;
     }
 
     bool EntityHandler::Double(double d) {
+        if (_inContinuationEntity) return true;
         _writer->Double(d);
         return true;
     }
 
     bool EntityHandler::String(const char *str, SizeType length, bool copy) {
+        if (_inContinuationEntity) return true;
         if (_inIdProperty) {
             if (strcmp(str, "@context") == 0) {
                 _inContextEntity = true;
@@ -167,10 +146,18 @@ namespace webofdata {
                 _newJson->Clear();
                 _writer->Reset(*_newJson);
 
+                return true;
+            } else if (strcmp(str, "@continuation") == 0) {
+                // continuation entities only mean something to readers of a stream, they are not stored.
+                // what was written of it goes, the rest is skipped until it ends
+                _inContinuationEntity = true;
+                _inIdProperty = false;
+                _newJson->Clear();
+                _writer->Reset(*_newJson);
                 return true;
             } else {
-                _currentRid = AssertResourceId(str);
-                _writer->String(_currentRid.data());
+                _currentRid = AssertResourceId(str, length);
+                _writer->String(_currentRid.data(), (SizeType) _currentRid.length());
                 _inIdProperty = false;
                 return true;
             }
@@ -179,6 +166,7 @@ namespace webofdata {
                 // take the expansion and assert it as a namespace in the store
                 if (_currentKey == "_") {
                     _contextDefaultPrefix = str;
+                    _contextDefaultPrefixId = -1;
                 } else {
                     auto nsid = _store->AssertNamespace(str);
                     _context[_currentKey] = nsid;
@@ -186,13 +174,16 @@ namespace webofdata {
             } else {
                 if (str[0] == '<' && str[length - 1] == '>') {
                     // make reference value
-                    auto refId = AssertResourceId(string(&str[1], length - 2));
-                    auto refValue = string("<") + refId + string(">");
-                    _writer->String(refValue.data());
+                    auto &refId = AssertResourceId(&str[1], length - 2);
+                    _refBuffer.clear();
+                    _refBuffer.push_back('<');
+                    _refBuffer.append(refId);
+                    _refBuffer.push_back('>');
+                    _writer->String(_refBuffer.data(), (SizeType) _refBuffer.length());
 
                     if (_objDepth == 1) {
                         // add reference
-                        _currentRefs.push_back(std::pair<string, string>(_currentNsKey, refId));
+                        _currentRefs.emplace_back(_currentNsKey, refId);
                     }
                 } else {
                     _writer->String(str, length, copy);
@@ -204,12 +195,15 @@ namespace webofdata {
 
     bool EntityHandler::StartObject() {
         _objDepth++;
+        if (_inContinuationEntity) return true;
         _writer->StartObject();
         return true;
     }
 
     bool EntityHandler::Key(const char *str, SizeType length, bool copy) {
-        _currentKey = string(str);
+        // the members of a continuation entity are not properties of the store
+        if (_inContinuationEntity) return true;
+        _currentKey.assign(str, length);
         if (strcmp(str, "@id") == 0) {
             _inIdProperty = true;
             _currentNsKey = "@id";
@@ -221,7 +215,7 @@ namespace webofdata {
             } else if (_inContextEntity && _inNamespaceSection) {
                 return true;
             } else {
-                _currentNsKey = AssertPropertyId(_currentKey);
+                _currentNsKey = AssertPropertyId(str, length);
                 WriteKey();
             }
         }
@@ -235,6 +229,7 @@ namespace webofdata {
 
             if (_contextDefaultPrefix.empty()) {
                 _contextDefaultPrefix = "http://data.wod.io/types/";
+                _contextDefaultPrefixId = -1;
             }
 
             _inNamespaceSection = false;
@@ -248,21 +243,39 @@ namespace webofdata {
             return true;
         }
 
+        if (_inContinuationEntity) {
+            if (_objDepth == 0) {
+                _inContinuationEntity = false;
+                _currentRefs.clear();
+                _newJson->Clear();
+                _writer->Reset(*_newJson);
+            }
+            return true;
+        }
+
         _writer->EndObject();
 
         if (_objDepth == 0) {
             _entityCount++;
             _newJson->Flush();
             auto json = string(_newJson->GetString());
+
+            // a second version of an entity must see the refs of the first, so the first is committed
+            if (!_batchIds.insert(_currentRid).second) {
+                Flush();
+                _batchIds.insert(_currentRid);
+            }
+
             _store->WriteEntity(_writeBatch, _dataset, json, _currentRid, _currentRefs);
             _batchCount++;
             _currentRefs.clear();
 
             if (this->_batchCount >= 100) {
-                string name("");
+                string name(_dataset->GetName());
                 _store->WriteBatch(name, _entityCount, _writeBatch);
                 _writeBatch->Clear();
                 _batchCount = 0;
+                _batchIds.clear();
             }
 
             // reset state ready for next entity...
@@ -275,11 +288,12 @@ namespace webofdata {
 
     void EntityHandler::Flush() {
         if (_batchCount > 0) {
-            string name("");
+            string name(_dataset->GetName());
             _store->WriteBatch(name, _entityCount, _writeBatch);
             _writeBatch->Clear();
             _batchCount = 0;
         }
+        _batchIds.clear();
     }
 
     bool EntityHandler::StartArray() {
@@ -290,6 +304,7 @@ namespace webofdata {
         }
 
         _arrayDepth++;
+        if (_inContinuationEntity) return true;
         _writer->StartArray();
         return true;
     }
@@ -297,6 +312,7 @@ namespace webofdata {
     bool EntityHandler::EndArray(SizeType elementCount) {
         _arrayDepth--;
         if (_arrayDepth < 0) return true; // this is the outer array.
+        if (_inContinuationEntity) return true;
 
         _writer->EndArray();
         return true;
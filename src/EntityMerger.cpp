@@ -0,0 +1,228 @@
+#include "EntityMerger.h"
+#include <algorithm>
+#include <unordered_map>
+
+extern "C" {
+    #include "xxhash.h"
+}
+
+namespace webofdata {
+
+    static const char *SkipWhitespace(const char *p, const char *end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+        return p;
+    }
+
+    // p is on the opening quote, returns the position after the closing quote or nullptr
+    static const char *SkipString(const char *p, const char *end) {
+        for (p++; p < end; p++) {
+            if (*p == '\\') {
+                p++;
+            } else if (*p == '"') {
+                return p + 1;
+            }
+        }
+        return nullptr;
+    }
+
+    // returns the position after the value starting at p or nullptr
+    static const char *SkipValue(const char *p, const char *end) {
+        if (p >= end) return nullptr;
+        if (*p == '"') return SkipString(p, end);
+
+        if (*p == '{' || *p == '[') {
+            int depth = 0;
+            while (p < end) {
+                if (*p == '"') {
+                    p = SkipString(p, end);
+                    if (p == nullptr) return nullptr;
+                    continue;
+                }
+                if (*p == '{' || *p == '[') depth++;
+                if (*p == '}' || *p == ']') {
+                    depth--;
+                    if (depth == 0) return p + 1;
+                }
+                p++;
+            }
+            return nullptr;
+        }
+
+        // number, true, false or null
+        auto start = p;
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t') p++;
+        return p == start ? nullptr : p;
+    }
+
+    bool EntityMerger::ScanMembers(const char *json, size_t length, vector<JsonMember> &members) {
+        auto end = json + length;
+        auto p = SkipWhitespace(json, end);
+        if (p == end || *p != '{') return false;
+        p = SkipWhitespace(p + 1, end);
+        if (p < end && *p == '}') return true;
+
+        while (p < end) {
+            if (*p != '"') return false;
+            auto nameEnd = SkipString(p, end);
+            if (nameEnd == nullptr) return false;
+            JsonSpan name{p, (size_t) (nameEnd - p)};
+
+            p = SkipWhitespace(nameEnd, end);
+            if (p == end || *p != ':') return false;
+            p = SkipWhitespace(p + 1, end);
+
+            auto valueEnd = SkipValue(p, end);
+            if (valueEnd == nullptr) return false;
+            members.push_back(JsonMember{name, JsonSpan{p, (size_t) (valueEnd - p)}});
+
+            p = SkipWhitespace(valueEnd, end);
+            if (p == end) return false;
+            if (*p == '}') return true;
+            if (*p != ',') return false;
+            p = SkipWhitespace(p + 1, end);
+        }
+        return false;
+    }
+
+    bool EntityMerger::ScanElements(const char *json, size_t length, vector<JsonSpan> &elements) {
+        auto end = json + length;
+        auto p = SkipWhitespace(json, end);
+        if (p == end || *p != '[') return false;
+        p = SkipWhitespace(p + 1, end);
+        if (p < end && *p == ']') return true;
+
+        while (p < end) {
+            auto valueEnd = SkipValue(p, end);
+            if (valueEnd == nullptr) return false;
+            elements.push_back(JsonSpan{p, (size_t) (valueEnd - p)});
+
+            p = SkipWhitespace(valueEnd, end);
+            if (p == end) return false;
+            if (*p == ']') return true;
+            if (*p != ',') return false;
+            p = SkipWhitespace(p + 1, end);
+        }
+        return false;
+    }
+
+    static bool NameLess(const JsonSpan &a, const JsonSpan &b) {
+        int c = memcmp(a.data, b.data, std::min(a.length, b.length));
+        return c != 0 ? c < 0 : a.length < b.length;
+    }
+
+    // working storage reused between merges on the same thread
+    struct MergeScratch {
+        vector<vector<JsonMember>> members;      // per partial, sorted by name
+        vector<pair<size_t, size_t>> heap;       // (partial, member index) cursors
+        vector<JsonSpan> values;                 // distinct values of the property being merged
+        vector<JsonSpan> elements;               // elements of an array value
+        unordered_map<unsigned long long, size_t> seen; // value hash -> index in values
+    };
+
+    // adds value unless an equal one is already in values
+    static void AddDistinct(MergeScratch &scratch, const JsonSpan &value) {
+        auto hash = XXH64(value.data, value.length, 0);
+        auto found = scratch.seen.find(hash);
+        if (found == scratch.seen.end()) {
+            scratch.seen.emplace(hash, scratch.values.size());
+            scratch.values.push_back(value);
+        } else if (!(scratch.values[found->second] == value)) {
+            // a collision, fall back to comparing the bytes
+            if (std::find(scratch.values.begin(), scratch.values.end(), value) == scratch.values.end()) {
+                scratch.values.push_back(value);
+            }
+        }
+    }
+
+    bool EntityMerger::Merge(const vector<rocksdb::Slice> &partials, string &output) {
+        thread_local MergeScratch scratch;
+
+        auto count = partials.size();
+        if (scratch.members.size() < count) {
+            scratch.members.resize(count);
+        }
+
+        // property keys are normalised nsN: ids so each partial only needs a small sort
+        for (size_t i = 0; i < count; i++) {
+            auto &members = scratch.members[i];
+            members.clear();
+            if (!ScanMembers(partials[i].data(), partials[i].size(), members)) return false;
+            std::sort(members.begin(), members.end(), [](const JsonMember &a, const JsonMember &b) {
+                return NameLess(a.name, b.name);
+            });
+        }
+
+        // k-way merge, the heap yields the smallest name and, for equal names, the earliest partial
+        auto &heap = scratch.heap;
+        auto &sorted = scratch.members;
+        auto cursorGreater = [&sorted](const pair<size_t, size_t> &a, const pair<size_t, size_t> &b) {
+            auto const &nameA = sorted[a.first][a.second].name;
+            auto const &nameB = sorted[b.first][b.second].name;
+            if (NameLess(nameB, nameA)) return true;
+            if (NameLess(nameA, nameB)) return false;
+            return a.first > b.first;
+        };
+
+        heap.clear();
+        for (size_t i = 0; i < count; i++) {
+            if (!scratch.members[i].empty()) {
+                heap.emplace_back(i, 0);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), cursorGreater);
+
+        output.push_back('{');
+        bool firstProperty = true;
+        while (!heap.empty()) {
+            JsonSpan name = scratch.members[heap.front().first][heap.front().second].name;
+            scratch.values.clear();
+            scratch.seen.clear();
+            bool isArray = false;
+
+            // take this property from every partial that has it
+            while (!heap.empty()) {
+                auto cursor = heap.front();
+                auto const &member = scratch.members[cursor.first][cursor.second];
+                if (!(member.name == name)) break;
+
+                std::pop_heap(heap.begin(), heap.end(), cursorGreater);
+                heap.pop_back();
+
+                if (member.value.length > 0 && member.value.data[0] == '[') {
+                    isArray = true;
+                    scratch.elements.clear();
+                    if (!ScanElements(member.value.data, member.value.length, scratch.elements)) return false;
+                    for (auto const &element : scratch.elements) {
+                        AddDistinct(scratch, element);
+                    }
+                } else {
+                    AddDistinct(scratch, member.value);
+                }
+
+                if (cursor.second + 1 < scratch.members[cursor.first].size()) {
+                    heap.emplace_back(cursor.first, cursor.second + 1);
+                    std::push_heap(heap.begin(), heap.end(), cursorGreater);
+                }
+            }
+
+            if (!firstProperty) output.push_back(',');
+            firstProperty = false;
+            output.append(name.data, name.length);
+            output.push_back(':');
+
+            auto const &values = scratch.values;
+            if (!isArray && values.size() == 1) {
+                output.append(values[0].data, values[0].length);
+            } else {
+                output.push_back('[');
+                for (size_t v = 0; v < values.size(); v++) {
+                    if (v > 0) output.push_back(',');
+                    output.append(values[v].data, values[v].length);
+                }
+                output.push_back(']');
+            }
+        }
+        output.push_back('}');
+        return true;
+    }
+}
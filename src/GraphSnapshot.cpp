@@ -0,0 +1,814 @@
+#include "GraphSnapshot.h"
+#include "Parallel.h"
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <queue>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace webofdata {
+
+    using namespace rapidjson;
+
+    static const char GraphMagic[8] = {'W', 'O', 'D', 'C', 'S', 'R', '0', '1'};
+
+    // header, then row offsets and id offsets (uint64, nodeCount + 1 each), targets (uint32),
+    // the id bytes and the sources (count, then name length, name and sequence for each)
+    struct GraphFileHeader {
+        char magic[8];
+        uint64_t nodeCount;
+        uint64_t edgeCount;
+        uint64_t idBytes;
+        uint64_t sourceBytes;
+    };
+
+    class GraphFile {
+    private:
+        void *_mapping = MAP_FAILED;
+        size_t _size = 0;
+
+    public:
+        uint64_t nodeCount = 0;
+        uint64_t edgeCount = 0;
+        const uint64_t *rowOffsets = nullptr;
+        const uint64_t *idOffsets = nullptr;
+        const uint32_t *targets = nullptr;
+        const char *ids = nullptr;
+        vector<GraphSource> sources;
+
+        ~GraphFile() {
+            if (_mapping != MAP_FAILED) {
+                munmap(_mapping, _size);
+            }
+        }
+
+        static shared_ptr<GraphFile> Open(const string &path) {
+            auto file = make_shared<GraphFile>();
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw GraphException("Unable to open graph file " + path);
+            }
+
+            struct stat info;
+            if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(GraphFileHeader)) {
+                close(fd);
+                throw GraphException("Graph file is truncated " + path);
+            }
+
+            file->_size = (size_t) info.st_size;
+            file->_mapping = mmap(nullptr, file->_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (file->_mapping == MAP_FAILED) {
+                throw GraphException("Unable to map graph file " + path);
+            }
+
+            auto base = (const char *) file->_mapping;
+            GraphFileHeader header;
+            memcpy(&header, base, sizeof(header));
+            if (memcmp(header.magic, GraphMagic, sizeof(GraphMagic)) != 0) {
+                throw GraphException("Not a graph file " + path);
+            }
+
+            auto expected = sizeof(header) + 2 * (header.nodeCount + 1) * sizeof(uint64_t)
+                            + header.edgeCount * sizeof(uint32_t) + header.idBytes + header.sourceBytes;
+            if (expected != file->_size) {
+                throw GraphException("Graph file is truncated " + path);
+            }
+
+            file->nodeCount = header.nodeCount;
+            file->edgeCount = header.edgeCount;
+            auto p = base + sizeof(header);
+            file->rowOffsets = (const uint64_t *) p;
+            p += (header.nodeCount + 1) * sizeof(uint64_t);
+            file->idOffsets = (const uint64_t *) p;
+            p += (header.nodeCount + 1) * sizeof(uint64_t);
+            file->targets = (const uint32_t *) p;
+            p += header.edgeCount * sizeof(uint32_t);
+            file->ids = p;
+            p += header.idBytes;
+
+            // the counts and lengths are read from the file, each is checked against what is left of the sources
+            auto end = p + header.sourceBytes;
+            uint32_t count, length;
+            if (header.sourceBytes < sizeof(count)) {
+                throw GraphException("Graph file has a malformed source list " + path);
+            }
+            memcpy(&count, p, sizeof(count));
+            p += sizeof(count);
+            for (uint32_t i = 0; i < count; i++) {
+                GraphSource source;
+                if ((size_t) (end - p) < sizeof(length)) {
+                    throw GraphException("Graph file has a malformed source list " + path);
+                }
+                memcpy(&length, p, sizeof(length));
+                p += sizeof(length);
+                if ((size_t) (end - p) < (size_t) length + sizeof(source.sequence)) {
+                    throw GraphException("Graph file has a malformed source list " + path);
+                }
+                source.dataset.assign(p, length);
+                p += length;
+                memcpy(&source.sequence, p, sizeof(source.sequence));
+                p += sizeof(source.sequence);
+                file->sources.push_back(source);
+            }
+            return file;
+        }
+
+        rocksdb::Slice GetId(uint64_t number) const {
+            return rocksdb::Slice(ids + idOffsets[number], idOffsets[number + 1] - idOffsets[number]);
+        }
+    };
+
+    // ids interned by one build worker, numbered in the order they were first seen
+    struct WorkerGraph {
+        unordered_map<string, uint32_t> numbers;
+        vector<const string *> ids;
+        vector<pair<uint32_t, uint32_t>> edges;
+
+        uint32_t Intern(const char *data, size_t length) {
+            auto inserted = numbers.emplace(string(data, length), (uint32_t) ids.size());
+            if (inserted.second) {
+                ids.push_back(&inserted.first->first);
+            }
+            return inserted.first->second;
+        }
+    };
+
+    // outrefs keys start idlen : id, the value is the related id
+    static bool ReadRefSource(const rocksdb::Slice &key, const char *&id, size_t &length) {
+        int size_id;
+        if (key.size() < sizeof(size_id)) return false;
+        memcpy(&size_id, key.data(), sizeof(size_id));
+        if (size_id < 0 || key.size() < sizeof(size_id) + size_id) return false;
+        id = key.data() + sizeof(size_id);
+        length = (size_t) size_id;
+        return true;
+    }
+
+    static string MakeRefSourcePrefix(const string &id) {
+        int size_id = id.length();
+        string key((const char *) &size_id, sizeof(size_id));
+        key.append(id);
+        return key;
+    }
+
+    // sorts and dedupes each row in place, then closes the gaps
+    static void CompactRows(vector<uint64_t> &offsets, vector<uint32_t> &targets, int workers) {
+        auto nodes = offsets.size() - 1;
+        vector<uint64_t> lengths(nodes);
+        ParallelForEach(nodes, workers, 4096, [&](size_t begin, size_t end, int worker) {
+            for (auto n = begin; n < end; n++) {
+                auto first = targets.begin() + offsets[n];
+                auto last = targets.begin() + offsets[n + 1];
+                std::sort(first, last);
+                lengths[n] = (uint64_t) (std::unique(first, last) - first);
+            }
+        });
+
+        uint64_t next = 0;
+        for (size_t n = 0; n < nodes; n++) {
+            auto start = offsets[n];
+            offsets[n] = next;
+            if (start != next) {
+                std::move(targets.begin() + start, targets.begin() + start + lengths[n], targets.begin() + next);
+            }
+            next += lengths[n];
+        }
+        offsets[nodes] = next;
+        targets.resize(next);
+    }
+
+    shared_ptr<GraphSnapshot> GraphSnapshot::Build(rocksdb::DB *db, const vector<GraphSource> &sources,
+                                                   const vector<GraphScanRange> &ranges, const string &path,
+                                                   int workers, const atomic<bool> &cancelled) {
+        // scan: each worker interns the ids it meets to its own numbers
+        vector<WorkerGraph> local((size_t) std::max(workers, 1));
+        ParallelForEach(ranges.size(), workers, 1, [&](size_t begin, size_t end, int worker) {
+            auto &graph = local[worker];
+            rocksdb::ReadOptions readOptions;
+            readOptions.fill_cache = false;
+
+            for (auto r = begin; r < end && !cancelled; r++) {
+                auto const &range = ranges[r];
+                unique_ptr<rocksdb::Iterator> it(db->NewIterator(readOptions, sources[range.source].outRefs));
+                rocksdb::Slice endKey(range.end);
+                for (range.begin.empty() ? it->SeekToFirst() : it->Seek(range.begin);
+                     it->Valid() && (range.end.empty() || it->key().compare(endKey) < 0) && !cancelled;
+                     it->Next()) {
+                    const char *id;
+                    size_t length;
+                    if (!ReadRefSource(it->key(), id, length)) continue;
+                    auto source = graph.Intern(id, length);
+                    auto target = graph.Intern(it->value().data(), it->value().size());
+                    graph.edges.emplace_back(source, target);
+                }
+            }
+        });
+
+        if (cancelled) {
+            throw GraphException("Graph build cancelled");
+        }
+
+        // number every id in id order and map each worker's numbers onto that
+        vector<string> ids;
+        for (auto const &graph : local) {
+            for (auto id : graph.ids) {
+                ids.push_back(*id);
+            }
+        }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        if (ids.size() >= NoNode) {
+            throw GraphException("Graph has too many nodes");
+        }
+
+        vector<vector<uint32_t>> numbers(local.size());
+        ParallelForEach(local.size(), workers, 1, [&](size_t begin, size_t end, int worker) {
+            for (auto w = begin; w < end; w++) {
+                numbers[w].reserve(local[w].ids.size());
+                for (auto id : local[w].ids) {
+                    numbers[w].push_back((uint32_t) (std::lower_bound(ids.begin(), ids.end(), *id) - ids.begin()));
+                }
+            }
+        });
+
+        // count, place and then sort and dedupe the rows, the same ref can be in several datasets
+        vector<uint64_t> offsets(ids.size() + 1, 0);
+        for (size_t w = 0; w < local.size(); w++) {
+            for (auto const &edge : local[w].edges) {
+                offsets[numbers[w][edge.first] + 1]++;
+            }
+        }
+        for (size_t n = 0; n < ids.size(); n++) {
+            offsets[n + 1] += offsets[n];
+        }
+
+        vector<uint32_t> targets(offsets.back());
+        vector<uint64_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (size_t w = 0; w < local.size(); w++) {
+            for (auto const &edge : local[w].edges) {
+                targets[cursor[numbers[w][edge.first]]++] = numbers[w][edge.second];
+            }
+            local[w] = WorkerGraph();
+        }
+
+        CompactRows(offsets, targets, workers);
+        return Write(path, ids, offsets, targets, sources);
+    }
+
+    // flushes a file or directory to disk
+    static bool SyncPath(const string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        auto synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+    }
+
+    shared_ptr<GraphSnapshot> GraphSnapshot::Write(const string &path, const vector<string> &sortedIds,
+                                                   const vector<uint64_t> &offsets, const vector<uint32_t> &targets,
+                                                   const vector<GraphSource> &sources) {
+        // written beside the live file and renamed over it, a mapping of the old file stays valid. each write
+        // has its own temporary so two writers never interleave in one file
+        static atomic<uint64_t> writes(0);
+        auto temporary = path + ".tmp." + to_string(getpid()) + "." + to_string(++writes);
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+
+            string sourceBytes;
+            uint32_t count = (uint32_t) sources.size();
+            sourceBytes.append((const char *) &count, sizeof(count));
+            for (auto const &source : sources) {
+                uint32_t length = (uint32_t) source.dataset.size();
+                sourceBytes.append((const char *) &length, sizeof(length));
+                sourceBytes.append(source.dataset);
+                sourceBytes.append((const char *) &source.sequence, sizeof(source.sequence));
+            }
+
+            vector<uint64_t> idOffsets;
+            idOffsets.reserve(sortedIds.size() + 1);
+            uint64_t idBytes = 0;
+            for (auto const &id : sortedIds) {
+                idOffsets.push_back(idBytes);
+                idBytes += id.size();
+            }
+            idOffsets.push_back(idBytes);
+
+            GraphFileHeader header;
+            memcpy(header.magic, GraphMagic, sizeof(GraphMagic));
+            header.nodeCount = sortedIds.size();
+            header.edgeCount = targets.size();
+            header.idBytes = idBytes;
+            header.sourceBytes = sourceBytes.size();
+
+            out.write((const char *) &header, sizeof(header));
+            out.write((const char *) offsets.data(), offsets.size() * sizeof(uint64_t));
+            out.write((const char *) idOffsets.data(), idOffsets.size() * sizeof(uint64_t));
+            out.write((const char *) targets.data(), targets.size() * sizeof(uint32_t));
+            for (auto const &id : sortedIds) {
+                out.write(id.data(), id.size());
+            }
+            out.write(sourceBytes.data(), sourceBytes.size());
+            out.close();
+            if (!out) {
+                std::remove(temporary.c_str());
+                throw GraphException("Unable to write graph file " + temporary);
+            }
+        }
+
+        // the contents are on disk before the rename makes them the graph, and the rename is before this returns
+        if (!SyncPath(temporary)) {
+            std::remove(temporary.c_str());
+            throw GraphException("Unable to sync graph file " + temporary);
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            throw GraphException("Unable to replace graph file " + path);
+        }
+        auto slash = path.rfind('/');
+        auto directory = slash == string::npos ? string(".") : path.substr(0, slash == 0 ? 1 : slash);
+        if (!SyncPath(directory)) {
+            throw GraphException("Unable to sync graph directory " + directory);
+        }
+
+        auto snapshot = Open(path);
+        // the caller's sources carry the column families
+        snapshot->_sources = sources;
+        return snapshot;
+    }
+
+    shared_ptr<GraphSnapshot> GraphSnapshot::Open(const string &path) {
+        shared_ptr<GraphSnapshot> snapshot(new GraphSnapshot());
+        auto file = GraphFile::Open(path);
+        snapshot->_sources = file->sources;
+        snapshot->_file = file;
+        snapshot->_path = path;
+        snapshot->_edgeCount = file->edgeCount;
+        return snapshot;
+    }
+
+    size_t GraphSnapshot::GetNodeCount() const {
+        return _file->nodeCount + _extraIds.size();
+    }
+
+    size_t GraphSnapshot::GetEdgeCount() const {
+        return _edgeCount;
+    }
+
+    string GraphSnapshot::GetId(uint32_t number) const {
+        if (number < _file->nodeCount) {
+            return _file->GetId(number).ToString();
+        }
+        return _extraIds[number - _file->nodeCount];
+    }
+
+    void GraphSnapshot::GetRow(uint32_t number, const uint32_t *&begin, const uint32_t *&end) const {
+        if (!_rowIndex.empty() && _rowIndex[number] != nullptr) {
+            begin = _rowIndex[number]->data();
+            end = begin + _rowIndex[number]->size();
+        } else if (number < _file->nodeCount) {
+            begin = _file->targets + _file->rowOffsets[number];
+            end = _file->targets + _file->rowOffsets[number + 1];
+        } else {
+            begin = end = nullptr;
+        }
+    }
+
+    uint32_t GraphSnapshot::FindNumber(const string &id) const {
+        // ids in the file are sorted
+        uint64_t low = 0;
+        uint64_t high = _file->nodeCount;
+        rocksdb::Slice key(id);
+        while (low < high) {
+            auto middle = low + (high - low) / 2;
+            auto c = _file->GetId(middle).compare(key);
+            if (c == 0) return (uint32_t) middle;
+            if (c < 0) low = middle + 1; else high = middle;
+        }
+
+        auto extra = _extraNumbers.find(id);
+        return extra == _extraNumbers.end() ? NoNode : extra->second;
+    }
+
+    uint32_t GraphSnapshot::Intern(const string &id) {
+        auto number = FindNumber(id);
+        if (number != NoNode) {
+            return number;
+        }
+        number = (uint32_t) GetNodeCount();
+        _extraIds.push_back(id);
+        _extraNumbers[id] = number;
+        return number;
+    }
+
+    shared_ptr<GraphSnapshot> GraphSnapshot::Refresh(rocksdb::DB *db, const vector<GraphSource> &sources, size_t &refreshed) const {
+        shared_ptr<GraphSnapshot> next(new GraphSnapshot(*this));
+        next->_sources = sources;
+
+        rocksdb::ReadOptions readOptions;
+        readOptions.fill_cache = false;
+
+        // sources carry the sequence every log entry up to is committed, entries above it are left to the
+        // next refresh. log keys lead with the native endian sequence, which does not sort by number, so a
+        // short run of sequences is sought one by one and a long one read by scanning the whole log
+        unordered_set<string> changed;
+        for (auto &source : next->_sources) {
+            unsigned long from = 0;
+            for (auto const &previous : _sources) {
+                if (previous.dataset == source.dataset) from = previous.sequence;
+            }
+            auto to = source.sequence;
+            if (to <= from) {
+                source.sequence = from;
+                continue;
+            }
+
+            uint64_t logKeys = 0;
+            db->GetIntProperty(source.log, "rocksdb.estimate-num-keys", &logKeys);
+            unique_ptr<rocksdb::Iterator> it(db->NewIterator(readOptions, source.log));
+            if (to - from < logKeys / 16) {
+                for (auto sequence = from + 1; sequence <= to; sequence++) {
+                    rocksdb::Slice prefix((const char *) &sequence, sizeof(sequence));
+                    it->Seek(prefix);
+                    if (it->Valid() && it->key().starts_with(prefix)) {
+                        changed.emplace(it->value().data(), it->value().size());
+                    }
+                }
+            } else {
+                for (it->SeekToFirst(); it->Valid(); it->Next()) {
+                    unsigned long sequence;
+                    if (it->key().size() < sizeof(sequence)) continue;
+                    memcpy(&sequence, it->key().data(), sizeof(sequence));
+                    if (sequence > from && sequence <= to) {
+                        changed.emplace(it->value().data(), it->value().size());
+                    }
+                }
+            }
+        }
+
+        // replace the row of each changed entity with its refs as they are now
+        vector<uint32_t> row;
+        for (auto const &id : changed) {
+            row.clear();
+            auto prefix = MakeRefSourcePrefix(id);
+            for (auto const &source : next->_sources) {
+                unique_ptr<rocksdb::Iterator> it(db->NewIterator(readOptions, source.outRefs));
+                for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+                    row.push_back(next->Intern(it->value().ToString()));
+                }
+            }
+            std::sort(row.begin(), row.end());
+            row.erase(std::unique(row.begin(), row.end()), row.end());
+
+            auto number = next->Intern(id);
+            auto existing = next->_rows.find(number);
+            if (existing != next->_rows.end()) {
+                next->_edgeCount -= existing->second->size();
+                next->_overlayEdges -= existing->second->size();
+            } else if (number < _file->nodeCount) {
+                next->_edgeCount -= _file->rowOffsets[number + 1] - _file->rowOffsets[number];
+            }
+            next->_edgeCount += row.size();
+            next->_overlayEdges += row.size();
+            next->_rows[number] = make_shared<const vector<uint32_t>>(row);
+        }
+        refreshed = changed.size();
+
+        next->_rowIndex.assign(next->GetNodeCount(), nullptr);
+        for (auto const &entry : next->_rows) {
+            next->_rowIndex[entry.first] = entry.second.get();
+        }
+
+        if (next->_overlayEdges > 1024 && next->_overlayEdges > _file->edgeCount / 10) {
+            return next->Compact();
+        }
+        return next;
+    }
+
+    shared_ptr<GraphSnapshot> GraphSnapshot::Compact() const {
+        // renumber in id order, overlay ids included
+        auto nodes = GetNodeCount();
+        vector<string> ids(nodes);
+        for (uint32_t n = 0; n < nodes; n++) {
+            ids[n] = GetId(n);
+        }
+        vector<uint32_t> order(nodes);
+        for (uint32_t n = 0; n < nodes; n++) {
+            order[n] = n;
+        }
+        std::sort(order.begin(), order.end(), [&ids](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+
+        vector<uint32_t> renumber(nodes);
+        vector<string> sortedIds(nodes);
+        for (uint32_t n = 0; n < nodes; n++) {
+            renumber[order[n]] = n;
+            sortedIds[n] = std::move(ids[order[n]]);
+        }
+
+        vector<uint64_t> offsets(nodes + 1, 0);
+        vector<uint32_t> targets;
+        targets.reserve(GetEdgeCount());
+        for (uint32_t n = 0; n < nodes; n++) {
+            const uint32_t *begin, *end;
+            GetRow(order[n], begin, end);
+            for (auto t = begin; t != end; t++) {
+                targets.push_back(renumber[*t]);
+            }
+            offsets[n + 1] = targets.size();
+        }
+        CompactRows(offsets, targets, 1);
+
+        return Write(_path, sortedIds, offsets, targets, _sources);
+    }
+
+    // numbers of the highest scoring nodes, best first
+    template<typename Score>
+    static vector<uint32_t> TopNodes(size_t nodes, size_t top, Score score) {
+        auto worse = [&score](uint32_t a, uint32_t b) { return score(a) > score(b); };
+        priority_queue<uint32_t, vector<uint32_t>, decltype(worse)> best(worse);
+        for (uint32_t n = 0; n < nodes; n++) {
+            if (best.size() < top) {
+                best.push(n);
+            } else if (top > 0 && score(n) > score(best.top())) {
+                best.pop();
+                best.push(n);
+            }
+        }
+
+        vector<uint32_t> result;
+        while (!best.empty()) {
+            result.push_back(best.top());
+            best.pop();
+        }
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+
+    // counts per power of two, bucket 0 holds degree 0 and bucket k degrees [2^(k-1), 2^k)
+    static void WriteDegreeSummary(Writer<StringBuffer> &writer, const vector<uint32_t> &degrees,
+                                   const GraphSnapshot &graph, size_t top) {
+        uint64_t total = 0;
+        uint32_t max = 0;
+        vector<uint64_t> histogram;
+        for (auto degree : degrees) {
+            total += degree;
+            max = std::max(max, degree);
+            size_t bucket = 0;
+            while (bucket < 33 && (1ull << bucket) <= degree) bucket++;
+            if (histogram.size() <= bucket) histogram.resize(bucket + 1, 0);
+            histogram[bucket]++;
+        }
+
+        writer.StartObject();
+        writer.Key("max");
+        writer.Uint(max);
+        writer.Key("mean");
+        writer.Double(degrees.empty() ? 0.0 : (double) total / degrees.size());
+        writer.Key("histogram");
+        writer.StartArray();
+        for (auto count : histogram) {
+            writer.Uint64(count);
+        }
+        writer.EndArray();
+        writer.Key("top");
+        writer.StartArray();
+        for (auto n : TopNodes(degrees.size(), top, [&degrees](uint32_t n) { return degrees[n]; })) {
+            writer.StartObject();
+            writer.Key("@id");
+            auto id = graph.GetId(n);
+            writer.String(id.data(), (SizeType) id.size());
+            writer.Key("degree");
+            writer.Uint(degrees[n]);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+    }
+
+    string GraphSnapshot::GetDegreeJson(int workers, size_t top) const {
+        auto nodes = GetNodeCount();
+        vector<uint32_t> out(nodes);
+        vector<atomic<uint32_t>> in(nodes);
+        ParallelForEach(nodes, workers, 4096, [&](size_t begin, size_t end, int worker) {
+            for (auto n = begin; n < end; n++) {
+                const uint32_t *first, *last;
+                GetRow((uint32_t) n, first, last);
+                out[n] = (uint32_t) (last - first);
+                for (auto t = first; t != last; t++) {
+                    in[*t].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        });
+
+        vector<uint32_t> inDegrees(nodes);
+        for (size_t n = 0; n < nodes; n++) {
+            inDegrees[n] = in[n];
+        }
+
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("nodes");
+        writer.Uint64(nodes);
+        writer.Key("edges");
+        writer.Uint64(GetEdgeCount());
+        writer.Key("out");
+        WriteDegreeSummary(writer, out, *this, top);
+        writer.Key("in");
+        WriteDegreeSummary(writer, inDegrees, *this, top);
+        writer.EndObject();
+        return string(buffer.GetString(), buffer.GetSize());
+    }
+
+    static bool AtomicMin(atomic<uint32_t> &target, uint32_t value) {
+        auto current = target.load(std::memory_order_relaxed);
+        while (value < current) {
+            if (target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    string GraphSnapshot::GetComponentsJson(int workers, size_t top) const {
+        // every node takes the smallest label among its neighbours, edges followed both ways,
+        // then labels jump to their label's label until nothing changes
+        auto nodes = GetNodeCount();
+        vector<atomic<uint32_t>> labels(nodes);
+        for (size_t n = 0; n < nodes; n++) {
+            labels[n] = (uint32_t) n;
+        }
+
+        int rounds = 0;
+        atomic<bool> changed(true);
+        while (changed) {
+            changed = false;
+            rounds++;
+            ParallelForEach(nodes, workers, 4096, [&](size_t begin, size_t end, int worker) {
+                bool local = false;
+                for (auto n = begin; n < end; n++) {
+                    const uint32_t *first, *last;
+                    GetRow((uint32_t) n, first, last);
+                    for (auto t = first; t != last; t++) {
+                        auto a = labels[n].load(std::memory_order_relaxed);
+                        auto b = labels[*t].load(std::memory_order_relaxed);
+                        if (a < b) local |= AtomicMin(labels[*t], a);
+                        if (b < a) local |= AtomicMin(labels[n], b);
+                    }
+                }
+                if (local) changed = true;
+            });
+
+            ParallelForEach(nodes, workers, 4096, [&](size_t begin, size_t end, int worker) {
+                for (auto n = begin; n < end; n++) {
+                    auto label = labels[n].load(std::memory_order_relaxed);
+                    while (true) {
+                        auto parent = labels[label].load(std::memory_order_relaxed);
+                        if (parent == label) break;
+                        label = parent;
+                    }
+                    AtomicMin(labels[n], label);
+                }
+            });
+        }
+
+        vector<uint32_t> sizes(nodes, 0);
+        size_t components = 0;
+        for (size_t n = 0; n < nodes; n++) {
+            if (sizes[labels[n]]++ == 0) components++;
+        }
+
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("nodes");
+        writer.Uint64(nodes);
+        writer.Key("components");
+        writer.Uint64(components);
+        writer.Key("rounds");
+        writer.Int(rounds);
+        writer.Key("largest");
+        writer.StartArray();
+        for (auto n : TopNodes(nodes, top, [&sizes](uint32_t n) { return sizes[n]; })) {
+            if (sizes[n] == 0) break;
+            writer.StartObject();
+            writer.Key("@id");
+            auto id = GetId(n);
+            writer.String(id.data(), (SizeType) id.size());
+            writer.Key("size");
+            writer.Uint(sizes[n]);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+        return string(buffer.GetString(), buffer.GetSize());
+    }
+
+    string GraphSnapshot::GetPageRankJson(int workers, int iterations, double damping, size_t top) const {
+        auto nodes = GetNodeCount();
+
+        // pull over the reversed graph so each node's rank is written by one thread
+        vector<uint64_t> inOffsets(nodes + 1, 0);
+        vector<uint32_t> outDegrees(nodes);
+        for (size_t n = 0; n < nodes; n++) {
+            const uint32_t *first, *last;
+            GetRow((uint32_t) n, first, last);
+            outDegrees[n] = (uint32_t) (last - first);
+            for (auto t = first; t != last; t++) {
+                inOffsets[*t + 1]++;
+            }
+        }
+        for (size_t n = 0; n < nodes; n++) {
+            inOffsets[n + 1] += inOffsets[n];
+        }
+        vector<uint32_t> sources(inOffsets.back());
+        vector<uint64_t> cursor(inOffsets.begin(), inOffsets.end() - 1);
+        for (size_t n = 0; n < nodes; n++) {
+            const uint32_t *first, *last;
+            GetRow((uint32_t) n, first, last);
+            for (auto t = first; t != last; t++) {
+                sources[cursor[*t]++] = (uint32_t) n;
+            }
+        }
+
+        vector<double> rank(nodes, nodes == 0 ? 0.0 : 1.0 / nodes);
+        vector<double> contribution(nodes);
+        vector<double> next(nodes);
+        vector<double> partials((size_t) std::max(workers, 1));
+        double delta = 0;
+
+        for (int i = 0; i < iterations && nodes > 0; i++) {
+            std::fill(partials.begin(), partials.end(), 0.0);
+            ParallelForEach(nodes, workers, 4096, [&](size_t begin, size_t end, int worker) {
+                double dangling = 0;
+                for (auto n = begin; n < end; n++) {
+                    if (outDegrees[n] == 0) {
+                        dangling += rank[n];
+                        contribution[n] = 0;
+                    } else {
+                        contribution[n] = rank[n] / outDegrees[n];
+                    }
+                }
+                partials[worker] += dangling;
+            });
+
+            double dangling = 0;
+            for (auto partial : partials) dangling += partial;
+            auto base = (1.0 - damping) / nodes + damping * dangling / nodes;
+
+            std::fill(partials.begin(), partials.end(), 0.0);
+            ParallelForEach(nodes, workers, 4096, [&](size_t begin, size_t end, int worker) {
+                double change = 0;
+                for (auto n = begin; n < end; n++) {
+                    double sum = 0;
+                    for (auto s = inOffsets[n]; s < inOffsets[n + 1]; s++) {
+                        sum += contribution[sources[s]];
+                    }
+                    next[n] = base + damping * sum;
+                    change += std::abs(next[n] - rank[n]);
+                }
+                partials[worker] += change;
+            });
+
+            delta = 0;
+            for (auto partial : partials) delta += partial;
+            rank.swap(next);
+        }
+
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("nodes");
+        writer.Uint64(nodes);
+        writer.Key("iterations");
+        writer.Int(iterations);
+        writer.Key("damping");
+        writer.Double(damping);
+        writer.Key("delta");
+        writer.Double(delta);
+        writer.Key("top");
+        writer.StartArray();
+        for (auto n : TopNodes(nodes, top, [&rank](uint32_t n) { return rank[n]; })) {
+            writer.StartObject();
+            writer.Key("@id");
+            auto id = GetId(n);
+            writer.String(id.data(), (SizeType) id.size());
+            writer.Key("rank");
+            writer.Double(rank[n]);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+        return string(buffer.GetString(), buffer.GetSize());
+    }
+}
@@ -0,0 +1,338 @@
+#include "PropertyIndex.h"
+#include "EntityCodec.h"
+#include "EntityMerger.h"
+#include "base64.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace webofdata {
+
+    static void AppendLengthPrefixed(string &key, const char *data, size_t length) {
+        int size = (int) length;
+        key.append((const char *) &size, sizeof(size));
+        key.append(data, length);
+    }
+
+    static void AppendBigEndian(string &key, uint64_t value) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            key.push_back((char) ((value >> shift) & 0xff));
+        }
+    }
+
+    static void EncodeString(const char *text, size_t length, string &encoded) {
+        encoded.clear();
+        for (size_t i = 0; i < length; i++) {
+            encoded.push_back(text[i]);
+            if (text[i] == '\0') encoded.push_back('\xff');
+        }
+        encoded.append("\x00\x01", 2);
+    }
+
+    static bool EncodeNumber(const string &text, string &encoded) {
+        char *end;
+        auto value = strtod(text.c_str(), &end);
+        if (text.empty() || *end != '\0' || std::isnan(value)) return false;
+        if (value == 0) value = 0; // -0 orders with 0
+
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        bits = (bits & (1ull << 63)) != 0 ? ~bits : bits | (1ull << 63);
+        encoded.clear();
+        AppendBigEndian(encoded, bits);
+        return true;
+    }
+
+    static void EncodeDate(int64_t milliseconds, string &encoded) {
+        encoded.clear();
+        AppendBigEndian(encoded, (uint64_t) milliseconds ^ (1ull << 63));
+    }
+
+    string PropertyIndex::MakePropertyPrefix(const string &property) {
+        string key;
+        AppendLengthPrefixed(key, property.data(), property.length());
+        return key;
+    }
+
+    string PropertyIndex::MakePropertyEnd(const string &property) {
+        // past every tag, and every key of the first layout whose values were length prefixed
+        return MakePropertyPrefix(property) + string(5, '\xff');
+    }
+
+    bool PropertyIndex::EncodeValue(IndexValueType type, const string &text, string &encoded) {
+        switch (type) {
+            case IndexValueType::String:
+                EncodeString(text.data(), text.length(), encoded);
+                return true;
+            case IndexValueType::Number:
+                return EncodeNumber(text, encoded);
+            case IndexValueType::Date: {
+                int64_t milliseconds;
+                if (!ParseDate(text.data(), text.length(), milliseconds)) return false;
+                EncodeDate(milliseconds, encoded);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    string PropertyIndex::MakeKey(const string &property, IndexValueType type, const string &encoded, const string &id) {
+        auto key = MakePropertyPrefix(property);
+        key.push_back((char) type);
+        key.append(encoded);
+        key.append(id);
+        return key;
+    }
+
+    bool PropertyIndex::GetId(const rocksdb::Slice &key, size_t prefixLength, string &id) {
+        if (key.size() <= prefixLength) return false;
+        auto data = key.data();
+        auto offset = prefixLength + 1;
+
+        switch ((IndexValueType) data[prefixLength]) {
+            case IndexValueType::Number:
+            case IndexValueType::Date:
+                offset += 8;
+                break;
+            case IndexValueType::String:
+                // the terminator is the only 0x00 not followed by 0xff
+                while (offset + 1 < key.size() && !(data[offset] == '\0' && data[offset + 1] == '\x01')) {
+                    offset += data[offset] == '\0' ? 2 : 1;
+                }
+                offset += 2;
+                break;
+            default:
+                return false;
+        }
+
+        if (offset > key.size()) return false;
+        id.assign(data + offset, key.size() - offset);
+        return true;
+    }
+
+    // days since 1970-01-01 of a proleptic gregorian date
+    static int64_t DaysFromCivil(int64_t year, unsigned month, unsigned day) {
+        year -= month <= 2;
+        auto era = (year >= 0 ? year : year - 399) / 400;
+        auto yearOfEra = (unsigned) (year - era * 400);
+        auto dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        auto dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + (int64_t) dayOfEra - 719468;
+    }
+
+    static bool ReadDigits(const char *text, size_t length, size_t &offset, int count, int &value) {
+        if (offset + count > length) return false;
+        value = 0;
+        for (int i = 0; i < count; i++) {
+            auto c = text[offset + i];
+            if (c < '0' || c > '9') return false;
+            value = value * 10 + (c - '0');
+        }
+        offset += count;
+        return true;
+    }
+
+    bool PropertyIndex::ParseDate(const char *text, size_t length, int64_t &milliseconds) {
+        size_t offset = 0;
+        int year, month, day, hour = 0, minute = 0, second = 0, millis = 0;
+        if (!ReadDigits(text, length, offset, 4, year) || offset >= length || text[offset++] != '-') return false;
+        if (!ReadDigits(text, length, offset, 2, month) || offset >= length || text[offset++] != '-') return false;
+        if (!ReadDigits(text, length, offset, 2, day)) return false;
+        if (month < 1 || month > 12 || day < 1 || day > 31) return false;
+
+        int offsetMinutes = 0;
+        if (offset < length) {
+            if (text[offset++] != 'T') return false;
+            if (!ReadDigits(text, length, offset, 2, hour) || offset >= length || text[offset++] != ':') return false;
+            if (!ReadDigits(text, length, offset, 2, minute)) return false;
+            if (offset < length && text[offset] == ':') {
+                offset++;
+                if (!ReadDigits(text, length, offset, 2, second)) return false;
+                if (offset < length && text[offset] == '.') {
+                    // milliseconds from the first three digits of the fraction
+                    offset++;
+                    int scale = 100;
+                    auto start = offset;
+                    while (offset < length && text[offset] >= '0' && text[offset] <= '9') {
+                        millis += (text[offset++] - '0') * scale;
+                        scale /= 10;
+                    }
+                    if (offset == start) return false;
+                }
+            }
+            if (hour > 23 || minute > 59 || second > 60) return false;
+
+            if (offset < length && text[offset] == 'Z') {
+                offset++;
+            } else if (offset < length && (text[offset] == '+' || text[offset] == '-')) {
+                auto sign = text[offset++] == '-' ? -1 : 1;
+                int zoneHours, zoneMinutes;
+                if (!ReadDigits(text, length, offset, 2, zoneHours)) return false;
+                if (offset < length && text[offset] == ':') offset++;
+                if (!ReadDigits(text, length, offset, 2, zoneMinutes)) return false;
+                offsetMinutes = sign * (zoneHours * 60 + zoneMinutes);
+            }
+            if (offset != length) return false;
+        }
+
+        auto seconds = DaysFromCivil(year, (unsigned) month, (unsigned) day) * 86400 + hour * 3600 + minute * 60 + second
+                       - offsetMinutes * 60;
+        milliseconds = seconds * 1000 + millis;
+        return true;
+    }
+
+    string PropertyIndex::EncodeCursor(const rocksdb::Slice &key, size_t prefixLength) {
+        auto token = base64_encode((const unsigned char *) key.data() + prefixLength, (unsigned int) (key.size() - prefixLength));
+        while (!token.empty() && token.back() == '=') token.pop_back();
+        for (auto &c : token) {
+            if (c == '+') c = '-';
+            if (c == '/') c = '_';
+        }
+        return token;
+    }
+
+    bool PropertyIndex::DecodeCursor(const string &token, string &cursor) {
+        string padded(token);
+        for (auto &c : padded) {
+            if (c == '-') c = '+';
+            else if (c == '_') c = '/';
+            else if (!isalnum((unsigned char) c)) return false;
+        }
+        cursor = base64_decode(padded);
+        return !cursor.empty();
+    }
+
+    // the text of a json string, its escapes decoded
+    static void UnescapeString(const char *data, size_t length, string &text) {
+        text.clear();
+        for (size_t i = 0; i < length; i++) {
+            if (data[i] != '\\' || i + 1 == length) {
+                text.push_back(data[i]);
+                continue;
+            }
+
+            auto c = data[++i];
+            switch (c) {
+                case 'b': text.push_back('\b'); break;
+                case 'f': text.push_back('\f'); break;
+                case 'n': text.push_back('\n'); break;
+                case 'r': text.push_back('\r'); break;
+                case 't': text.push_back('\t'); break;
+                case 'u': {
+                    if (i + 4 >= length) return;
+                    auto code = (unsigned) strtoul(string(data + i + 1, 4).c_str(), nullptr, 16);
+                    i += 4;
+                    // a high surrogate takes the low one after it
+                    if (code >= 0xd800 && code < 0xdc00 && i + 6 < length && data[i + 1] == '\\' && data[i + 2] == 'u') {
+                        auto low = (unsigned) strtoul(string(data + i + 3, 4).c_str(), nullptr, 16);
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                        i += 6;
+                    }
+                    if (code < 0x80) {
+                        text.push_back((char) code);
+                    } else if (code < 0x800) {
+                        text.push_back((char) (0xc0 | (code >> 6)));
+                        text.push_back((char) (0x80 | (code & 0x3f)));
+                    } else if (code < 0x10000) {
+                        text.push_back((char) (0xe0 | (code >> 12)));
+                        text.push_back((char) (0x80 | ((code >> 6) & 0x3f)));
+                        text.push_back((char) (0x80 | (code & 0x3f)));
+                    } else {
+                        text.push_back((char) (0xf0 | (code >> 18)));
+                        text.push_back((char) (0x80 | ((code >> 12) & 0x3f)));
+                        text.push_back((char) (0x80 | ((code >> 6) & 0x3f)));
+                        text.push_back((char) (0x80 | (code & 0x3f)));
+                    }
+                    break;
+                }
+                default: text.push_back(c); // quote, backslash and slash
+            }
+        }
+    }
+
+    bool PropertyIndex::EncodeJsonValue(const char *json, size_t length, IndexValueType type, string &encoded) {
+        if (length == 0 || json[0] == '{' || json[0] == '[') return false;
+        if (length == 4 && memcmp(json, "null", 4) == 0) return false;
+
+        thread_local string text;
+        if (json[0] == '"') {
+            UnescapeString(json + 1, length - 2, text);
+        } else {
+            text.assign(json, length);
+        }
+        return EncodeValue(type, text, encoded);
+    }
+
+    // appends the keys for one scalar, none for values that are not indexed
+    static void AppendValueKeys(const string &property, const JsonSpan &value, const string &id, vector<string> &keys) {
+        if (value.length == 0 || value.data[0] == '{' || value.data[0] == '[') return;
+        if (value.length == 4 && memcmp(value.data, "null", 4) == 0) return;
+
+        thread_local string text;
+        thread_local string encoded;
+        if (value.data[0] == '"') {
+            UnescapeString(value.data + 1, value.length - 2, text);
+            EncodeString(text.data(), text.length(), encoded);
+            keys.push_back(PropertyIndex::MakeKey(property, IndexValueType::String, encoded, id));
+
+            int64_t milliseconds;
+            if (PropertyIndex::ParseDate(text.data(), text.length(), milliseconds)) {
+                EncodeDate(milliseconds, encoded);
+                keys.push_back(PropertyIndex::MakeKey(property, IndexValueType::Date, encoded, id));
+            }
+        } else if (value.data[0] == 't' || value.data[0] == 'f') {
+            EncodeString(value.data, value.length, encoded);
+            keys.push_back(PropertyIndex::MakeKey(property, IndexValueType::String, encoded, id));
+        } else {
+            text.assign(value.data, value.length);
+            if (EncodeNumber(text, encoded)) {
+                keys.push_back(PropertyIndex::MakeKey(property, IndexValueType::Number, encoded, id));
+            }
+        }
+    }
+
+    static bool AppendMemberKeys(const vector<JsonMember> &members, const vector<string> &properties, const string &id,
+                                 vector<string> &keys) {
+        thread_local vector<JsonSpan> elements;
+        auto first = keys.size();
+        for (auto const &member : members) {
+            // member names are quoted
+            string property(member.name.data + 1, member.name.length - 2);
+            if (std::find(properties.begin(), properties.end(), property) == properties.end()) continue;
+
+            elements.clear();
+            if (member.value.length > 0 && member.value.data[0] == '[') {
+                if (!EntityMerger::ScanElements(member.value.data, member.value.length, elements)) return false;
+            } else {
+                elements.push_back(member.value);
+            }
+
+            for (auto const &element : elements) {
+                AppendValueKeys(property, element, id, keys);
+            }
+        }
+
+        std::sort(keys.begin() + first, keys.end());
+        keys.erase(std::unique(keys.begin() + first, keys.end()), keys.end());
+        return true;
+    }
+
+    bool PropertyIndex::GetKeys(const char *json, size_t length, const vector<string> &properties, const string &id,
+                                vector<string> &keys) {
+        thread_local vector<JsonMember> members;
+        members.clear();
+        if (!EntityMerger::ScanMembers(json, length, members)) return false;
+        return AppendMemberKeys(members, properties, id, keys);
+    }
+
+    bool PropertyIndex::GetKeys(const rocksdb::Slice &entity, const vector<string> &properties, const vector<string> &names,
+                                const unordered_map<string, int> &numbers, const string &id, vector<string> &keys) {
+        if (!EntityCodec::IsBinary(entity)) return GetKeys(entity.data(), entity.size(), properties, id, keys);
+
+        thread_local vector<JsonMember> members;
+        thread_local string values;
+        if (!EntityCodec::FindMembers(entity, properties, names, numbers, values, members)) return false;
+        return AppendMemberKeys(members, properties, id, keys);
+    }
+}
@@ -6,6 +6,7 @@
 #include <simple-web-server/server_http.hpp>
 #include <simple-web-server/status_code.hpp>
 #include <EntityStreamWriter.h>
+#include "Compression.h"
 #include <rapidjson/document.h>
 #include "rapidjson/error/en.h"
 #include <algorithm>
@@ -59,6 +60,201 @@ namespace webofdata {
         return elems;
     }
 
+    // true if any value of the named header contains the given value
+    bool HeaderContains(const shared_ptr<HttpServer::Request> &request, const string &name, const string &value) {
+        auto range = request->header.equal_range(name);
+        for (auto it = range.first; it != range.second; it++) {
+            if (it->second.find(value) != string::npos) return true;
+        }
+        return false;
+    }
+
+    // filter=<expression> conditions, all of which an entity must meet, and fields=<property>[,<property>]
+    // to project. property names are uris or stored ids. false if an expression doesn't parse
+    bool ParseEntityFilter(const shared_ptr<Store> &store, const CaseInsensitiveMultimap &params, EntityFilter &filter) {
+        for (auto const &param : params) {
+            if (param.first == "filter") {
+                PropertyCondition condition;
+                if (!store->ParseFilterCondition(param.second, condition)) return false;
+                filter.AddCondition(condition);
+            } else if (param.first == "fields") {
+                for (auto const &field : splitstr(param.second, ',')) {
+                    if (!field.empty()) filter.AddField(store->GetPropertyId(field, ""));
+                }
+            }
+        }
+        return true;
+    }
+
+    StreamFormat NegotiateStreamFormat(const shared_ptr<HttpServer::Request> &request) {
+        if (HeaderContains(request, "Accept", "application/x-ndjson")) {
+            return StreamFormat::NdJson;
+        }
+        return StreamFormat::JsonArray;
+    }
+
+    const char *StreamContentType(StreamFormat format) {
+        return format == StreamFormat::NdJson ? "application/x-ndjson" : "application/json";
+    }
+
+    void WodServer::SetCompressionLevels(const string &route, CompressionLevels levels) {
+        _compressionLevels[route] = levels;
+    }
+
+    void WodServer::SetResponseChunkSize(size_t chunkSize) {
+        _responseChunkSize = chunkSize;
+    }
+
+    void WodServer::SetMaxUnacknowledgedBytes(size_t maxUnacknowledgedBytes) {
+        _maxUnacknowledgedBytes = maxUnacknowledgedBytes;
+    }
+
+    void WodServer::SetRequestThreads(int threads) {
+        _server.config.thread_pool_size = (size_t) threads;
+    }
+
+    void WodServer::SetScanThreads(int threads, int maxPending) {
+        // an empty pool would queue every scan forever
+        if (threads <= 0 || maxPending <= 0) {
+            throw invalid_argument("scan threads and max pending scans must be greater than 0");
+        }
+        _scanPool->resize(threads);
+        _maxPendingScans = maxPending;
+    }
+
+    void WodServer::SetIngestLimits(int maxPerStore, int maxPerDataset) {
+        _maxStoreIngests = maxPerStore;
+        _maxDatasetIngests = maxPerDataset;
+    }
+
+    int WodServer::GetIngestRetryAfter(const shared_ptr<Store> &store) {
+        auto pressure = store->GetWritePressure();
+        if (pressure.writesStopped) {
+            return 10;
+        }
+
+        // rocksdb is already slowing writes down, a request now would hold a thread for the duration
+        if (pressure.delayedWriteRate > 0) {
+            return 2;
+        }
+
+        // back off before compaction debt reaches the point where rocksdb starts delaying writes
+        if (pressure.softPendingCompactionLimit > 0 &&
+            pressure.pendingCompactionBytes >= pressure.softPendingCompactionLimit / 4 * 3) {
+            return 5;
+        }
+
+        return 0;
+    }
+
+    // holds an ingest slot on a store and one of its datasets for the lifetime of a request
+    class IngestSlot {
+    private:
+        shared_ptr<Store> _store;
+        shared_ptr<DataSet> _dataset;
+        bool _acquired;
+
+    public:
+        IngestSlot(shared_ptr<Store> store, shared_ptr<DataSet> dataset, int maxStoreIngests, int maxDatasetIngests)
+                : _store(std::move(store)), _dataset(std::move(dataset)) {
+            _acquired = false;
+            if (_store->TryBeginIngest(maxStoreIngests)) {
+                if (_dataset->TryBeginIngest(maxDatasetIngests)) {
+                    _acquired = true;
+                } else {
+                    _store->EndIngest();
+                }
+            }
+        }
+
+        ~IngestSlot() {
+            if (_acquired) {
+                _dataset->EndIngest();
+                _store->EndIngest();
+            }
+        }
+
+        bool Acquired() {
+            return _acquired;
+        }
+    };
+
+    RouteHandler WodServer::OnScanPool(RouteHandler handler) {
+        return [this, handler](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request) {
+            if (++_scansPending > _maxPendingScans) {
+                _scansPending--;
+                _logger->warn(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "scan", "msg" : "too many scans pending" }})",
+                              _serviceId, GetRequestId(request));
+                CaseInsensitiveMultimap headers;
+                headers.emplace("Retry-After", "1");
+                response->write(StatusCode::server_error_service_unavailable, headers);
+                return;
+            }
+
+            // the response is sent from the pool thread, the request thread is free once this returns
+            _scanPool->push([this, handler, response, request](int id) {
+                RunRoute(handler, response, request);
+                _scansPending--;
+            });
+        };
+    }
+
+    // set once a route has created its response writer, which it does right before sending the status line
+    static thread_local bool responseStarted = false;
+
+    void WodServer::RunRoute(const RouteHandler &handler,
+                             shared_ptr<HttpServer::Response> response,
+                             shared_ptr<HttpServer::Request> request) {
+        responseStarted = false;
+        try {
+            handler(response, request);
+        } catch (const exception &ex) {
+            _logger->error(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "route", "error" : "{}" }})",
+                           _serviceId, GetRequestId(request), ex.what());
+            if (responseStarted) {
+                // a 200 is already out, drop the connection so the client sees a broken stream instead of
+                // waiting on the terminating chunk or taking what it got as complete
+                response->close_connection_after_response = true;
+            } else if (dynamic_cast<const StoreException *>(&ex) != nullptr) {
+                response->write(StatusCode::client_error_bad_request, ex.what());
+            } else {
+                response->write(StatusCode::server_error_internal_server_error, ex.what());
+            }
+        }
+        responseStarted = false;
+    }
+
+    unique_ptr<EntityStreamWriter> WodServer::CreateResponseWriter(const string &route,
+                                                                   shared_ptr<HttpServer::Response> response,
+                                                                   shared_ptr<HttpServer::Request> request,
+                                                                   CaseInsensitiveMultimap &headers,
+                                                                   bool backpressure) {
+        CompressionLevels levels;
+        auto configured = _compressionLevels.find(route);
+        if (configured != _compressionLevels.end()) {
+            levels = configured->second;
+        }
+
+        string acceptEncoding;
+        auto acceptEncodingHeader = request->header.find("Accept-Encoding");
+        if (acceptEncodingHeader != request->header.end()) {
+            acceptEncoding = acceptEncodingHeader->second;
+        }
+
+        responseStarted = true;
+        auto maxUnacknowledged = backpressure ? _maxUnacknowledgedBytes : SIZE_MAX;
+        unique_ptr<EntityStreamWriter> writer(new HttpResponseStreamWriter(response, _responseChunkSize, maxUnacknowledged));
+        auto coding = NegotiateContentCoding(acceptEncoding, levels);
+        if (coding == ContentCoding::Identity) {
+            return writer;
+        }
+
+        headers.emplace("Content-Encoding", ContentCodingName(coding));
+        headers.emplace("Vary", "Accept-Encoding");
+        auto level = coding == ContentCoding::Gzip ? levels.gzip : levels.zstd;
+        return unique_ptr<EntityStreamWriter>(new CompressingStreamWriter(std::move(writer), coding, level));
+    }
+
     void WodServer::ConfigureRoutes() {
 
         // get service info
@@ -265,6 +461,220 @@ namespace webofdata {
             }
         };
 
+        // store statistics, cache counters and the like
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/stats$"]["GET"] = [this](shared_ptr<HttpServer::Response> response,
+                                                                               shared_ptr<HttpServer::Request> request) {
+            auto requestId = GetRequestId(request);
+            _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "get-store-stats" }})", _serviceId, requestId);
+            CaseInsensitiveMultimap headers;
+            try {
+                string storeName = request->path_match[1];
+                auto store = _storeManager->GetStore(storeName);
+                if (store) {
+                    headers.emplace("Content-Type", "application/json");
+                    response->write(StatusCode::success_ok, store->GetStatsJson(), headers);
+                } else {
+                    response->write(StatusCode::client_error_not_found);
+                }
+            } catch (const exception &ex) {
+                _logger->error(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "get-store-stats", "error" : "{}" }})",
+                               _serviceId, requestId, ex.what());
+                response->write(StatusCode::server_error_internal_server_error, headers);
+            }
+        };
+
+        // graph snapshot status
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/graph$"]["GET"] = [this](shared_ptr<HttpServer::Response> response,
+                                                                               shared_ptr<HttpServer::Request> request) {
+            CaseInsensitiveMultimap headers;
+            string storeName = request->path_match[1];
+            auto store = _storeManager->GetStore(storeName);
+            if (store == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+            headers.emplace("Content-Type", "application/json");
+            response->write(StatusCode::success_ok, store->GetGraphStatusJson(), headers);
+        };
+
+        // build a graph snapshot of the given datasets, or all of them, in the background
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/graph$"]["POST"] = [this](shared_ptr<HttpServer::Response> response,
+                                                                                shared_ptr<HttpServer::Request> request) {
+            auto requestId = GetRequestId(request);
+            _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "build-graph" }})", _serviceId, requestId);
+            string storeName = request->path_match[1];
+            auto store = _storeManager->GetStore(storeName);
+            if (store == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+
+            vector<string> datasets;
+            auto params = request->parse_query_string();
+            for (auto it = params.begin(); it != params.end(); it++) {
+                if (it->first == "dataset") {
+                    if (store->GetDataSet(it->second) == nullptr) {
+                        response->write(StatusCode::client_error_not_found);
+                        return;
+                    }
+                    datasets.push_back(it->second);
+                }
+            }
+
+            if (store->StartGraphBuild(datasets)) {
+                response->write(StatusCode::success_accepted);
+            } else {
+                response->write(StatusCode::client_error_conflict, "a graph build is already running");
+            }
+        };
+
+        // apply the changes logged since the graph was built or last refreshed
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/graph/refresh$"]["POST"]
+                = OnScanPool([this](shared_ptr<HttpServer::Response> response,
+                                    shared_ptr<HttpServer::Request> request) {
+            auto requestId = GetRequestId(request);
+            CaseInsensitiveMultimap headers;
+            string storeName = request->path_match[1];
+            auto store = _storeManager->GetStore(storeName);
+            if (store == nullptr || store->GetGraph() == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+
+            try {
+                size_t refreshed;
+                if (!store->RefreshGraph(refreshed)) {
+                    response->write(StatusCode::client_error_conflict, "a graph build is running");
+                    return;
+                }
+                headers.emplace("Content-Type", "application/json");
+                response->write(StatusCode::success_ok, "{\"refreshed\":" + to_string(refreshed) + "}", headers);
+            } catch (const StoreException &sex) {
+                _logger->error(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "refresh-graph", "error" : "{}" }})",
+                               _serviceId, requestId, sex.what());
+                response->write(StatusCode::server_error_internal_server_error, headers);
+            }
+        });
+
+        // analytics over the graph snapshot: degree, components or pagerank
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/graph/(degree|components|pagerank)$"]["GET"]
+                = OnScanPool([this](shared_ptr<HttpServer::Response> response,
+                                    shared_ptr<HttpServer::Request> request) {
+            CaseInsensitiveMultimap headers;
+            string storeName = request->path_match[1];
+            string algorithm = request->path_match[2];
+            auto store = _storeManager->GetStore(storeName);
+            auto graph = store == nullptr ? nullptr : store->GetGraph();
+            if (graph == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+
+            size_t top = 10;
+            int iterations = 20;
+            double damping = 0.85;
+            auto params = request->parse_query_string();
+            for (auto it = params.begin(); it != params.end(); it++) {
+                if (it->first == "top") top = std::min<size_t>(strtoul(it->second.data(), nullptr, 10), 1000);
+                if (it->first == "iterations") iterations = std::max(1, std::min((int) strtol(it->second.data(), nullptr, 10), 100));
+                if (it->first == "damping") damping = strtod(it->second.data(), nullptr);
+            }
+            if (damping <= 0 || damping >= 1) {
+                response->write(StatusCode::client_error_bad_request, "damping must be between 0 and 1");
+                return;
+            }
+
+            auto workers = Store::GetGraphWorkers();
+            string json;
+            if (algorithm == "degree") {
+                json = graph->GetDegreeJson(workers, top);
+            } else if (algorithm == "components") {
+                json = graph->GetComponentsJson(workers, top);
+            } else {
+                json = graph->GetPageRankJson(workers, iterations, damping, top);
+            }
+
+            headers.emplace("Content-Type", "application/json");
+            response->write(StatusCode::success_ok, json, headers);
+        });
+
+        // start aggregating a dataset: group=<property> counts entities by value, distinct=<property> estimates
+        // distinct values, filter= as for entities. repeatable, top caps the groups reported per property
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/datasets/([a-zA-Z0-9 ._-]*)/aggregations$"]["POST"]
+                = [this](shared_ptr<HttpServer::Response> response,
+                         shared_ptr<HttpServer::Request> request) {
+            auto requestId = GetRequestId(request);
+            _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "start-aggregation" }})", _serviceId, requestId);
+            CaseInsensitiveMultimap headers;
+            string storeName = request->path_match[1];
+            string datasetName = request->path_match[2];
+            auto store = _storeManager->GetStore(storeName);
+            if (store == nullptr || store->GetDataSet(datasetName) == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+
+            AggregationSpec spec;
+            EntityFilter filter;
+            auto params = request->parse_query_string();
+            try {
+                for (auto it = params.begin(); it != params.end(); it++) {
+                    if (it->first == "group") spec.groupBy.push_back(store->GetPropertyId(it->second, ""));
+                    if (it->first == "distinct") spec.distinct.push_back(store->GetPropertyId(it->second, ""));
+                    if (it->first == "top") spec.top = std::min<size_t>(strtoul(it->second.data(), nullptr, 10), 10000);
+                }
+
+                if (!ParseEntityFilter(store, params, filter)) {
+                    response->write(StatusCode::client_error_bad_request, "invalid filter");
+                    return;
+                }
+            } catch (const exception &ex) {
+                // a property name that can't be resolved is the request's fault
+                response->write(StatusCode::client_error_bad_request, "invalid property: " + string(ex.what()));
+                return;
+            }
+
+            try {
+                auto id = store->StartAggregation(datasetName, spec, filter);
+                headers.emplace("Content-Type", "application/json");
+                headers.emplace("Location", "/stores/" + storeName + "/aggregations/" + id);
+                response->write(StatusCode::success_accepted, "{\"id\":\"" + id + "\"}", headers);
+            } catch (const StoreException &sex) {
+                _logger->error(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "start-aggregation", "error" : "{}" }})",
+                               _serviceId, requestId, sex.what());
+                response->write(StatusCode::server_error_internal_server_error, headers);
+            }
+        };
+
+        // an aggregation's state, progress and once completed its result
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/aggregations/([0-9]+)$"]["GET"]
+                = [this](shared_ptr<HttpServer::Response> response,
+                         shared_ptr<HttpServer::Request> request) {
+            CaseInsensitiveMultimap headers;
+            string storeName = request->path_match[1];
+            auto store = _storeManager->GetStore(storeName);
+            auto job = store == nullptr ? nullptr : store->GetAggregation(request->path_match[2]);
+            if (job == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+            headers.emplace("Content-Type", "application/json");
+            response->write(StatusCode::success_ok, job->GetStatusJson(), headers);
+        };
+
+        // cancel a running aggregation, its workers stop at the next entity
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/aggregations/([0-9]+)$"]["DELETE"]
+                = [this](shared_ptr<HttpServer::Response> response,
+                         shared_ptr<HttpServer::Request> request) {
+            string storeName = request->path_match[1];
+            auto store = _storeManager->GetStore(storeName);
+            if (store == nullptr || !store->CancelAggregation(request->path_match[2])) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+            response->write(StatusCode::success_accepted);
+        };
+
         // get-store
         _server.resource["^/stores/([a-zA-Z0-9 ._-]*)$"]["GET"] = [this](shared_ptr<HttpServer::Response> response,
                                                                          shared_ptr<HttpServer::Request> request) {
@@ -567,8 +977,8 @@ namespace webofdata {
 
         // stream entities from dataset
         _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/datasets/([a-zA-Z0-9 ._-]*)/entities$"]["GET"]
-                = [this](shared_ptr<HttpServer::Response> response,
-                         shared_ptr<HttpServer::Request> request) {
+                = OnScanPool([this](shared_ptr<HttpServer::Response> response,
+                                    shared_ptr<HttpServer::Request> request) {
 
             auto requestId = GetRequestId(request);
             _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "get-entities" }})", _serviceId, requestId);
@@ -600,20 +1010,21 @@ namespace webofdata {
                     entityId = string(idParam->second);
                 }
 
+                auto format = NegotiateStreamFormat(request);
+
                 if (!entityId.empty()) {
-                    headers.emplace("Content-Type", "application/json");
+                    headers.emplace("Transfer-Encoding", "chunked");
+                    headers.emplace("Content-Type", StreamContentType(format));
                     auto rid = store->GetResourceId(entityId);
 
+                    auto writer = CreateResponseWriter("entities", response, request, headers);
+                    writer->SetFormat(format);
                     response->write(StatusCode::success_ok, headers);
-                    HttpResponseStreamWriter writer(response);
 
                     vector<string> datasets;
                     datasets.push_back(datasetName);
-                    store->WriteEntityToStream(rid, datasets, writer);
-
-                    *response << "0\r\n" << "\r\n";
-                    writer.Flush();
-                    response->flush();
+                    store->WriteEntityToStream(rid, datasets, *writer);
+                    writer->Close();
 
                 } else {
 
@@ -625,11 +1036,18 @@ namespace webofdata {
 
                     auto continuationToken = queryParams.find("token"); // check token
 
+                    EntityFilter filter;
+                    if (!ParseEntityFilter(store, queryParams, filter)) {
+                        response->write(StatusCode::client_error_bad_request, "invalid filter");
+                        return;
+                    }
+
                     headers.emplace("Transfer-Encoding", "chunked");
-                    headers.emplace("Content-Type", "application/json");
+                    headers.emplace("Content-Type", StreamContentType(format));
 
+                    auto writer = CreateResponseWriter("entities", response, request, headers);
+                    writer->SetFormat(format);
                     response->write(StatusCode::success_ok, headers);
-                    HttpResponseStreamWriter writer(response);
 
                     int shard = -1;
                     string lastid(""); 
@@ -646,13 +1064,12 @@ namespace webofdata {
                     }
 
                     // write out data
-                    store->WriteEntitiesToStream(datasetName, lastid, take, shard, writer);
-
-                    // TODO: move this into the writer
-                    *response << "0\r\n" << "\r\n";
-
-                    writer.Flush();
-                    response->flush();
+                    store->WriteEntitiesToStream(datasetName, lastid, take, shard, *writer, &filter);
+                    writer->Close();
+                    if (writer->IsCancelled()) {
+                        _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "get-entities", "msg" : "client disconnected, scan stopped" }})",
+                                      _serviceId, requestId);
+                    }
                 }
 
             } catch (const StoreException &sex) {
@@ -664,7 +1081,7 @@ namespace webofdata {
                                _serviceId, requestId, ex.what());
                 response->write(StatusCode::server_error_internal_server_error, headers);
             }
-        };
+        });
 
         // get changes partitions
         _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/datasets/([a-zA-Z0-9 ._-]*)/changes/partitions$"]["GET"]
@@ -781,10 +1198,140 @@ namespace webofdata {
 
         };
 
+        // get the dataset's entities with a value for an indexed property
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/datasets/([a-zA-Z0-9 ._-]*)/index$"]["GET"]
+                = OnScanPool([this](shared_ptr<HttpServer::Response> response,
+                                    shared_ptr<HttpServer::Request> request) {
+            auto requestId = GetRequestId(request);
+            _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "query-property-index" }})", _serviceId, requestId);
+            CaseInsensitiveMultimap headers;
+
+            try {
+                string storeName = request->path_match[1];
+                string datasetName = request->path_match[2];
+
+                auto store = _storeManager->GetStore(storeName);
+                if (store == nullptr) {
+                    // no store by this name
+                    response->write(StatusCode::client_error_not_found);
+                    return;
+                }
+
+                auto ds = store->GetDataSet(datasetName);
+                if (ds == nullptr) {
+                    // no dataset by this name
+                    response->write(StatusCode::client_error_not_found);
+                    return;
+                }
+
+                auto queryParams = request->parse_query_string();
+                auto propertyParam = queryParams.find("property");
+                if (propertyParam == queryParams.end()) {
+                    response->write(StatusCode::client_error_bad_request, "property is required");
+                    return;
+                }
+
+                // values are compared as the type, string by default
+                PropertyIndexRange range;
+                string typeName("string");
+                auto typeParam = queryParams.find("type");
+                if (typeParam != queryParams.end()) {
+                    typeName = typeParam->second;
+                }
+                if (typeName == "number") {
+                    range.type = IndexValueType::Number;
+                } else if (typeName == "date") {
+                    range.type = IndexValueType::Date;
+                } else if (typeName != "string") {
+                    response->write(StatusCode::client_error_bad_request, "type must be string, number or date");
+                    return;
+                }
+
+                // value for one value, or gt or gte and lt or lte for a range
+                for (string name : {"value", "gt", "gte", "lt", "lte"}) {
+                    auto param = queryParams.find(name);
+                    if (param == queryParams.end()) continue;
+
+                    string encoded;
+                    if (!PropertyIndex::EncodeValue(range.type, param->second, encoded)) {
+                        response->write(StatusCode::client_error_bad_request, name + " is not a " + typeName);
+                        return;
+                    }
+                    if (name == "value" || name[0] == 'g') {
+                        range.lower = encoded;
+                        range.lowerInclusive = name != "gt";
+                    }
+                    if (name == "value" || name[0] == 'l') {
+                        range.upper = encoded;
+                        range.upperInclusive = name != "lt";
+                    }
+                }
+                if (range.lower.empty() && range.upper.empty()) {
+                    response->write(StatusCode::client_error_bad_request, "value or a range is required");
+                    return;
+                }
+
+                int take = PropertyIndex::DefaultPageSize;
+                auto takeCountParam = queryParams.find("take");
+                if (takeCountParam != queryParams.end()) {
+                    take = (int) strtol(takeCountParam->second.data(), nullptr, 10);
+                    if (take <= 0 || take > PropertyIndex::MaxPageSize) {
+                        response->write(StatusCode::client_error_bad_request, "take must be between 1 and " + to_string(PropertyIndex::MaxPageSize));
+                        return;
+                    }
+                }
+
+                // the token is the key the previous page ended at
+                string token;
+                auto continuationToken = queryParams.find("token");
+                if (continuationToken != queryParams.end()) {
+                    string cursor;
+                    if (!PropertyIndex::DecodeCursor(continuationToken->second, cursor)) {
+                        response->write(StatusCode::client_error_bad_request, "invalid token");
+                        return;
+                    }
+                    token = continuationToken->second;
+                }
+
+                auto property = store->GetPropertyId(propertyParam->second, "");
+                auto indexed = ds->GetIndexedProperties();
+                auto found = indexed->find(property);
+                if (found == indexed->end()) {
+                    response->write(StatusCode::client_error_bad_request, "property is not indexed");
+                    return;
+                }
+                if (!found->second) {
+                    // the index is still being built
+                    headers.emplace("Retry-After", "5");
+                    response->write(StatusCode::server_error_service_unavailable, headers);
+                    return;
+                }
+
+                auto format = NegotiateStreamFormat(request);
+                headers.emplace("Transfer-Encoding", "chunked");
+                headers.emplace("Content-Type", StreamContentType(format));
+
+                auto writer = CreateResponseWriter("query", response, request, headers);
+                writer->SetFormat(format);
+                response->write(StatusCode::success_ok, headers);
+                store->WritePropertyIndexQueryToStream(datasetName, property, range, token, take, *writer);
+                writer->Close();
+
+            } catch (const StoreException &sex) {
+                _logger->error(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "query-property-index", "error" : "{}" }})",
+                               _serviceId, requestId, sex.what());
+                response->write(StatusCode::server_error_internal_server_error, headers);
+            } catch (const exception &ex) {
+                _logger->error(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "query-property-index", "error" : "{}" }})",
+                               _serviceId, requestId, ex.what());
+                response->write(StatusCode::server_error_internal_server_error, headers);
+            }
+        });
+
         // get dataset changes
         _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/datasets/([a-zA-Z0-9 ._-]*)/changes$"]["GET"]
-                = [this](shared_ptr<HttpServer::Response> response,
-                         shared_ptr<HttpServer::Request> request) {
+                = OnScanPool([this](shared_ptr<HttpServer::Response> response,
+                                    shared_ptr<HttpServer::Request> request) {
 
             auto requestId = GetRequestId(request);
             _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "get-changes" }})", _serviceId, requestId);
@@ -842,19 +1389,27 @@ namespace webofdata {
                     // reset sequence
                 }
 
+                EntityFilter filter;
+                if (!ParseEntityFilter(store, queryParams, filter)) {
+                    response->write(StatusCode::client_error_bad_request, "invalid filter");
+                    return;
+                }
+
+                auto format = NegotiateStreamFormat(request);
                 headers.emplace("Transfer-Encoding", "chunked");
-                headers.emplace("Content-Type", "application/json");
+                headers.emplace("Content-Type", StreamContentType(format));
                 headers.emplace("x-wod-full-sync", "false");
 
+                auto writer = CreateResponseWriter("changes", response, request, headers);
+                writer->SetFormat(format);
                 response->write(StatusCode::success_ok, headers);
 
-                HttpResponseStreamWriter writer(response);
-
-                store->WriteChangesToStream(datasetName, sequence, take, shard, writer);
-
-                *response << "0\r\n" << "\r\n";
-                writer.Flush();
-                response->flush();
+                store->WriteChangesToStream(datasetName, sequence, take, shard, *writer, &filter);
+                writer->Close();
+                if (writer->IsCancelled()) {
+                    _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "get-changes", "msg" : "client disconnected, scan stopped" }})",
+                                  _serviceId, requestId);
+                }
 
             } catch (const StoreException &sex) {
                 _logger->error(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "get-changes", "error" : "{}" }})",
@@ -865,7 +1420,7 @@ namespace webofdata {
                                _serviceId, requestId, ex.what());
                 response->write(StatusCode::server_error_internal_server_error, headers);
             }
-        };
+        });
 
         // set entities by posting to /entities
         _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/datasets/([a-zA-Z0-9 ._-]*)/entities$"]["POST"]
@@ -896,7 +1451,52 @@ namespace webofdata {
                     return;
                 }
 
-                auto count = store->StoreEntities(request->content, datasetName);
+                // shed load while compaction catches up rather than block in a stalled write
+                auto retryAfter = GetIngestRetryAfter(store);
+                if (retryAfter > 0) {
+                    _logger->warn(R"({{ "nodeid" : "{}" , "rid" : "{}" , "store" : "{}", "dataset" : "{}" , "op" : "set-entities", "status" : "rejected", "msg" : "write pressure" }})", _serviceId, requestId, storeName, datasetName);
+                    headers.emplace("Retry-After", to_string(retryAfter));
+                    response->write(StatusCode::client_error_too_many_requests, headers);
+                    return;
+                }
+
+                IngestSlot slot(store, ds, _maxStoreIngests, _maxDatasetIngests);
+                if (!slot.Acquired()) {
+                    _logger->warn(R"({{ "nodeid" : "{}" , "rid" : "{}" , "store" : "{}", "dataset" : "{}" , "op" : "set-entities", "status" : "rejected", "msg" : "too many concurrent ingests" }})", _serviceId, requestId, storeName, datasetName);
+                    headers.emplace("Retry-After", "1");
+                    response->write(StatusCode::client_error_too_many_requests, headers);
+                    return;
+                }
+
+                string contentEncoding;
+                auto contentEncodingHeader = request->header.find("Content-Encoding");
+                if (contentEncodingHeader != request->header.end()) {
+                    contentEncoding = contentEncodingHeader->second;
+                }
+
+                auto coding = ParseContentCoding(contentEncoding);
+                if (coding == ContentCoding::Unsupported) {
+                    response->write(StatusCode::client_error_unsupported_media_type, "unsupported content encoding", headers);
+                    return;
+                }
+
+                // compressed bodies are inflated as the parser reads them
+                std::istream *body = &request->content;
+                unique_ptr<DecompressingStreamBuf> inflater;
+                unique_ptr<std::istream> inflated;
+                if (coding != ContentCoding::Identity) {
+                    inflater.reset(new DecompressingStreamBuf(request->content, coding));
+                    inflated.reset(new std::istream(inflater.get()));
+                    inflated->exceptions(std::ios::badbit);
+                    body = inflated.get();
+                }
+
+                long count;
+                if (HeaderContains(request, "Content-Type", "application/x-ndjson")) {
+                    count = store->StoreEntitiesNdJson(*body, datasetName);
+                } else {
+                    count = store->StoreEntities(*body, datasetName);
+                }
 
                 auto end = std::chrono::steady_clock::now();
                 auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
@@ -959,21 +1559,160 @@ namespace webofdata {
 
         };
 
+        // Traverse a path of properties from a subject, e.g. path=out:employer/in:member, and stream the entities reached
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/traverse$"]["GET"]
+                = OnScanPool([this](shared_ptr<HttpServer::Response> response,
+                                    shared_ptr<HttpServer::Request> request) {
+
+            auto requestId = GetRequestId(request);
+            _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "traverse" }})", _serviceId, requestId);
+            CaseInsensitiveMultimap headers;
+
+            string storeName = request->path_match[1];
+            auto store = _storeManager->GetStore(storeName);
+            if (store == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+
+            string subject;
+            string path;
+            string base;              // namespace for bare property names
+            vector<string> datasets;
+            size_t take = 1000;
+            size_t maxFrontier = 10000;
+
+            auto params = request->parse_query_string();
+            for (auto it = params.begin(); it != params.end(); it++) {
+                if (it->first == "subject") subject = it->second;
+                if (it->first == "path") path = it->second;
+                if (it->first == "base") base = it->second;
+                if (it->first == "dataset") datasets.push_back(it->second);
+                if (it->first == "take") take = (size_t) strtoul(it->second.data(), nullptr, 10);
+                if (it->first == "maxfrontier") maxFrontier = (size_t) strtoul(it->second.data(), nullptr, 10);
+            }
+
+            if (subject.empty() || path.empty() || maxFrontier == 0) {
+                response->write(StatusCode::client_error_bad_request);
+                return;
+            }
+
+            vector<string> ids;
+            bool truncated = false;
+            try {
+                auto steps = store->ParseTraversalPath(path, base);
+                ids = store->Traverse(subject, steps, datasets, maxFrontier, truncated);
+            } catch (const StoreException &sex) {
+                _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "traverse", "error" : "{}" }})",
+                              _serviceId, requestId, sex.what());
+                response->write(StatusCode::client_error_bad_request, sex.what());
+                return;
+            }
+
+            if (ids.size() > take) {
+                ids.resize(take);
+                truncated = true;
+            }
+
+            auto format = NegotiateStreamFormat(request);
+            headers.emplace("Transfer-Encoding", "chunked");
+            headers.emplace("Content-Type", StreamContentType(format));
+            if (truncated) {
+                // a level or the result hit its limit, the entities are not everything the path reaches
+                headers.emplace("X-Wod-Truncated", "true");
+            }
+
+            auto writer = CreateResponseWriter("query", response, request, headers);
+            writer->SetFormat(format);
+            response->write(StatusCode::success_ok, headers);
+            store->WriteEntitiesByIdToStream(ids, datasets, *writer);
+            writer->Close();
+        });
+
+        // Shortest directed path between two subjects, streamed as the entities along it
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/path$"]["GET"]
+                = OnScanPool([this](shared_ptr<HttpServer::Response> response,
+                                    shared_ptr<HttpServer::Request> request) {
+
+            auto requestId = GetRequestId(request);
+            _logger->info(R"({{ "nodeid" : "{}" , "rid" : "{}" , "op" : "path" }})", _serviceId, requestId);
+            CaseInsensitiveMultimap headers;
+
+            string storeName = request->path_match[1];
+            auto store = _storeManager->GetStore(storeName);
+            if (store == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
+
+            string from;
+            string to;
+            vector<string> datasets;
+            int maxDepth = 6;
+            size_t maxVisited = 100000;
+
+            auto params = request->parse_query_string();
+            for (auto it = params.begin(); it != params.end(); it++) {
+                if (it->first == "from") from = it->second;
+                if (it->first == "to") to = it->second;
+                if (it->first == "dataset") datasets.push_back(it->second);
+                if (it->first == "maxdepth") maxDepth = (int) strtol(it->second.data(), nullptr, 10);
+                if (it->first == "maxvisited") maxVisited = (size_t) strtoul(it->second.data(), nullptr, 10);
+            }
+
+            if (from.empty() || to.empty() || maxDepth <= 0 || maxDepth > 16) {
+                response->write(StatusCode::client_error_bad_request);
+                return;
+            }
+
+            vector<string> path;
+            bool truncated = false;
+            try {
+                path = store->FindShortestPath(from, to, datasets, maxDepth, maxVisited, truncated);
+            } catch (const StoreException &sex) {
+                response->write(StatusCode::client_error_bad_request, sex.what());
+                return;
+            }
+
+            if (truncated) {
+                // gave up at maxvisited, a longer search might still find a path
+                headers.emplace("X-Wod-Truncated", "true");
+            }
+
+            if (path.empty()) {
+                response->write(StatusCode::client_error_not_found, headers);
+                return;
+            }
+
+            auto format = NegotiateStreamFormat(request);
+            headers.emplace("Transfer-Encoding", "chunked");
+            headers.emplace("Content-Type", StreamContentType(format));
+
+            auto writer = CreateResponseWriter("query", response, request, headers);
+            writer->SetFormat(format);
+            response->write(StatusCode::success_ok, headers);
+            store->WriteEntitiesByIdToStream(path, datasets, *writer);
+            writer->Close();
+        });
+
         // Query endpoint for accessing subjects and traversing the graph
-        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/query$"]["GET"]
-                = [this](shared_ptr<HttpServer::Response> response,
-                         shared_ptr<HttpServer::Request> request) 
-        {
+        auto queryHandler = [this](shared_ptr<HttpServer::Response> response,
+                                   shared_ptr<HttpServer::Request> request) {
 
             auto requestId = GetRequestId(request);
             auto start = std::chrono::steady_clock::now();
 
             string storeName = request->path_match[1];
             auto store = _storeManager->GetStore(storeName);
+            if (store == nullptr) {
+                response->write(StatusCode::client_error_not_found);
+                return;
+            }
 
             // get query params
             auto params = request->parse_query_string();
 
+            RelatedEntitiesQuery query;
             string subject;           // params.find("subject");
             string connected;         // params.find("connected");
             string incoming;          // params.find("incoming");
@@ -981,12 +1720,10 @@ namespace webofdata {
             vector<string> datasets;  // params.find("dataset");
             string nextdata;          // params.find("nextdata");
             bool inverse = false;
+            bool count = false;       // params.find("count");
 
             // process params
             for(auto it = params.begin(); it != params.end(); it++) {
-                cout << it->first << '\t';
-                cout << it->second << endl;
-
                 if (it->first == "subject") {
                     subject = it->second;
                 }
@@ -1013,35 +1750,91 @@ namespace webofdata {
                 if (it->first == "nextdata") {
                     nextdata = it->second;
                 }
+
+                if (it->first == "count") {
+                    count = it->second == "true";
+                }
             }
 
             CaseInsensitiveMultimap headers;
 
-            if (subject.empty()) {
-                // bad request
-                response->write(StatusCode::client_error_bad_request);
+            // just the number of refs, by property when no property is given
+            if (count) {
+                if (subject.empty()) {
+                    response->write(StatusCode::client_error_bad_request);
+                    return;
+                }
+                headers.emplace("Content-Type", "application/json");
+                response->write(StatusCode::success_ok, store->GetRelatedCountsJson(subject, connected, inverse, datasets), headers);
                 return;
             }
 
             if (nextdata.empty()) {
-                headers.emplace("Transfer-Encoding", "chunked");
-                headers.emplace("Content-Type", "application/json");
-                response->write(StatusCode::success_ok, headers);
-
-                HttpResponseStreamWriter writer(response);
+                if (subject.empty()) {
+                    // bad request
+                    response->write(StatusCode::client_error_bad_request);
+                    return;
+                }
 
-                if (connected.empty()) {
-                    // just lookup the subject
-                    store->WriteCompleteEntityToStream(subject, datasets, writer);
-                } else {
-                    store->WriteRelatedEntitiesToStream(subject, connected, inverse, 0, 50, datasets, writer);
+                query.subject = subject;
+                query.property = connected;
+                query.inverse = inverse;
+                query.datasets = datasets;
+                if (!pageSize.empty()) {
+                    query.pageSize = (int) strtol(pageSize.data(), nullptr, 10);
+                    if (query.pageSize <= 0 || query.pageSize > RelatedEntitiesQuery::MaxPageSize) {
+                        response->write(StatusCode::client_error_bad_request, "pagesize must be between 1 and " + to_string(RelatedEntitiesQuery::MaxPageSize));
+                        return;
+                    }
+                }
+            } else {
+                // the token carries the query and where the last page ended
+                if (!RelatedEntitiesQuery::Decode(nextdata, query) || query.property.empty()) {
+                    response->write(StatusCode::client_error_bad_request, "invalid nextdata token");
+                    return;
                 }
+                if (!store->CanResumeRelatedEntities(query)) {
+                    response->write(StatusCode::client_error_bad_request, "stale nextdata token");
+                    return;
+                }
+            }
+
+            auto format = NegotiateStreamFormat(request);
+            headers.emplace("Transfer-Encoding", "chunked");
+            headers.emplace("Content-Type", StreamContentType(format));
 
-                *response << "0\r\n" << "\r\n";
-                response->flush();                 
+            // a subject lookup is one entity and is answered on the request thread
+            auto writer = CreateResponseWriter("query", response, request, headers, !query.property.empty());
+            writer->SetFormat(format);
+            response->write(StatusCode::success_ok, headers);
+
+            if (query.property.empty()) {
+                // just lookup the subject
+                store->WriteCompleteEntityToStream(query.subject, query.datasets, *writer);
             } else {
-                // shred the next data token into the same bits
+                store->WriteRelatedEntitiesToStream(query, *writer);
+            }
 
+            writer->Close();
+        };
+
+        // subject and count lookups stay on the request threads, so exports filling the scan pool can't
+        // queue or reject them. only pages of related entities are scans
+        auto queryScan = OnScanPool(queryHandler);
+        _server.resource["^/stores/([a-zA-Z0-9 ._-]*)/query$"]["GET"]
+                = [this, queryHandler, queryScan](shared_ptr<HttpServer::Response> response,
+                                                  shared_ptr<HttpServer::Request> request) {
+            bool count = false;
+            bool related = false;
+            for (auto const &param : request->parse_query_string()) {
+                if (param.first == "count") count = param.second == "true";
+                if ((param.first == "connected" || param.first == "nextdata") && !param.second.empty()) related = true;
+            }
+
+            if (related && !count) {
+                queryScan(response, request);
+            } else {
+                RunRoute(queryHandler, response, request);
             }
         };
     }
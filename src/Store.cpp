@@ -1,6 +1,9 @@
 #include "Store.h"
 #include "EntityHandler.h"
 #include "DataSet.h"
+#include "Parallel.h"
+#include "PropertyIndex.h"
+#include "EntityCodec.h"
 #include <rocksdb/db.h>
 #include <rocksdb/slice.h>
 #include <rocksdb/options.h>
@@ -12,8 +15,11 @@
 #include <rapidjson/document.h>
 #include <boost/filesystem.hpp>
 #include <utility>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
 #include <sstream>
-#include <set>
+#include <unordered_set>
 
 extern "C" {
     #include "xxhash.h"
@@ -82,6 +88,9 @@ namespace webofdata {
 
         string inrefs_prefix("dataset::inrefs::");
         _resourceInRefsColumnFamily = _store->AssertColumnFamily(inrefs_prefix + std::to_string(_id));
+
+        string propindex_prefix("dataset::propindex::");
+        _resourcePropertyIndexColumnFamily = _store->AssertColumnFamily(propindex_prefix + std::to_string(_id));
     }
 
     void DataSet::LookupNextSeqId() {
@@ -114,6 +123,16 @@ namespace webofdata {
         _namespacesJson = make_shared<string>("{}");
         _namespacesJsonDocument = make_shared<Document>();
         _namespacesJsonDocument->SetObject();
+        _namespaceTrie = make_shared<NamespaceTrie>();
+        _activeIngests = 0;
+        _presenceIndexReady = false;
+        _storeInRefsIndexEnabled = false;
+        _storeInRefsIndexReady = false;
+        _degreeCountersReady = false;
+        _closing = false;
+        _graphBuilding = false;
+        _nextAggregationId = 0;
+        _entityCache = make_shared<EntityCache>(DefaultEntityCacheBytes);
     }
 
     shared_ptr<string> Store::GetNamespacesJson() {
@@ -121,9 +140,347 @@ namespace webofdata {
     }
 
     void Store::Close() {
+        StopBackgroundWork();
         delete _database;
     }
 
+    void Store::StopBackgroundWork() {
+        _closing = true;
+        if (_presenceBackfill.joinable()) {
+            _presenceBackfill.join();
+        }
+        if (_storeInRefsBackfill.joinable()) {
+            _storeInRefsBackfill.join();
+        }
+        if (_degreeBackfill.joinable()) {
+            _degreeBackfill.join();
+        }
+        if (_graphBuild.joinable()) {
+            _graphBuild.join();
+        }
+
+        vector<std::thread> indexBuilds;
+        {
+            std::lock_guard<std::mutex> lock(_indexBuildMutex);
+            indexBuilds.swap(_indexBuilds);
+        }
+        for (auto &build : indexBuilds) {
+            build.join();
+        }
+
+        vector<std::thread> purges;
+        {
+            std::lock_guard<std::mutex> lock(_purgeMutex);
+            purges.swap(_purges);
+        }
+        for (auto &purge : purges) {
+            purge.join();
+        }
+
+        vector<std::thread> conversions;
+        {
+            std::lock_guard<std::mutex> lock(_encodingMutex);
+            conversions.swap(_encodingConversions);
+        }
+        for (auto &conversion : conversions) {
+            conversion.join();
+        }
+
+        map<long, shared_ptr<AggregationJob>> aggregations;
+        {
+            std::lock_guard<std::mutex> lock(_aggregationsMutex);
+            aggregations.swap(_aggregations);
+        }
+        for (auto &job : aggregations) {
+            job.second->cancelled = true;
+            if (job.second->worker.joinable()) {
+                job.second->worker.join();
+            }
+        }
+    }
+
+    string Store::StartAggregation(const string &dataset, const AggregationSpec &spec, const EntityFilter &filter) {
+        if (GetDataSet(dataset) == nullptr) {
+            throw StoreException("No dataset named " + dataset);
+        }
+
+        std::lock_guard<std::mutex> lock(_aggregationsMutex);
+        auto number = ++_nextAggregationId;
+        auto job = make_shared<AggregationJob>(to_string(number), dataset, spec, filter);
+
+        // the oldest finished job makes way, its thread has nothing left to do
+        size_t finishedCount = 0;
+        for (auto const &existing : _aggregations) {
+            if (existing.second->GetState() != AggregationJob::Running) finishedCount++;
+        }
+        for (auto it = _aggregations.begin(); it != _aggregations.end() && finishedCount >= MaxFinishedAggregations;) {
+            if (it->second->GetState() != AggregationJob::Running) {
+                if (it->second->worker.joinable()) {
+                    it->second->worker.join();
+                }
+                it = _aggregations.erase(it);
+                finishedCount--;
+            } else {
+                ++it;
+            }
+        }
+
+        _aggregations[number] = job;
+        job->worker = std::thread(&Store::RunAggregation, this, job);
+        return job->id;
+    }
+
+    shared_ptr<AggregationJob> Store::GetAggregation(const string &id) {
+        auto number = strtol(id.c_str(), nullptr, 10);
+        std::lock_guard<std::mutex> lock(_aggregationsMutex);
+        auto found = _aggregations.find(number);
+        if (found == _aggregations.end() || found->second->id != id) {
+            return nullptr;
+        }
+        return found->second;
+    }
+
+    bool Store::CancelAggregation(const string &id) {
+        auto job = GetAggregation(id);
+        if (job == nullptr) {
+            return false;
+        }
+        job->cancelled = true;
+        return true;
+    }
+
+    void Store::RunAggregation(shared_ptr<AggregationJob> job) {
+        auto ds = GetDataSet(job->dataset);
+        if (ds == nullptr) {
+            job->Finish(AggregationJob::Failed, "dataset " + job->dataset + " no longer exists");
+            return;
+        }
+
+        auto snapshot = _database->GetSnapshot();
+        auto readOptions = rocksdb::ReadOptions();
+        readOptions.fill_cache = false;
+        readOptions.snapshot = snapshot;
+
+        // ranges of similar size from the sst boundaries, a few per worker to even out the work
+        auto workers = GetGraphWorkers();
+        vector<pair<string, string>> ranges;
+        string begin;
+        for (auto const &split : GetSplitKeys(ds->GetStoreColumnFamily(), (size_t) workers * 4)) {
+            ranges.emplace_back(begin, split);
+            begin = split;
+        }
+        ranges.emplace_back(begin, "");
+        job->ranges = ranges.size();
+
+        vector<AggregationPartial> partials(workers, AggregationPartial(job->spec));
+        try {
+            ParallelForEach(ranges.size(), workers, 1, [&](size_t first, size_t last, int worker) {
+                auto filter = job->filter;
+                auto &partial = partials[worker];
+
+                unique_ptr<rocksdb::Iterator> it(_database->NewIterator(readOptions, ds->GetStoreColumnFamily()));
+                for (auto r = first; r < last; r++) {
+                    auto const &end = ranges[r].second;
+                    for (it->Seek(ranges[r].first); it->Valid(); it->Next()) {
+                        if (!end.empty() && it->key().compare(end) >= 0) break;
+                        if (job->cancelled || _closing) return;
+                        job->entitiesScanned.fetch_add(1, std::memory_order_relaxed);
+
+                        // a binary entity has only the properties tested and counted decoded
+                        auto namesLock = LockPropertyNames(it->value());
+                        if (!filter.Meets(it->value(), _propertyNames, _propertyToIdIndex)) continue;
+                        partial.Add(it->value(), _propertyNames, _propertyToIdIndex, job->spec);
+                    }
+                    job->rangesScanned++;
+                }
+            });
+        } catch (const exception &ex) {
+            _database->ReleaseSnapshot(snapshot);
+            _logger->error(R"({{ "store" : "{}" , "dataset" : "{}" , "op" : "aggregation", "id" : "{}", "error" : "{}" }})",
+                           _name, job->dataset, job->id, ex.what());
+            job->Finish(AggregationJob::Failed, ex.what());
+            return;
+        }
+        _database->ReleaseSnapshot(snapshot);
+
+        if (job->cancelled || _closing) {
+            job->Finish(AggregationJob::Cancelled, "");
+            return;
+        }
+
+        for (size_t w = 1; w < partials.size(); w++) {
+            partials[0].Merge(partials[w]);
+        }
+        job->Finish(AggregationJob::Completed, partials[0].ToJson(job->spec));
+        _logger->info(R"({{ "store" : "{}" , "dataset" : "{}" , "op" : "aggregation", "id" : "{}", "entities" : {}, "status" : "completed" }})",
+                      _name, job->dataset, job->id, job->entitiesScanned.load());
+    }
+
+    string Store::GetGraphPath() {
+        return _storeLocation + "/graph.csr";
+    }
+
+    int Store::GetGraphWorkers() {
+        return (int) std::min(std::max(std::thread::hardware_concurrency(), 1u), 16u);
+    }
+
+    vector<GraphSource> Store::GetGraphSources(const vector<string> &datasets) {
+        vector<GraphSource> sources;
+        for (auto const &name : datasets) {
+            auto ds = GetDataSet(name);
+            if (ds == nullptr) {
+                throw StoreException("No dataset " + name + " for the graph");
+            }
+            GraphSource source;
+            source.dataset = name;
+            // a sequence later ingests are still writing below would be skipped by the next refresh
+            source.sequence = ds->GetCommittedSequenceId();
+            source.outRefs = ds->GetOutRefsColumnFamily();
+            source.log = ds->GetLogColumnFamily();
+            sources.push_back(source);
+        }
+        return sources;
+    }
+
+    vector<string> Store::GetSplitKeys(ColumnFamilyHandle *columnFamily, size_t parts) {
+        std::vector<rocksdb::LiveFileMetaData> files;
+        _database->GetLiveFilesMetaData(&files);
+
+        vector<string> boundaries;
+        for (auto const &file : files) {
+            if (file.column_family_name == columnFamily->GetName()) {
+                boundaries.push_back(file.smallestkey);
+            }
+        }
+        std::sort(boundaries.begin(), boundaries.end());
+        boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+        // the first boundary starts the first range anyway
+        vector<string> splits;
+        if (parts < 2 || boundaries.size() < 2) {
+            return splits;
+        }
+        auto step = std::max<size_t>(1, boundaries.size() / parts);
+        for (size_t i = step; i < boundaries.size() && splits.size() + 1 < parts; i += step) {
+            splits.push_back(boundaries[i]);
+        }
+        return splits;
+    }
+
+    bool Store::StartGraphBuild(const vector<string> &datasets) {
+        if (_graphBuilding.exchange(true)) {
+            return false;
+        }
+        if (_graphBuild.joinable()) {
+            _graphBuild.join();
+        }
+
+        vector<string> names(datasets);
+        if (names.empty()) {
+            for (auto const &ds : GetDataSets()) {
+                names.push_back(ds->GetName());
+            }
+        }
+
+        _graphBuild = std::thread([this, names]() {
+            // a refresh that began before the build finishes first, later ones are turned away until it is done,
+            // so neither writes the graph file over the other
+            {
+                std::lock_guard<std::mutex> lock(_graphMutex);
+            }
+
+            try {
+                // sequences are taken before the scan, refs written during it are picked up by the next refresh
+                auto sources = GetGraphSources(names);
+                auto workers = GetGraphWorkers();
+                vector<GraphScanRange> ranges;
+                for (size_t s = 0; s < sources.size(); s++) {
+                    string begin;
+                    for (auto const &split : GetSplitKeys(sources[s].outRefs, (size_t) workers * 4)) {
+                        ranges.push_back(GraphScanRange{s, begin, split});
+                        begin = split;
+                    }
+                    ranges.push_back(GraphScanRange{s, begin, ""});
+                }
+
+                auto graph = GraphSnapshot::Build(_database, sources, ranges, GetGraphPath(), workers, _closing);
+                {
+                    // cleared before the graph is published, a caller that sees the new graph can refresh it
+                    std::lock_guard<std::mutex> lock(_graphMutex);
+                    _graphError.clear();
+                    _graphBuilding = false;
+                    std::atomic_store(&_graph, graph);
+                }
+                _logger->info(R"({{ "store" : "{}" , "op" : "graph-build", "nodes" : {}, "edges" : {} }})",
+                              _name, graph->GetNodeCount(), graph->GetEdgeCount());
+            } catch (const exception &ex) {
+                std::lock_guard<std::mutex> lock(_graphMutex);
+                _graphError = ex.what();
+                _graphBuilding = false;
+                _logger->error(R"({{ "store" : "{}" , "op" : "graph-build", "error" : "{}" }})", _name, ex.what());
+            }
+        });
+        return true;
+    }
+
+    bool Store::RefreshGraph(size_t &refreshed) {
+        std::lock_guard<std::mutex> lock(_graphMutex);
+        if (_graphBuilding) {
+            return false;
+        }
+
+        auto graph = GetGraph();
+        if (graph == nullptr) {
+            throw StoreException("No graph has been built");
+        }
+
+        vector<string> names;
+        for (auto const &source : graph->GetSources()) {
+            names.push_back(source.dataset);
+        }
+
+        refreshed = 0;
+        try {
+            auto next = graph->Refresh(_database, GetGraphSources(names), refreshed);
+            std::atomic_store(&_graph, next);
+        } catch (const GraphException &ex) {
+            throw StoreException(string("Unable to refresh graph: ") + ex.what());
+        }
+        return true;
+    }
+
+    string Store::GetGraphStatusJson() {
+        auto graph = GetGraph();
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("building");
+        writer.Bool(_graphBuilding);
+        writer.Key("ready");
+        writer.Bool(graph != nullptr);
+        if (graph != nullptr) {
+            writer.Key("nodes");
+            writer.Uint64(graph->GetNodeCount());
+            writer.Key("edges");
+            writer.Uint64(graph->GetEdgeCount());
+            writer.Key("overlay-edges");
+            writer.Uint64(graph->GetOverlayEdgeCount());
+            writer.Key("datasets");
+            writer.StartArray();
+            for (auto const &source : graph->GetSources()) {
+                writer.String(source.dataset.data(), (SizeType) source.dataset.size());
+            }
+            writer.EndArray();
+        }
+        std::lock_guard<std::mutex> lock(_graphMutex);
+        if (!_graphError.empty()) {
+            writer.Key("error");
+            writer.String(_graphError.data(), (SizeType) _graphError.size());
+        }
+        writer.EndObject();
+        return string(buffer.GetString(), buffer.GetSize());
+    }
+
     void Store::Compact() {
         CompactionOptions options;
         std::vector<std::string> input_file_names;
@@ -131,6 +488,181 @@ namespace webofdata {
         Status s = _database->CompactFiles(options, input_file_names, output_level);
     }
 
+    WritePressure Store::GetWritePressure() {
+        WritePressure pressure;
+        uint64_t value = 0;
+        if (_database->GetIntProperty(DB::Properties::kIsWriteStopped, &value)) {
+            pressure.writesStopped = value != 0;
+        }
+        _database->GetIntProperty(DB::Properties::kActualDelayedWriteRate, &pressure.delayedWriteRate);
+        _database->GetAggregatedIntProperty(DB::Properties::kEstimatePendingCompactionBytes, &pressure.pendingCompactionBytes);
+        pressure.softPendingCompactionLimit = _database->GetOptions().soft_pending_compaction_bytes_limit;
+        return pressure;
+    }
+
+    void Store::SetEntityCacheBytes(size_t capacityBytes) {
+        shared_ptr<EntityCache> cache;
+        if (capacityBytes > 0) {
+            cache = make_shared<EntityCache>(capacityBytes);
+        }
+        std::atomic_store(&_entityCache, cache);
+    }
+
+    string Store::GetStatsJson() {
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        writer.StartObject();
+
+        auto cache = std::atomic_load(&_entityCache);
+        writer.Key("entity-cache");
+        writer.StartObject();
+        writer.Key("enabled");
+        writer.Bool(cache != nullptr);
+        if (cache != nullptr) {
+            writer.Key("hits");
+            writer.Uint64(cache->GetHits());
+            writer.Key("misses");
+            writer.Uint64(cache->GetMisses());
+            writer.Key("evictions");
+            writer.Uint64(cache->GetEvictions());
+            writer.Key("entries");
+            writer.Uint64(cache->GetCount());
+            writer.Key("bytes");
+            writer.Uint64(cache->GetBytes());
+        }
+        writer.EndObject();
+
+        writer.Key("presence-index");
+        writer.StartObject();
+        writer.Key("ready");
+        writer.Bool(_presenceIndexReady);
+        writer.EndObject();
+
+        writer.Key("store-inrefs-index");
+        writer.StartObject();
+        writer.Key("enabled");
+        writer.Bool(_storeInRefsIndexEnabled);
+        writer.Key("ready");
+        writer.Bool(_storeInRefsIndexReady);
+        writer.EndObject();
+
+        writer.Key("dataset-purges");
+        writer.StartObject();
+        writer.Key("pending");
+        writer.Int(_pendingPurges);
+        writer.EndObject();
+
+        writer.Key("degree-counters");
+        writer.StartObject();
+        writer.Key("ready");
+        writer.Bool(_degreeCountersReady);
+        writer.EndObject();
+
+        // dataset -> property -> ready, for datasets with indexes
+        writer.Key("property-indexes");
+        writer.StartObject();
+        for (auto const &ds : GetDataSets()) {
+            auto indexed = ds->GetIndexedProperties();
+            if (indexed->empty()) continue;
+            auto name = ds->GetName();
+            writer.Key(name.data(), (SizeType) name.size());
+            writer.StartObject();
+            for (auto const &property : *indexed) {
+                writer.Key(property.first.data(), (SizeType) property.first.size());
+                writer.Bool(property.second);
+            }
+            writer.EndObject();
+        }
+        writer.EndObject();
+
+        // dataset -> conversion running, for datasets in the binary form or converting out of it
+        writer.Key("binary-encoding");
+        writer.StartObject();
+        for (auto const &ds : GetDataSets()) {
+            auto name = ds->GetName();
+            bool converting;
+            {
+                std::lock_guard<std::mutex> lock(_encodingMutex);
+                converting = _encodingConversionsRunning.count(name) > 0;
+            }
+            if (!ds->UsesBinaryEncoding() && !converting) continue;
+            writer.Key(name.data(), (SizeType) name.size());
+            writer.StartObject();
+            writer.Key("binary");
+            writer.Bool(ds->UsesBinaryEncoding());
+            writer.Key("converting");
+            writer.Bool(converting);
+            writer.EndObject();
+        }
+        writer.EndObject();
+
+        // sst compression of the datasets' entities and logs, and what reading it back costs
+        writer.Key("compression");
+        writer.StartObject();
+        if (_statistics != nullptr) {
+            rocksdb::HistogramData decompression;
+            _statistics->histogramData(rocksdb::DECOMPRESSION_TIMES_NANOS, &decompression);
+            writer.Key("blocks-decompressed");
+            writer.Uint64(decompression.count);
+            writer.Key("decompression-nanos-average");
+            writer.Double(decompression.average);
+            writer.Key("decompression-nanos-p99");
+            writer.Double(decompression.percentile99);
+        }
+        writer.Key("datasets");
+        writer.StartObject();
+        for (auto const &ds : GetDataSets()) {
+            auto name = ds->GetName();
+            writer.Key(name.data(), (SizeType) name.size());
+            writer.StartObject();
+            writer.Key("store");
+            WriteCompressionStats(writer, ds->GetStoreColumnFamily());
+            writer.Key("log");
+            WriteCompressionStats(writer, ds->GetLogColumnFamily());
+            writer.EndObject();
+        }
+        writer.EndObject();
+        writer.EndObject();
+
+        writer.Key("interned-properties");
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(_propertyNamesLock);
+            writer.Uint64(_propertyToIdIndex.size());
+        }
+
+        writer.EndObject();
+        return string(buffer.GetString(), buffer.GetSize());
+    }
+
+    void Store::WriteCompressionStats(Writer<StringBuffer> &writer, ColumnFamilyHandle *columnFamily) {
+        rocksdb::TablePropertiesCollection tables;
+        uint64_t rawBytes = 0, dataBytes = 0, entries = 0;
+        string compression;
+        if (_database->GetPropertiesOfAllTables(columnFamily, &tables).ok()) {
+            for (auto const &table : tables) {
+                rawBytes += table.second->raw_key_size + table.second->raw_value_size;
+                dataBytes += table.second->data_size;
+                entries += table.second->num_entries;
+                compression = table.second->compression_name;
+            }
+        }
+
+        writer.StartObject();
+        writer.Key("files");
+        writer.Uint64(tables.size());
+        writer.Key("entries");
+        writer.Uint64(entries);
+        writer.Key("raw-bytes");
+        writer.Uint64(rawBytes);
+        writer.Key("compressed-bytes");
+        writer.Uint64(dataBytes);
+        writer.Key("ratio");
+        writer.Double(dataBytes > 0 ? (double) rawBytes / (double) dataBytes : 0);
+        writer.Key("compression");
+        writer.String(compression.data(), (SizeType) compression.size());
+        writer.EndObject();
+    }
+
     void Store::StoreMetadataEntity(std::string data) {
         Slice val(data.data(), data.length());
         auto s = _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, "store_entity", val);
@@ -139,13 +671,446 @@ namespace webofdata {
         }
     }
 
+    // adds the index keys only in after and removes those only in before, both sorted
+    static void WritePropertyIndexDiff(rocksdb::WriteBatch &batch, ColumnFamilyHandle *indexColumnFamily,
+                                       const vector<string> &before, const vector<string> &after) {
+        vector<string> changed;
+        std::set_difference(after.begin(), after.end(), before.begin(), before.end(), std::back_inserter(changed));
+        for (auto const &key : changed) {
+            batch.Put(indexColumnFamily, key, Slice());
+        }
+
+        changed.clear();
+        std::set_difference(before.begin(), before.end(), after.begin(), after.end(), std::back_inserter(changed));
+        for (auto const &key : changed) {
+            batch.Delete(indexColumnFamily, key);
+        }
+    }
+
     void Store::StoreDatasetMetadataEntity(std::string dataset, std::string data) {
+        // wod:indexes lists the properties to index, checked before anything is stored
+        vector<string> indexes;
+        Document entity;
+        entity.Parse(data.data(), data.length());
+        if (entity.IsObject() && entity.HasMember("wod:indexes")) {
+            auto const &declared = entity["wod:indexes"];
+            if (!declared.IsArray()) {
+                throw StoreException("wod:indexes must be an array of property uris");
+            }
+            for (auto const &property : declared.GetArray()) {
+                if (!property.IsString()) {
+                    throw StoreException("wod:indexes must be an array of property uris");
+                }
+                indexes.push_back(AssertPropertyId(property.GetString()));
+            }
+        }
+
+        // wod:encoding picks the form entities are stored in, json unless it says binary
+        bool binary = false;
+        if (entity.IsObject() && entity.HasMember("wod:encoding")) {
+            auto const &encoding = entity["wod:encoding"];
+            if (!encoding.IsString() || (strcmp(encoding.GetString(), "binary") != 0 && strcmp(encoding.GetString(), "json") != 0)) {
+                throw StoreException("wod:encoding must be binary or json");
+            }
+            binary = strcmp(encoding.GetString(), "binary") == 0;
+        }
+
         string key("dataset_entity_" + dataset);
         Slice val(data.data(), data.length());
         auto s = _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, key, val);
         if (!s.ok()) {
             throw StoreException("Unable to store global state. Key: " + key);
         }
+
+        auto ds = GetDataSet(dataset);
+        if (ds != nullptr) {
+            UpdatePropertyIndexes(ds, indexes);
+            UpdateEncoding(ds, binary);
+        }
+    }
+
+    void Store::UpdatePropertyIndexes(const shared_ptr<DataSet> &dataset, const vector<string> &properties) {
+        std::lock_guard<std::mutex> lock(_indexBuildMutex);
+        auto current = dataset->GetIndexedProperties();
+        auto updated = make_shared<map<string, bool>>();
+        bool building = false;
+        for (auto const &property : properties) {
+            auto found = current->find(property);
+            auto ready = found != current->end() && found->second;
+            (*updated)[property] = ready;
+            building = building || !ready;
+        }
+
+        // the entries of properties no longer indexed go, any a racing write adds are cleared by the next build
+        for (auto const &property : *current) {
+            if (updated->count(property.first) == 0) {
+                _database->DeleteRange(WriteOptions(), dataset->GetPropertyIndexColumnFamily(),
+                                       PropertyIndex::MakePropertyPrefix(property.first),
+                                       PropertyIndex::MakePropertyEnd(property.first));
+            }
+        }
+
+        SavePropertyIndexes(dataset, *updated);
+        dataset->SetIndexedProperties(updated);
+        if (building) {
+            StartPropertyIndexBuild(dataset);
+        }
+    }
+
+    void Store::SavePropertyIndexes(const shared_ptr<DataSet> &dataset, const map<string, bool> &properties) {
+        // proplen : property : ready for each
+        string value;
+        for (auto const &property : properties) {
+            int length = property.first.length();
+            value.append((const char *) &length, sizeof(length));
+            value.append(property.first);
+            value.push_back(property.second ? 1 : 0);
+        }
+
+        string key("propindexes_" + dataset->GetName());
+        auto s = _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, key, value);
+        if (!s.ok()) {
+            throw StoreException("Unable to store global state. Key: " + key);
+        }
+    }
+
+    void Store::LoadPropertyIndexes(const shared_ptr<DataSet> &dataset, bool rebuild) {
+        string value;
+        string key("propindexes_" + dataset->GetName());
+        auto s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, key, &value);
+        if (s.IsNotFound()) {
+            return;
+        }
+        if (!s.ok()) {
+            throw StoreException("Unable to read " + key + " from _globalStateColumnFamily. Status: " + s.ToString());
+        }
+
+        auto properties = make_shared<map<string, bool>>();
+        bool building = false;
+        size_t offset = 0;
+        while (offset + sizeof(int) <= value.size()) {
+            int length;
+            memcpy((char *) &length, value.data() + offset, sizeof(length));
+            offset += sizeof(length);
+            if (length < 0 || offset + length + 1 > value.size()) {
+                throw StoreException("Malformed " + key + " in _globalStateColumnFamily");
+            }
+            auto ready = !rebuild && value[offset + length] != 0;
+            (*properties)[value.substr(offset, length)] = ready;
+            building = building || !ready;
+            offset += length + 1;
+        }
+
+        std::lock_guard<std::mutex> lock(_indexBuildMutex);
+        if (rebuild) {
+            SavePropertyIndexes(dataset, *properties);
+        }
+        dataset->SetIndexedProperties(properties);
+        if (building) {
+            StartPropertyIndexBuild(dataset);
+        }
+    }
+
+    void Store::StartPropertyIndexBuild(const shared_ptr<DataSet> &dataset) {
+        // a running build picks up properties added since it started
+        if (!_indexBuildsRunning.insert(dataset->GetName()).second) {
+            return;
+        }
+        _indexBuilds.emplace_back(&Store::BuildPropertyIndexes, this, dataset->GetName());
+    }
+
+    void Store::BuildPropertyIndexes(string dataset) {
+        while (!_closing) {
+            auto ds = GetDataSet(dataset);
+            vector<string> building;
+            {
+                std::lock_guard<std::mutex> lock(_indexBuildMutex);
+                if (ds != nullptr) {
+                    for (auto const &property : *ds->GetIndexedProperties()) {
+                        if (!property.second) building.push_back(property.first);
+                    }
+                }
+                if (building.empty()) {
+                    _indexBuildsRunning.erase(dataset);
+                    return;
+                }
+            }
+
+            try {
+                if (!BuildPropertyIndex(ds, building)) break;
+                _logger->info(R"({{ "store" : "{}" , "dataset" : "{}" , "op" : "property-index-build", "properties" : {}, "status" : "completed" }})",
+                              _name, dataset, building.size());
+            } catch (const exception &ex) {
+                _logger->error(R"({{ "store" : "{}" , "dataset" : "{}" , "op" : "property-index-build", "error" : "{}" }})",
+                               _name, dataset, ex.what());
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(_indexBuildMutex);
+        _indexBuildsRunning.erase(dataset);
+    }
+
+    bool Store::BuildPropertyIndex(const shared_ptr<DataSet> &dataset, const vector<string> &properties) {
+        auto indexColumnFamily = dataset->GetPropertyIndexColumnFamily();
+        const rocksdb::Snapshot *snapshot;
+        {
+            // with no commit in flight, old entries are cleared, writes start being recorded and the snapshot
+            // is taken, so every write is either in the snapshot or recorded
+            std::unique_lock<std::shared_timed_mutex> lock(_commitLock);
+            for (auto const &property : properties) {
+                auto status = _database->DeleteRange(WriteOptions(), indexColumnFamily, PropertyIndex::MakePropertyPrefix(property),
+                                                     PropertyIndex::MakePropertyEnd(property));
+                if (!status.ok()) {
+                    throw StoreException("Unable to clear the index of " + property + ". Status: " + status.ToString());
+                }
+            }
+            dataset->StartRecordingWrites();
+            snapshot = _database->GetSnapshot();
+        }
+
+        auto readOptions = rocksdb::ReadOptions();
+        readOptions.fill_cache = false;
+        readOptions.snapshot = snapshot;
+
+        // ranges of similar size from the sst boundaries, a few per worker to even out the work
+        auto workers = GetGraphWorkers();
+        vector<pair<string, string>> ranges;
+        string begin;
+        for (auto const &split : GetSplitKeys(dataset->GetStoreColumnFamily(), (size_t) workers * 4)) {
+            ranges.emplace_back(begin, split);
+            begin = split;
+        }
+        ranges.emplace_back(begin, "");
+
+        try {
+            ParallelForEach(ranges.size(), workers, 1, [&](size_t first, size_t last, int worker) {
+                rocksdb::WriteBatch batch;
+                vector<string> keys;
+                auto flush = [&]() {
+                    auto status = _database->Write(WriteOptions(), &batch);
+                    if (!status.ok()) {
+                        throw StoreException("Unable to write the property index. Status: " + status.ToString());
+                    }
+                    batch.Clear();
+                };
+
+                unique_ptr<rocksdb::Iterator> it(_database->NewIterator(readOptions, dataset->GetStoreColumnFamily()));
+                for (auto r = first; r < last; r++) {
+                    auto const &end = ranges[r].second;
+                    for (it->Seek(ranges[r].first); it->Valid() && !_closing; it->Next()) {
+                        if (!end.empty() && it->key().compare(end) >= 0) break;
+                        keys.clear();
+                        {
+                            auto namesLock = LockPropertyNames(it->value());
+                            PropertyIndex::GetKeys(it->value(), properties, _propertyNames, _propertyToIdIndex,
+                                                   it->key().ToString(), keys);
+                        }
+                        for (auto const &key : keys) {
+                            batch.Put(indexColumnFamily, key, Slice());
+                        }
+                        if (batch.Count() >= 1000) {
+                            flush();
+                        }
+                    }
+                }
+                flush();
+            });
+        } catch (...) {
+            dataset->StopRecordingWrites();
+            _database->ReleaseSnapshot(snapshot);
+            throw;
+        }
+
+        if (_closing) {
+            dataset->StopRecordingWrites();
+            _database->ReleaseSnapshot(snapshot);
+            return false;
+        }
+
+        {
+            // entities written since the snapshot may have had entries added from the version in it after their
+            // own write removed them, each is set to the entries of its current version
+            std::unique_lock<std::shared_timed_mutex> lock(_commitLock);
+            auto written = dataset->StopRecordingWrites();
+            std::sort(written.begin(), written.end());
+            written.erase(std::unique(written.begin(), written.end()), written.end());
+
+            rocksdb::WriteBatch batch;
+            vector<string> before, after;
+            for (auto const &id : written) {
+                string value;
+                before.clear();
+                after.clear();
+                if (_database->Get(readOptions, dataset->GetStoreColumnFamily(), id, &value).ok()) {
+                    auto namesLock = LockPropertyNames(value);
+                    PropertyIndex::GetKeys(value, properties, _propertyNames, _propertyToIdIndex, id, before);
+                }
+                if (_database->Get(rocksdb::ReadOptions(), dataset->GetStoreColumnFamily(), id, &value).ok()) {
+                    auto namesLock = LockPropertyNames(value);
+                    PropertyIndex::GetKeys(value, properties, _propertyNames, _propertyToIdIndex, id, after);
+                }
+                WritePropertyIndexDiff(batch, indexColumnFamily, before, after);
+            }
+
+            auto status = _database->Write(WriteOptions(), &batch);
+            _database->ReleaseSnapshot(snapshot);
+            if (!status.ok()) {
+                throw StoreException("Unable to write the property index. Status: " + status.ToString());
+            }
+
+            std::lock_guard<std::mutex> indexLock(_indexBuildMutex);
+            auto updated = make_shared<map<string, bool>>(*dataset->GetIndexedProperties());
+            for (auto const &property : properties) {
+                auto found = updated->find(property);
+                if (found != updated->end()) {
+                    found->second = true;
+                }
+            }
+            SavePropertyIndexes(dataset, *updated);
+            dataset->SetIndexedProperties(updated);
+        }
+        return true;
+    }
+
+    void Store::UpdateEncoding(const shared_ptr<DataSet> &dataset, bool binary) {
+        std::lock_guard<std::mutex> lock(_encodingMutex);
+        if (dataset->UsesBinaryEncoding() == binary) {
+            return;
+        }
+
+        // new writes take the new form straight away, the conversion rewrites the rest
+        SaveEncoding(dataset, binary, false);
+        dataset->SetBinaryEncoding(binary);
+        StartEncodingConversion(dataset);
+    }
+
+    void Store::SaveEncoding(const shared_ptr<DataSet> &dataset, bool binary, bool converted) {
+        // binary : converted
+        char value[2] = {(char) (binary ? 1 : 0), (char) (converted ? 1 : 0)};
+        string key("encoding_" + dataset->GetName());
+        auto s = _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, key, Slice(value, sizeof(value)));
+        if (!s.ok()) {
+            throw StoreException("Unable to store global state. Key: " + key);
+        }
+    }
+
+    void Store::LoadEncoding(const shared_ptr<DataSet> &dataset) {
+        string value;
+        string key("encoding_" + dataset->GetName());
+        auto s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, key, &value);
+        if (s.IsNotFound()) {
+            return;
+        }
+        if (!s.ok() || value.size() != 2) {
+            throw StoreException("Unable to read " + key + " from _globalStateColumnFamily. Status: " + s.ToString());
+        }
+
+        std::lock_guard<std::mutex> lock(_encodingMutex);
+        dataset->SetBinaryEncoding(value[0] != 0);
+        if (value[1] == 0) {
+            StartEncodingConversion(dataset);
+        }
+    }
+
+    void Store::StartEncodingConversion(const shared_ptr<DataSet> &dataset) {
+        // a running conversion goes round again when the encoding changes under it
+        if (!_encodingConversionsRunning.insert(dataset->GetName()).second) {
+            return;
+        }
+        _encodingConversions.emplace_back(&Store::ConvertEncoding, this, dataset->GetName());
+    }
+
+    void Store::ConvertEncoding(string dataset) {
+        while (!_closing) {
+            auto ds = GetDataSet(dataset);
+            if (ds == nullptr) break;
+            auto binary = ds->UsesBinaryEncoding();
+
+            try {
+                if (!ConvertEntities(ds, binary)) continue;
+
+                std::lock_guard<std::mutex> lock(_encodingMutex);
+                if (ds->UsesBinaryEncoding() == binary && GetDataSet(dataset) == ds) {
+                    SaveEncoding(ds, binary, true);
+                    _encodingConversionsRunning.erase(dataset);
+                    _logger->info(R"({{ "store" : "{}" , "dataset" : "{}" , "op" : "encoding-conversion", "encoding" : "{}", "status" : "completed" }})",
+                                  _name, dataset, binary ? "binary" : "json");
+                    return;
+                }
+            } catch (const exception &ex) {
+                _logger->error(R"({{ "store" : "{}" , "dataset" : "{}" , "op" : "encoding-conversion", "error" : "{}" }})",
+                               _name, dataset, ex.what());
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(_encodingMutex);
+        _encodingConversionsRunning.erase(dataset);
+    }
+
+    bool Store::ConvertEntities(const shared_ptr<DataSet> &dataset, bool binary) {
+        auto readOptions = rocksdb::ReadOptions();
+        readOptions.fill_cache = false;
+
+        // each entity is read again and rewritten with commits held off, so no write in between is lost.
+        // the size kept is that of the json written, so an unchanged entity still compares equal after it
+        auto convert = [&](const vector<string> &ids) {
+            std::unique_lock<std::shared_timed_mutex> lock(_commitLock);
+            rocksdb::WriteBatch batch;
+            string value, decoded, encoded;
+            for (auto const &id : ids) {
+                if (!_database->Get(rocksdb::ReadOptions(), dataset->GetStoreColumnFamily(), id, &value).ok() ||
+                    EntityCodec::IsBinary(value) == binary) {
+                    continue;
+                }
+
+                auto json = DecodeEntity(value, decoded);
+                if (binary) {
+                    if (!EntityCodec::Encode(json.data(), json.size(), [this](const char *name, size_t length) {
+                        return InternPropertyName(name, length);
+                    }, encoded)) {
+                        continue;
+                    }
+                    batch.Put(dataset->GetStoreColumnFamily(), id, encoded);
+                } else {
+                    long dataLength = json.size();
+                    batch.Put(dataset->GetSizeColumnFamily(), id, Slice((const char *) &dataLength, sizeof(dataLength)));
+                    batch.Put(dataset->GetStoreColumnFamily(), id, json);
+                }
+            }
+
+            auto status = _database->Write(WriteOptions(), &batch);
+            if (!status.ok()) {
+                throw StoreException("Unable to write converted entities. Status: " + status.ToString());
+            }
+        };
+
+        vector<string> ids;
+        uint64_t converted = 0;
+        unique_ptr<rocksdb::Iterator> it(_database->NewIterator(readOptions, dataset->GetStoreColumnFamily()));
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            if (_closing || dataset->UsesBinaryEncoding() != binary) {
+                return false;
+            }
+            if (EntityCodec::IsBinary(it->value()) == binary) continue;
+
+            ids.push_back(it->key().ToString());
+            if (ids.size() >= 1000) {
+                convert(ids);
+                converted += ids.size();
+                ids.clear();
+            }
+        }
+        if (!it->status().ok()) {
+            throw StoreException("Unable to read entities to convert. Status: " + it->status().ToString());
+        }
+        convert(ids);
+        converted += ids.size();
+
+        _logger->info(R"({{ "store" : "{}" , "dataset" : "{}" , "op" : "encoding-conversion", "entities" : {} }})",
+                      _name, dataset->GetName(), converted);
+        return !_closing;
     }
 
     string Store::GetMetadataEntity() {
@@ -181,10 +1146,7 @@ namespace webofdata {
         } else {
 
             ColumnFamilyHandle *cf;
-            ColumnFamilyOptions cfoptions;
-            cfoptions.compression = CompressionType::kLZ4Compression;
-
-            auto s = _database->CreateColumnFamily(cfoptions, name, &cf);
+            auto s = _database->CreateColumnFamily(GetColumnFamilyOptions(name), name, &cf);
 
             if (!s.ok()) {
                 throw StoreException("Unable to create column family " + name);
@@ -212,6 +1174,10 @@ namespace webofdata {
             int val;
             memcpy((char *) &val, value.data(), sizeof(val));
             _namespaceToIdIndex[ns] = val;
+
+            auto trie = make_shared<NamespaceTrie>(*GetNamespaceTrie());
+            trie->Insert(ns.data(), ns.length(), val);
+            std::atomic_store(&_namespaceTrie, shared_ptr<const NamespaceTrie>(trie));
             return val;
         } else if (status.kNotFound) {
             // wrap this is write batch
@@ -235,6 +1201,11 @@ namespace webofdata {
             _namespaceToIdIndex[ns] = _nextNamespaceId;
             _idToNamespaceIndex[_nextNamespaceId] = ns;
 
+            // readers keep using the old trie until the new one is swapped in
+            auto trie = make_shared<NamespaceTrie>(*GetNamespaceTrie());
+            trie->Insert(ns.data(), ns.length(), _nextNamespaceId);
+            std::atomic_store(&_namespaceTrie, shared_ptr<const NamespaceTrie>(trie));
+
             // update namespace json
             auto keyStr = string("ns" + to_string(_nextNamespaceId));
             Value key(keyStr.data(), _namespacesJsonDocument->GetAllocator());
@@ -252,23 +1223,51 @@ namespace webofdata {
         }
     }
 
+    ColumnFamilyOptions Store::GetColumnFamilyOptions(const string &name) {
+        ColumnFamilyOptions cfoptions;
+        if (name == "default") {
+            return cfoptions;
+        }
+
+        cfoptions.compression = CompressionType::kLZ4Compression;
+        if (name.compare(0, 16, "dataset::store::") == 0 || name.compare(0, 14, "dataset::log::") == 0) {
+            // small values repeating the same names and structure compress far better against a dictionary
+            cfoptions.compression = CompressionType::kZSTD;
+            cfoptions.compression_opts.max_dict_bytes = EntityDictionaryBytes;
+            cfoptions.compression_opts.zstd_max_train_bytes = EntityDictionaryTrainingBytes;
+#if ROCKSDB_MAJOR >= 6
+            cfoptions.periodic_compaction_seconds = EntityDictionaryRetrainSeconds;
+#endif
+        }
+        if (name == "presence") {
+            cfoptions.merge_operator = make_shared<PresenceMergeOperator>();
+        }
+        if (name == "degree") {
+            cfoptions.merge_operator = make_shared<CounterMergeOperator>();
+        }
+        return cfoptions;
+    }
+
     void Store::OpenRocksDb(string location) {
         rocksdb::Options options;
         options.create_if_missing = true;
         options.compression = CompressionType::kLZ4Compression;
 
+        // decompression is only timed above the default level
+        _statistics = rocksdb::CreateDBStatistics();
+        _statistics->set_stats_level(rocksdb::StatsLevel::kExceptTimeForMutex);
+        options.statistics = _statistics;
+
         vector<string> cfnames;
         DB::ListColumnFamilies(options, location, &cfnames);
         // status here is a bit bogus as it completes correctly for new stores but returns an IOError
 
-        ColumnFamilyOptions cfoptions;
-        cfoptions.compression = CompressionType::kLZ4Compression;
-
         if (cfnames.empty()) {
             _columnFamilies.push_back(ColumnFamilyDescriptor("default", ColumnFamilyOptions()));
         } else {
+            // column families with a merge operator must be reopened with it
             for (const auto &cfname : cfnames) {
-                _columnFamilies.push_back(ColumnFamilyDescriptor(cfname, ColumnFamilyOptions()));
+                _columnFamilies.push_back(ColumnFamilyDescriptor(cfname, GetColumnFamilyOptions(cfname)));
             }
         }
 
@@ -287,6 +1286,10 @@ namespace webofdata {
         _globalStateColumnFamily = AssertColumnFamily("global_state");
         _namespacesColumnFamily = AssertColumnFamily("namespaces");
         _pipeState = AssertColumnFamily("pipe_state");
+        _presenceColumnFamily = AssertColumnFamily("presence");
+        _storeInRefsColumnFamily = AssertColumnFamily("inrefs");
+        _degreeColumnFamily = AssertColumnFamily("degree");
+        _propertyColumnFamily = AssertColumnFamily("property_index");
 
         // load next dataset id
         string nextDataSetIdBytes;
@@ -319,6 +1322,7 @@ namespace webofdata {
         }
 
         // load existing namespace mappings
+        auto trie = make_shared<NamespaceTrie>();
         auto nsiter = _database->NewIterator(ReadOptions(), _namespacesColumnFamily);
         for (nsiter->SeekToFirst(); nsiter->Valid(); nsiter->Next()) {
             auto key = nsiter->key().ToString();
@@ -327,52 +1331,395 @@ namespace webofdata {
 
             _namespaceToIdIndex[key] = val;
             _idToNamespaceIndex[val] = key;
+            trie->Insert(key.data(), key.length(), val);
 
             auto keyStr = string("ns" + to_string(val));
             Value key1(keyStr.data(), _namespacesJsonDocument->GetAllocator());
             _namespacesJsonDocument->AddMember(key1, Value(StringRef(key.data())), _namespacesJsonDocument->GetAllocator());
         }
 
-        // update json document
-        StringBuffer buffer;
-        Writer<StringBuffer> writer(buffer);
-        _namespacesJsonDocument->Accept(writer);
-        _namespacesJson = make_shared<string>(buffer.GetString());
+        delete nsiter;
+        std::atomic_store(&_namespaceTrie, shared_ptr<const NamespaceTrie>(trie));
+
+        // update json document
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        _namespacesJsonDocument->Accept(writer);
+        _namespacesJson = make_shared<string>(buffer.GetString());
+
+        // load next property id
+        string nextPropertyIdBytes;
+        s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, "_next_property_id", &nextPropertyIdBytes);
+        if (s.ok()) {
+            memcpy((char *) &_nextPropertyId, nextPropertyIdBytes.data(), sizeof(_nextPropertyId));
+        } else {
+            if (s.kNotFound) {
+                _nextPropertyId = 0;
+            } else {
+                throw StoreException(
+                        "Unable to read _next_property_id from _globalStateColumnFamily. Status: " + s.ToString());
+            }
+        }
+        LoadPropertyNames();
+
+        // dataset keys begin dataset_name : dataset_id
+        auto iter = _database->NewIterator(ReadOptions(), _globalStateColumnFamily);
+        for (iter->Seek("dataset_"); iter->Valid() && iter->key().starts_with("dataset_"); iter->Next()) {
+
+            auto dataset_name = iter->key().ToString().substr(8);
+            // int dataset_id = atoi(iter->value().data());
+            int dataset_id;
+            memcpy(&dataset_id, (const char *) iter->value().data(), sizeof(dataset_id));
+
+            shared_ptr<DataSet> ds = make_shared<DataSet>(shared_from_this(), dataset_name, dataset_id);
+            _datasets[dataset_name] = ds;
+        }
+        delete iter;
+
+        // indexes declared before the store was closed, builds cut short resume. indexes written with
+        // another key layout are built again, the version is only recorded once they are marked for it
+        int propertyIndexFormat = 1;
+        string propertyIndexFormatBytes;
+        s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, "_property_index_format", &propertyIndexFormatBytes);
+        if (s.ok() && propertyIndexFormatBytes.size() == sizeof(propertyIndexFormat)) {
+            memcpy(&propertyIndexFormat, propertyIndexFormatBytes.data(), sizeof(propertyIndexFormat));
+        } else if (!s.ok() && !s.IsNotFound()) {
+            throw StoreException("Unable to read _property_index_format from _globalStateColumnFamily. Status: " + s.ToString());
+        }
+        for (auto const &ds : GetDataSets()) {
+            LoadPropertyIndexes(ds, propertyIndexFormat != PropertyIndex::FormatVersion);
+            LoadEncoding(ds);
+        }
+
+        // purges of deleted datasets cut short resume
+        unique_ptr<rocksdb::Iterator> purges(_database->NewIterator(ReadOptions(), _globalStateColumnFamily));
+        for (purges->Seek("purge_"); purges->Valid() && purges->key().starts_with("purge_"); purges->Next()) {
+            StartDataSetPurge(atoi(purges->key().ToString().substr(6).c_str()));
+        }
+        if (propertyIndexFormat != PropertyIndex::FormatVersion) {
+            int version = PropertyIndex::FormatVersion;
+            s = _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, "_property_index_format",
+                               Slice((const char *) &version, sizeof(version)));
+            if (!s.ok()) {
+                throw StoreException("Unable to store global state. Key: _property_index_format");
+            }
+        }
+
+        // a graph written before the store was closed, kept if its datasets are still here
+        if (boost::filesystem::exists(GetGraphPath())) {
+            try {
+                auto graph = GraphSnapshot::Open(GetGraphPath());
+                for (auto const &source : graph->GetSources()) {
+                    if (GetDataSet(source.dataset) == nullptr) {
+                        throw GraphException("dataset " + source.dataset + " no longer exists");
+                    }
+                }
+                std::atomic_store(&_graph, graph);
+            } catch (const exception &ex) {
+                _logger->warn(R"({{ "store" : "{}" , "op" : "graph-load", "error" : "{}" }})", _name, ex.what());
+            }
+        }
+
+        string presenceReady;
+        s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, "_presence_index_ready", &presenceReady);
+        if (s.ok()) {
+            _presenceIndexReady = true;
+        } else if (s.IsNotFound()) {
+            _presenceBackfill = std::thread(&Store::BackfillPresenceIndex, this);
+        } else {
+            throw StoreException("Unable to read _presence_index_ready from _globalStateColumnFamily. Status: " + s.ToString());
+        }
+
+        string inRefsIndex;
+        s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, "_store_inrefs_index", &inRefsIndex);
+        if (s.ok()) {
+            _storeInRefsIndexEnabled = true;
+            s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, "_store_inrefs_index_ready", &inRefsIndex);
+            if (s.ok()) {
+                _storeInRefsIndexReady = true;
+            } else if (s.IsNotFound()) {
+                _storeInRefsBackfill = std::thread(&Store::BackfillStoreInRefsIndex, this);
+            }
+        }
+        if (!s.ok() && !s.IsNotFound()) {
+            throw StoreException("Unable to read _store_inrefs_index from _globalStateColumnFamily. Status: " + s.ToString());
+        }
+
+        string degreeReady;
+        s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, "_degree_counters_ready", &degreeReady);
+        if (s.ok()) {
+            _degreeCountersReady = true;
+        } else if (s.IsNotFound()) {
+            _degreeBackfill = std::thread(&Store::BackfillDegreeCounters, this);
+        } else {
+            throw StoreException("Unable to read _degree_counters_ready from _globalStateColumnFamily. Status: " + s.ToString());
+        }
+    }
+
+    void Store::BackfillPresenceIndex() {
+        // writes made while this runs merge their own bits, or-ing the same bit twice is harmless
+        auto readOptions = rocksdb::ReadOptions();
+        readOptions.fill_cache = false;
+
+        for (auto const &ds : GetDataSets()) {
+            auto bitmap = MakeDataSetBitmap(ds->GetId());
+            rocksdb::WriteBatch batch;
+            rocksdb::Iterator *it = _database->NewIterator(readOptions, ds->GetSizeColumnFamily());
+            for (it->SeekToFirst(); it->Valid() && !_closing; it->Next()) {
+                batch.Merge(_presenceColumnFamily, it->key(), bitmap);
+                if (batch.Count() == 1000) {
+                    _database->Write(WriteOptions(), &batch);
+                    batch.Clear();
+                }
+            }
+            delete it;
+
+            if (_closing) return;
+            auto status = _database->Write(WriteOptions(), &batch);
+            if (!status.ok()) {
+                _logger->error(R"({{ "store" : "{}" , "op" : "presence-backfill", "error" : "{}" }})", _name, status.ToString());
+                return;
+            }
+        }
+
+        _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, "_presence_index_ready", "1");
+        _presenceIndexReady = true;
+        _logger->info(R"({{ "store" : "{}" , "op" : "presence-backfill", "status" : "completed" }})", _name);
+    }
+
+    static string MakeRefKeyPrefix(const string &id, const string &property) {
+        // idlen : id [ : proplen : property ]
+        int size_id = id.length();
+        string key((const char *) &size_id, sizeof(size_id));
+        key.append(id);
+        if (!property.empty()) {
+            int size_prop = property.length();
+            key.append((const char *) &size_prop, sizeof(size_prop));
+            key.append(property);
+        }
+        return key;
+    }
+
+    // the store wide inrefs key, the dataset's inrefs key followed by the dataset id. the refs to an id from
+    // every dataset share the dataset inrefs prefix, and the same ref held by several datasets sorts together
+    static string MakeStoreRefKey(const Slice &invkey, int datasetId) {
+        string key(invkey.data(), invkey.size());
+        key.append((const char *) &datasetId, sizeof(datasetId));
+        return key;
+    }
+
+    static int GetStoreRefDataSetId(const Slice &key) {
+        int datasetId;
+        memcpy((char *) &datasetId, key.data() + key.size() - sizeof(datasetId), sizeof(datasetId));
+        return datasetId;
+    }
+
+    void Store::EnableStoreInRefsIndex() {
+        if (_storeInRefsIndexEnabled) return;
+        if (_storeInRefsBackfill.joinable()) {
+            _storeInRefsBackfill.join();
+        }
+
+        auto status = _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, "_store_inrefs_index", "1");
+        if (!status.ok()) {
+            throw StoreException("Unable to store global state. Key: _store_inrefs_index");
+        }
+        _storeInRefsIndexEnabled = true;
+        _storeInRefsBackfill = std::thread(&Store::BackfillStoreInRefsIndex, this);
+    }
+
+    void Store::DisableStoreInRefsIndex() {
+        _storeInRefsIndexEnabled = false;
+        _storeInRefsIndexReady = false;
+        if (_storeInRefsBackfill.joinable()) {
+            _storeInRefsBackfill.join();
+        }
+
+        // entries left behind are cleared before the index is next backfilled
+        rocksdb::WriteBatch batch;
+        batch.Delete(_globalStateColumnFamily, "_store_inrefs_index");
+        batch.Delete(_globalStateColumnFamily, "_store_inrefs_index_ready");
+        auto status = _database->Write(WriteOptions(), &batch);
+        if (!status.ok()) {
+            throw StoreException("Unable to store global state. Key: _store_inrefs_index");
+        }
+    }
+
+    void Store::BackfillStoreInRefsIndex() {
+        auto readOptions = rocksdb::ReadOptions();
+        readOptions.fill_cache = false;
+
+        {
+            // anything still in the index is from before it was last disabled. no key starts with a length of -1
+            std::unique_lock<std::shared_timed_mutex> lock(_commitLock);
+            auto status = _database->DeleteRange(WriteOptions(), _storeInRefsColumnFamily, Slice(), Slice("\xff\xff\xff\xff", 4));
+            if (!status.ok()) {
+                _logger->error(R"({{ "store" : "{}" , "op" : "store-inrefs-backfill", "error" : "{}" }})", _name, status.ToString());
+                return;
+            }
+        }
+
+        vector<string> names;
+        for (auto const &ds : GetDataSets()) {
+            names.push_back(ds->GetName());
+        }
+
+        for (auto const &name : names) {
+            // chunks are copied with commits held off, each from a fresh iterator so it sees every commit before it
+            string cursor;
+            bool done = false;
+            while (!done) {
+                if (_closing || !_storeInRefsIndexEnabled) return;
+
+                std::unique_lock<std::shared_timed_mutex> lock(_commitLock);
+                auto ds = GetDataSet(name);
+                if (ds == nullptr) break; // deleted since the backfill started
+
+                rocksdb::WriteBatch batch;
+                unique_ptr<rocksdb::Iterator> it(_database->NewIterator(readOptions, ds->GetInRefsColumnFamily()));
+                for (it->Seek(cursor); it->Valid() && batch.Count() < 1000; it->Next()) {
+                    batch.Put(_storeInRefsColumnFamily, MakeStoreRefKey(it->key(), ds->GetId()), it->value());
+                    cursor.assign(it->key().data(), it->key().size());
+                }
+                done = !it->Valid();
+                cursor.push_back('\0'); // the key after the last one copied
+
+                auto status = _database->Write(WriteOptions(), &batch);
+                if (!status.ok()) {
+                    _logger->error(R"({{ "store" : "{}" , "op" : "store-inrefs-backfill", "error" : "{}" }})", _name, status.ToString());
+                    return;
+                }
+            }
+        }
+
+        _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, "_store_inrefs_index_ready", "1");
+        _storeInRefsIndexReady = true;
+        _logger->info(R"({{ "store" : "{}" , "op" : "store-inrefs-backfill", "status" : "completed" }})", _name);
+    }
+
+    bool Store::UseStoreInRefsIndex(const vector<shared_ptr<DataSet>> &datasets) {
+        // a single dataset's own inrefs are just as direct and need no filtering
+        return _storeInRefsIndexEnabled && _storeInRefsIndexReady && datasets.size() > 1;
+    }
+
+    // direction : idlen : id : proplen : property : dataset id, so the counters of an entity share a prefix
+    static string MakeDegreeKey(const string &id, const string &property, bool inverse, int datasetId) {
+        string key(1, inverse ? 'i' : 'o');
+        key.append(MakeRefKeyPrefix(id, property));
+        key.append((const char *) &datasetId, sizeof(datasetId));
+        return key;
+    }
+
+    // length of the idlen : id : proplen : property prefix of a ref key
+    static size_t GetRefKeyGroupLength(const Slice &key) {
+        int idLength, propertyLength;
+        memcpy((char *) &idLength, key.data(), sizeof(idLength));
+        memcpy((char *) &propertyLength, key.data() + sizeof(idLength) + idLength, sizeof(propertyLength));
+        return sizeof(idLength) + idLength + sizeof(propertyLength) + propertyLength;
+    }
+
+    void Store::BackfillDegreeCounters() {
+        for (auto const &ds : GetDataSets()) {
+            if (!ReconcileDegreeCounters(ds, false) || !ReconcileDegreeCounters(ds, true)) {
+                return;
+            }
+        }
+
+        _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, "_degree_counters_ready", "1");
+        _degreeCountersReady = true;
+        _logger->info(R"({{ "store" : "{}" , "op" : "degree-backfill", "status" : "completed" }})", _name);
+    }
+
+    bool Store::ReconcileDegreeCounters(const shared_ptr<DataSet> &dataset, bool inverse) {
+        // a counter holds the deltas of every write since counters existed. the refs and the counters are read
+        // from one snapshot and the difference merged in, so writes after it still add to the right total
+        auto snapshot = _database->GetSnapshot();
+        auto readOptions = rocksdb::ReadOptions();
+        readOptions.fill_cache = false;
+        readOptions.snapshot = snapshot;
+
+        auto datasetId = dataset->GetId();
+        auto refsColumnFamily = inverse ? dataset->GetInRefsColumnFamily() : dataset->GetOutRefsColumnFamily();
+        rocksdb::WriteBatch batch;
+        bool completed = true;
+
+        auto correct = [&](const string &degreeKey, int64_t count) {
+            string value;
+            auto status = _database->Get(readOptions, _degreeColumnFamily, degreeKey, &value);
+            auto delta = count - (status.ok() ? ReadCounter(value) : 0);
+            if (delta != 0) {
+                batch.Merge(_degreeColumnFamily, degreeKey, MakeCounterDelta(delta));
+            }
+            if (batch.Count() == 1000) {
+                _database->Write(WriteOptions(), &batch);
+                batch.Clear();
+            }
+        };
+
+        // refs of one entity and property are adjacent, count each run
+        unique_ptr<rocksdb::Iterator> it(_database->NewIterator(readOptions, refsColumnFamily));
+        string group;
+        int64_t count = 0;
+        string direction(1, inverse ? 'i' : 'o');
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            if (_closing) {
+                completed = false;
+                break;
+            }
+            Slice key(it->key().data(), GetRefKeyGroupLength(it->key()));
+            if (count > 0 && key != Slice(group)) {
+                correct(direction + group + string((const char *) &datasetId, sizeof(datasetId)), count);
+                count = 0;
+            }
+            if (count == 0) {
+                group = key.ToString();
+            }
+            count++;
+        }
+        if (completed && count > 0) {
+            correct(direction + group + string((const char *) &datasetId, sizeof(datasetId)), count);
+        }
+
+        // counters left without refs, from refs written before counters and removed since
+        unique_ptr<rocksdb::Iterator> counters(_database->NewIterator(readOptions, _degreeColumnFamily));
+        unique_ptr<rocksdb::Iterator> refs(_database->NewIterator(readOptions, refsColumnFamily));
+        for (counters->Seek(direction); completed && counters->Valid() && counters->key().starts_with(direction); counters->Next()) {
+            if (_closing) {
+                completed = false;
+                break;
+            }
+            auto key = counters->key();
+            if (GetStoreRefDataSetId(key) != datasetId || ReadCounter(counters->value()) == 0) {
+                continue;
+            }
 
-        // load next property id
-        string nextPropertyIdBytes;
-        s = _database->Get(rocksdb::ReadOptions(), _globalStateColumnFamily, "_next_property_id", &nextPropertyIdBytes);
-        if (s.ok()) {
-            memcpy((char *) &_nextPropertyId, nextPropertyIdBytes.data(), sizeof(_nextPropertyId));
-        } else {
-            if (s.kNotFound) {
-                _nextPropertyId = 0;
-            } else {
-                throw StoreException(
-                        "Unable to read _next_property_id from _globalStateColumnFamily. Status: " + s.ToString());
+            Slice prefix(key.data() + 1, key.size() - 1 - sizeof(datasetId));
+            refs->Seek(prefix);
+            if (!refs->Valid() || !refs->key().starts_with(prefix)) {
+                batch.Merge(_degreeColumnFamily, key, MakeCounterDelta(-ReadCounter(counters->value())));
             }
         }
 
-        // dataset keys begin dataset_name : dataset_id
-        auto iter = _database->NewIterator(ReadOptions(), _globalStateColumnFamily);
-        for (iter->Seek("dataset_"); iter->Valid() && iter->key().starts_with("dataset_"); iter->Next()) {
-
-            auto dataset_name = iter->key().ToString().substr(8);
-            // int dataset_id = atoi(iter->value().data());
-            int dataset_id;
-            memcpy(&dataset_id, (const char *) iter->value().data(), sizeof(dataset_id));
+        _database->ReleaseSnapshot(snapshot);
+        if (!completed) {
+            return false;
+        }
 
-            shared_ptr<DataSet> ds = make_shared<DataSet>(shared_from_this(), dataset_name, dataset_id);
-            _datasets[dataset_name] = ds;
+        auto status = _database->Write(WriteOptions(), &batch);
+        if (!status.ok()) {
+            _logger->error(R"({{ "store" : "{}" , "op" : "degree-backfill", "error" : "{}" }})", _name, status.ToString());
+            return false;
         }
-        delete iter;
+        return true;
     }
 
     Store::~Store() {
+        StopBackgroundWork();
     }
 
     void Store::Delete() {
         try {
+            StopBackgroundWork();
             delete _database;
             boost::filesystem::remove_all(boost::filesystem::path(_storeLocation));
         } catch (const exception &ex) {
@@ -426,11 +1773,121 @@ namespace webofdata {
         }
     }
 
+    long Store::StoreEntitiesNdJson(std::istream &data, string dataset) {
+        auto ds = AssertDataSet(std::move(dataset));
+        EntityHandler handler(shared_from_this(), ds, make_shared<rocksdb::WriteBatch>(), true);
+        Reader reader;
+        string line;
+        long lineNumber = 0;
+
+        // each line is a complete entity so it is parsed on its own, the context line comes first
+        while (std::getline(data, line)) {
+            lineNumber++;
+            if (line.find_first_not_of(" \t\r") == string::npos) continue;
+
+            try {
+                StringStream ss(line.data());
+                reader.Parse(ss, handler);
+            } catch (const ParseException &ex) {
+                throw StoreException(
+                        "Error parsing entity : error at line: " + std::to_string(lineNumber) + " position: " +
+                        std::to_string(ex.Offset()) + " parse error was: " + string(GetParseError_En(ex.Code())));
+            }
+        }
+
+        handler.Flush();
+        return handler.GetEntityCount();
+    }
+
+    // ids of the entities a batch writes, from its puts to a dataset's size column family
+    class EntityIdCollector : public rocksdb::WriteBatch::Handler {
+    private:
+        uint32_t _sizeColumnFamily;
+
+    public:
+        vector<string> ids;
+
+        explicit EntityIdCollector(uint32_t sizeColumnFamily) : _sizeColumnFamily(sizeColumnFamily) {}
+
+        rocksdb::Status PutCF(uint32_t columnFamilyId, const Slice &key, const Slice &value) override {
+            if (columnFamilyId == _sizeColumnFamily) {
+                ids.push_back(key.ToString());
+            }
+            return rocksdb::Status::OK();
+        }
+
+        rocksdb::Status DeleteCF(uint32_t columnFamilyId, const Slice &key) override {
+            return rocksdb::Status::OK();
+        }
+
+        rocksdb::Status MergeCF(uint32_t columnFamilyId, const Slice &key, const Slice &value) override {
+            return rocksdb::Status::OK();
+        }
+    };
+
+    // sequences of the log entries a batch writes, log keys lead with the sequence
+    class LogSequenceCollector : public rocksdb::WriteBatch::Handler {
+    private:
+        uint32_t _logColumnFamily;
+
+    public:
+        vector<ulong> sequences;
+
+        explicit LogSequenceCollector(uint32_t logColumnFamily) : _logColumnFamily(logColumnFamily) {}
+
+        rocksdb::Status PutCF(uint32_t columnFamilyId, const Slice &key, const Slice &value) override {
+            ulong sequence;
+            if (columnFamilyId == _logColumnFamily && key.size() >= sizeof(sequence)) {
+                memcpy(&sequence, key.data(), sizeof(sequence));
+                sequences.push_back(sequence);
+            }
+            return rocksdb::Status::OK();
+        }
+
+        rocksdb::Status DeleteCF(uint32_t columnFamilyId, const Slice &key) override {
+            return rocksdb::Status::OK();
+        }
+
+        rocksdb::Status MergeCF(uint32_t columnFamilyId, const Slice &key, const Slice &value) override {
+            return rocksdb::Status::OK();
+        }
+    };
+
     void Store::WriteBatch(string& dataset,long firstOffset, shared_ptr<rocksdb::WriteBatch> writeBatch) {
+        auto ds = GetDataSet(dataset);
+        std::shared_lock<std::shared_timed_mutex> commitLock(_commitLock);
+
         auto result = _database->Write(WriteOptions(), writeBatch.get());
+
+        // written or failed, the batch's sequences no longer hold back the committed sequence
+        if (ds != nullptr) {
+            LogSequenceCollector collector(ds->GetLogColumnFamily()->GetID());
+            writeBatch->Iterate(&collector);
+            ds->EndSequenceIds(collector.sequences);
+        }
+
         if (!result.ok()) {
             throw StoreException("Unable to write batch. Error: " + result.ToString());
         }
+
+        if (ds != nullptr) {
+            // a property index build brings the entities written while it ran up to date
+            if (ds->IsRecordingWrites()) {
+                EntityIdCollector collector(ds->GetSizeColumnFamily()->GetID());
+                writeBatch->Iterate(&collector);
+                ds->RecordWrites(collector.ids);
+            }
+
+            // only after the commit, so a read racing the write can't cache the old entity as current
+            ds->MarkWritten();
+        }
+    }
+
+    void Store::DiscardBatch(const shared_ptr<DataSet> &dataset, rocksdb::WriteBatch &writeBatch) {
+        LogSequenceCollector collector(dataset->GetLogColumnFamily()->GetID());
+        writeBatch.Iterate(&collector);
+        dataset->EndSequenceIds(collector.sequences);
+        writeBatch.Clear();
     }
 
     shared_ptr<DataSet> Store::GetDataSet(string name) {
@@ -449,12 +1906,9 @@ namespace webofdata {
         // TODO: fix scope of this lock.
         std::lock_guard<std::mutex> lock(assert_dataset_mutex);
         auto iter = _datasets.find(dataset);
-        if (iter != _datasets.end()) {
-            _datasets.erase(iter);
-        }
-
         if (iter == _datasets.end()) return; // no dataset
         auto ds = iter->second;
+        _datasets.erase(iter);
 
         // delete all the column families
         auto cfs = ds->GetColumnFamilies();
@@ -466,7 +1920,87 @@ namespace webofdata {
         // delete global info about dataset
         std::string key = string("dataset_") + ds->GetName();
         _database->Delete(rocksdb::WriteOptions(), _globalStateColumnFamily, key);
+        _database->Delete(rocksdb::WriteOptions(), _globalStateColumnFamily, "propindexes_" + ds->GetName());
+        _database->Delete(rocksdb::WriteOptions(), _globalStateColumnFamily, "encoding_" + ds->GetName());
+
+        // dataset ids are not reused, so what is left under this one can go at any pace
+        auto purgeKey = "purge_" + to_string(ds->GetId());
+        auto status = _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, purgeKey, "1");
+        if (!status.ok()) {
+            throw StoreException("Unable to store global state. Key: " + purgeKey);
+        }
+        StartDataSetPurge(ds->GetId());
+    }
+
+    void Store::StartDataSetPurge(int datasetId) {
+        std::lock_guard<std::mutex> lock(_purgeMutex);
+        _pendingPurges++;
+        _purges.emplace_back(&Store::PurgeDataSet, this, datasetId);
+    }
+
+    void Store::PurgeDataSet(int datasetId) {
+        // the dataset's bit is cleared from the presence bitmaps, an id in no other dataset loses its entry
+        auto index = (size_t) datasetId / 8;
+        auto mask = (char) (1 << (datasetId % 8));
+        auto purged = PurgeEntries(_presenceColumnFamily, [&](const Slice &key, const Slice &value, rocksdb::WriteBatch &batch) {
+            if (!DataSetBitmapContains(value, datasetId)) return;
+            string bitmap(value.data(), value.size());
+            bitmap[index] &= ~mask;
+            if (bitmap.find_first_not_of('\0') == string::npos) {
+                batch.Delete(_presenceColumnFamily, key);
+            } else {
+                batch.Put(_presenceColumnFamily, key, bitmap);
+            }
+        });
+        if (!purged) return;
+
+        // its rows in the store wide inrefs index, which end with the dataset id
+        purged = PurgeEntries(_storeInRefsColumnFamily, [&](const Slice &key, const Slice &, rocksdb::WriteBatch &batch) {
+            if (GetStoreRefDataSetId(key) == datasetId) batch.Delete(_storeInRefsColumnFamily, key);
+        });
+        if (!purged) return;
+
+        // and its degree counters, keyed the same way
+        purged = PurgeEntries(_degreeColumnFamily, [&](const Slice &key, const Slice &, rocksdb::WriteBatch &batch) {
+            if (GetStoreRefDataSetId(key) == datasetId) batch.Delete(_degreeColumnFamily, key);
+        });
+        if (!purged) return;
+
+        _database->Delete(rocksdb::WriteOptions(), _globalStateColumnFamily, "purge_" + to_string(datasetId));
+        _pendingPurges--;
+        _logger->info(R"({{ "store" : "{}" , "op" : "dataset-purge", "dataset-id" : {}, "status" : "completed" }})", _name, datasetId);
+    }
+
+    bool Store::PurgeEntries(ColumnFamilyHandle *columnFamily,
+                             const function<void(const Slice &key, const Slice &value, rocksdb::WriteBatch &batch)> &purge) {
+        auto readOptions = rocksdb::ReadOptions();
+        readOptions.fill_cache = false;
+
+        // each chunk reads from a fresh iterator with commits held off, so a merge can't land between the
+        // read of an entry and its rewrite
+        string cursor;
+        bool done = false;
+        while (!done) {
+            if (_closing) return false;
+
+            std::unique_lock<std::shared_timed_mutex> lock(_commitLock);
+            rocksdb::WriteBatch batch;
+            unique_ptr<rocksdb::Iterator> it(_database->NewIterator(readOptions, columnFamily));
+            size_t scanned = 0;
+            for (it->Seek(cursor); it->Valid() && scanned < 10000; it->Next(), scanned++) {
+                purge(it->key(), it->value(), batch);
+                cursor.assign(it->key().data(), it->key().size());
+            }
+            done = !it->Valid();
+            cursor.push_back('\0'); // the key after the last one scanned
 
+            auto status = _database->Write(WriteOptions(), &batch);
+            if (!status.ok()) {
+                _logger->error(R"({{ "store" : "{}" , "op" : "dataset-purge", "error" : "{}" }})", _name, status.ToString());
+                return false;
+            }
+        }
+        return true;
     }
 
     shared_ptr<DataSet> Store::AssertDataSet(string name) {
@@ -502,6 +2036,7 @@ namespace webofdata {
     }
 
     vector<shared_ptr<DataSet>> Store::GetDataSets() {
+        std::lock_guard<std::mutex> lock(assert_dataset_mutex);
         vector<shared_ptr<DataSet>> datasets;
         for (auto const &kv : _datasets) {
             datasets.push_back(kv.second);
@@ -521,6 +2056,16 @@ namespace webofdata {
         memcpy(buffer.get(), (char *) &dataLength, sizeof(dataLength));
         Slice dataLengthVal(buffer.get(), sizeof(dataLength));
 
+        // the size kept is always that of the json, so sizes compare whatever form either version is in
+        string encoded;
+        Slice stored(data);
+        if (dataset->UsesBinaryEncoding() &&
+            EntityCodec::Encode(data.data(), data.length(), [this](const char *name, size_t length) {
+                return InternPropertyName(name, length);
+            }, encoded)) {
+            stored = Slice(encoded);
+        }
+
         PinnableSlice existingLengthValue;
         bool isUpdate = false;
         bool isInsert = false;
@@ -541,9 +2086,15 @@ namespace webofdata {
                                                     &existingData);
 
                 if (getDataStatus.ok()) {
+                    // the same bytes in the same form need no parsing
+                    if (existingData == stored) {
+                        return;
+                    }
+
+                    string decoded;
+                    auto existingJson = DecodeEntity(existingData, decoded);
                     Document currentData;
-                    string exdat(existingData.data(), existingData.size());
-                    currentData.Parse((char *) existingData.data(), existingData.size());
+                    currentData.Parse((char *) existingJson.data(), existingJson.size());
 
                     Document newData;
                     newData.Parse((char *) data.data());
@@ -570,7 +2121,31 @@ namespace webofdata {
         // -------------------------------------------------------------------------------------
 
         writeBatch->Put(dataset->GetSizeColumnFamily(), id, dataLengthVal);
-        writeBatch->Put(dataset->GetStoreColumnFamily(), id, data);
+        writeBatch->Put(dataset->GetStoreColumnFamily(), id, stored);
+
+        if (isInsert) {
+            writeBatch->Merge(_presenceColumnFamily, id, MakeDataSetBitmap(dataset->GetId()));
+        }
+
+        // property index entries of the values that changed
+        auto indexed = dataset->GetIndexedProperties();
+        if (!indexed->empty()) {
+            vector<string> properties;
+            for (auto const &property : *indexed) {
+                properties.push_back(property.first);
+            }
+
+            vector<string> before, after;
+            PropertyIndex::GetKeys(data.data(), data.length(), properties, id, after);
+            if (isUpdate) {
+                PinnableSlice existingData;
+                if (_database->Get(ReadOptions(), dataset->GetStoreColumnFamily(), id, &existingData).ok()) {
+                    auto namesLock = LockPropertyNames(existingData);
+                    PropertyIndex::GetKeys(existingData, properties, _propertyNames, _propertyToIdIndex, id, before);
+                }
+            }
+            WritePropertyIndexDiff(*writeBatch, dataset->GetPropertyIndexColumnFamily(), before, after);
+        }
 
         // -------------------------------------------------------------------------------------
         // Write log entry
@@ -594,6 +2169,13 @@ namespace webofdata {
         // If update, then find and remove refs (do a diff)
         // -------------------------------------------------------------------------------------
 
+        // a ref listed twice is stored once, so it must only be counted once
+        std::sort(outrefs.begin(), outrefs.end());
+        outrefs.erase(std::unique(outrefs.begin(), outrefs.end()), outrefs.end());
+
+        // the change in the number of refs from this entity by property
+        map<string, int64_t> outDegrees;
+
         if (isUpdate) {
             // outrefs:  idsize : entityId : propidsize : propid : relatedentityidsize : relatedentityid -> relatedentityid
             int size_id = id.length();
@@ -611,15 +2193,14 @@ namespace webofdata {
                  it->Valid() && it->key().starts_with(key);
                  it->Next()) {
 
-                string relatedEntityId(it->value().data());
-                string relatedPropertyId;
+                string relatedEntityId(it->value().data(), it->value().size());
 
                 // read property id length
                 int propIdLength;
                 memcpy((char *) &propIdLength, it->key().data() + searchKeyBufferSize, sizeof(propIdLength));
 
                 // get property id
-                memcpy((char *) &relatedPropertyId, it->key().data() + searchKeyBufferSize + sizeof(propIdLength), propIdLength);
+                string relatedPropertyId(it->key().data() + searchKeyBufferSize + sizeof(propIdLength), propIdLength);
 
                 // try and find and remove it from outrefs
                 auto p = pair<string, string>(relatedPropertyId, relatedEntityId);
@@ -651,16 +2232,23 @@ namespace webofdata {
                            relatedPropertyId.data(), relatedPropertyId.length());
 
                     // relatedidlen : relatedid
-                    memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + id.length() + sizeof(size_property) +
+                    memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length() + sizeof(size_property) +
                            relatedPropertyId.length(),
                            (char *) &size_id, sizeof(size_id));
-                    memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + id.length() + sizeof(size_property) +
+                    memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length() + sizeof(size_property) +
                            relatedPropertyId.length() + sizeof(size_id),
                            id.data(), id.length());
 
                     string invkey(refKeyBuffer.get(), refKeyBufferSize);
 
                     writeBatch->Delete(dataset->GetInRefsColumnFamily(), invkey);
+                    if (_storeInRefsIndexEnabled) {
+                        writeBatch->Delete(_storeInRefsColumnFamily, MakeStoreRefKey(invkey, dataset->GetId()));
+                    }
+
+                    outDegrees[relatedPropertyId]--;
+                    writeBatch->Merge(_degreeColumnFamily, MakeDegreeKey(relatedEntityId, relatedPropertyId, true, dataset->GetId()),
+                                      MakeCounterDelta(-1));
                 }
             }
             delete it;
@@ -686,444 +2274,1082 @@ namespace webofdata {
             memcpy(refKeyBuffer.get(), (char *) &size_id, sizeof(size_id));
             memcpy(refKeyBuffer.get() + sizeof(size_id), id.data(), id.length());
 
-            // proplen : prop
-            memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length(), (char *) &size_property, sizeof(size_property));
-            memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length() + sizeof(size_property),
-                   propId.data(), propId.length());
+            // proplen : prop
+            memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length(), (char *) &size_property, sizeof(size_property));
+            memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length() + sizeof(size_property),
+                   propId.data(), propId.length());
+
+            // relatedidlen : relatedid
+            memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length() + sizeof(size_property) + propId.length(),
+                   (char *) &size_relatedEntityId, sizeof(size_relatedEntityId));
+            memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length() + sizeof(size_property) + propId.length() +
+                   sizeof(size_relatedEntityId),
+                   relatedEntityId.data(), relatedEntityId.length());
+
+            string key(refKeyBuffer.get(), refKeyBufferSize);
+
+            // insert
+            writeBatch->Put(dataset->GetOutRefsColumnFamily(), key, relatedEntityId);
+
+
+            // AND the inverse key
+            // same size as the out key so reuse the buffer from above
+
+            memcpy(refKeyBuffer.get(), (char *) &size_relatedEntityId, sizeof(size_relatedEntityId));
+            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId), relatedEntityId.data(), relatedEntityId.length());
+
+            // proplen : prop
+            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length(),
+                   (char *) &size_property, sizeof(size_property));
+            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length() + sizeof(size_property),
+                   propId.data(), propId.length());
+
+            // relatedidlen : relatedid
+            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length() +
+                   sizeof(size_property) + propId.length(),
+                   (char *) &size_id, sizeof(size_id));
+            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length() +
+                   sizeof(size_property) + propId.length() + sizeof(size_id),
+                   id.data(), id.length());
+
+            string invkey(refKeyBuffer.get(), refKeyBufferSize);
+
+            writeBatch->Put(dataset->GetInRefsColumnFamily(), invkey, id);
+            if (_storeInRefsIndexEnabled) {
+                writeBatch->Put(_storeInRefsColumnFamily, MakeStoreRefKey(invkey, dataset->GetId()), id);
+            }
+
+            outDegrees[propId]++;
+            writeBatch->Merge(_degreeColumnFamily, MakeDegreeKey(relatedEntityId, propId, true, dataset->GetId()), MakeCounterDelta(1));
+        }
+
+        for (auto const &degree : outDegrees) {
+            if (degree.second != 0) {
+                writeBatch->Merge(_degreeColumnFamily, MakeDegreeKey(id, degree.first, false, dataset->GetId()),
+                                  MakeCounterDelta(degree.second));
+            }
+        }
+    }
+
+    string Store::GetResourceId(string resourceUri) {
+        if (resourceUri.compare(0, 4, "http") == 0) {
+            // one walk over the uri finds the last hash or slash and the namespace ending there
+            auto match = GetNamespaceTrie()->MatchLastSeparator(resourceUri.data(), resourceUri.length());
+            if (match.separator == std::string::npos) {
+                throw StoreException("No hash or slash found in URL");
+            }
+
+            if (match.prefixId == -1) {
+                throw StoreException("Namespace prefix not found. Prefix is: " + resourceUri.substr(0, match.separator + 1));
+            }
+
+            string rid;
+            auto nameOffset = match.separator + 1;
+            WriteNamespacedId(rid, match.prefixId, resourceUri.data() + nameOffset, resourceUri.length() - nameOffset);
+            return rid;
+
+        } else {
+            throw StoreException("Resource URL doesnt start with http ");
+        }
+    }
+
+    void Store::LoadPropertyNames() {
+        // each name has an entry to its number and an inverse one keyed by the number, a name never
+        // ends in a zero byte so the inverse entries are the four byte keys that do
+        std::unique_lock<std::shared_timed_mutex> lock(_propertyNamesLock);
+        _propertyNames.assign((size_t) _nextPropertyId + 1, string());
+        unique_ptr<rocksdb::Iterator> it(_database->NewIterator(ReadOptions(), _propertyColumnFamily));
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            if (it->key().size() != sizeof(int) || it->key()[sizeof(int) - 1] != 0) continue;
+            int propertyId;
+            memcpy((char *) &propertyId, it->key().data(), sizeof(propertyId));
+            if (propertyId <= 0 || propertyId > _nextPropertyId) continue;
+            _propertyNames[propertyId] = it->value().ToString();
+            _propertyToIdIndex[_propertyNames[propertyId]] = propertyId;
+        }
+    }
+
+    int Store::AssertProperty(string ns_name) {
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(_propertyNamesLock);
+            auto iter = _propertyToIdIndex.find(ns_name);
+            if (iter != _propertyToIdIndex.end()) {
+                return iter->second;
+            }
+        }
+
+        // every name is loaded at open, so one not in the cache is new unless another thread just added it
+        std::lock_guard<std::mutex> lock(assert_property_mutex);
+        {
+            std::shared_lock<std::shared_timed_mutex> namesLock(_propertyNamesLock);
+            auto iter = _propertyToIdIndex.find(ns_name);
+            if (iter != _propertyToIdIndex.end()) {
+                return iter->second;
+            }
+        }
+
+        auto propertyId = _nextPropertyId + 1;
+        Slice val((const char *) &propertyId, sizeof(propertyId));
+
+        // the counter, the entry and its inverse together
+        rocksdb::WriteBatch batch;
+        batch.Put(_globalStateColumnFamily, "_next_property_id", val);
+        batch.Put(_propertyColumnFamily, ns_name, val);
+        batch.Put(_propertyColumnFamily, val, ns_name);
+        auto s = _database->Write(rocksdb::WriteOptions(), &batch);
+        if (!s.ok()) {
+            throw StoreException("Error in assert property " + s.ToString());
+        }
+
+        // update local cache
+        std::unique_lock<std::shared_timed_mutex> namesLock(_propertyNamesLock);
+        _nextPropertyId = propertyId;
+        _propertyNames.resize((size_t) propertyId + 1);
+        _propertyNames[propertyId] = ns_name;
+        _propertyToIdIndex[ns_name] = propertyId;
+        return propertyId;
+    }
+
+    uint32_t Store::InternPropertyName(const char *name, size_t length) {
+        return (uint32_t) AssertProperty(string(name, length));
+    }
+
+    Slice Store::DecodeEntity(const Slice &stored, string &buffer) {
+        if (!EntityCodec::IsBinary(stored)) {
+            return stored;
+        }
+
+        buffer.clear();
+        std::shared_lock<std::shared_timed_mutex> lock(_propertyNamesLock);
+        if (!EntityCodec::ToJson(stored, _propertyNames, buffer)) {
+            throw StoreException("Malformed binary entity");
+        }
+        return Slice(buffer);
+    }
+
+    std::shared_lock<std::shared_timed_mutex> Store::LockPropertyNames(const Slice &stored) {
+        std::shared_lock<std::shared_timed_mutex> lock(_propertyNamesLock, std::defer_lock);
+        if (EntityCodec::IsBinary(stored)) {
+            lock.lock();
+        }
+        return lock;
+    }
+
+    bool Store::FilterEntity(const Slice &stored, EntityFilter *filter, string &buffer, Slice &output) {
+        if (filter == nullptr) {
+            output = DecodeEntity(stored, buffer);
+            return true;
+        }
+        auto namesLock = LockPropertyNames(stored);
+        return filter->Apply(stored, _propertyNames, _propertyToIdIndex, output);
+    }
+
+    ReadOptions Store::GetMultiGetReadOptions() {
+        ReadOptions readOptions;
+#if ROCKSDB_MAJOR > 7 || (ROCKSDB_MAJOR == 7 && ROCKSDB_MINOR >= 6)
+        // lets MultiGet overlap the reads of different files where the build supports it
+        readOptions.async_io = true;
+#endif
+        return readOptions;
+    }
+
+    vector<shared_ptr<DataSet>> Store::ResolveDataSets(const vector<string> &datasets) {
+        if (datasets.empty()) {
+            return GetDataSets();
+        }
+
+        vector<shared_ptr<DataSet>> resolved;
+        for (auto const &dsname : datasets) {
+            auto ds = GetDataSet(dsname);
+            if (ds != nullptr) {
+                resolved.push_back(ds);
+            }
+        }
+        return resolved;
+    }
+
+    vector<vector<shared_ptr<DataSet>>> Store::ResolveDataSets(const vector<string> &ids, const vector<string> &datasets) {
+        auto resolved = ResolveDataSets(datasets);
+        vector<vector<shared_ptr<DataSet>>> sources(ids.size());
+
+        // named datasets are read as given, otherwise look in all that hold the id or in every
+        // dataset until the presence index is complete
+        if (!datasets.empty() || !_presenceIndexReady) {
+            for (auto &idSources : sources) {
+                idSources = resolved;
+            }
+            return sources;
+        }
+
+        auto count = ids.size();
+        vector<ColumnFamilyHandle *> columnFamilies(count, _presenceColumnFamily);
+        vector<Slice> keys;
+        keys.reserve(count);
+        for (auto const &id : ids) {
+            keys.emplace_back(id);
+        }
+        vector<PinnableSlice> bitmaps(count);
+        vector<Status> statuses(count);
+        _database->MultiGet(GetMultiGetReadOptions(), count, columnFamilies.data(), keys.data(), bitmaps.data(), statuses.data());
+
+        for (size_t i = 0; i < count; i++) {
+            if (statuses[i].IsNotFound()) {
+                continue;
+            }
+            if (!statuses[i].ok()) {
+                sources[i] = resolved;
+                continue;
+            }
+            for (auto const &ds : resolved) {
+                if (DataSetBitmapContains(bitmaps[i], ds->GetId())) {
+                    sources[i].push_back(ds);
+                }
+            }
+        }
+        return sources;
+    }
+
+    shared_ptr<string> Store::GetEntity(string id, const vector<string> &datasets) {
+        return GetEntities(vector<string>{id}, datasets)[0];
+    }
+
+    vector<shared_ptr<string>> Store::GetEntities(const vector<string> &ids, const vector<string> &datasets) {
+        auto sources = ResolveDataSets(ids, datasets);
+        auto cache = std::atomic_load(&_entityCache);
+        if (cache == nullptr) {
+            return ReadEntities(ids, sources);
+        }
+
+        // key on the id and the ids of the datasets merged, read the generations before the entity
+        vector<shared_ptr<string>> entities(ids.size());
+        vector<string> keys(ids.size());
+        vector<vector<ulong>> generations(ids.size());
+        vector<string> missingIds;
+        vector<vector<shared_ptr<DataSet>>> missingSources;
+        vector<size_t> missingPositions;
+
+        for (size_t i = 0; i < ids.size(); i++) {
+            keys[i] = ids[i];
+            generations[i].reserve(sources[i].size());
+            for (auto const &ds : sources[i]) {
+                keys[i].push_back('|');
+                keys[i].append(to_string(ds->GetId()));
+                generations[i].push_back(ds->GetWriteGeneration());
+            }
+
+            entities[i] = cache->Get(keys[i], generations[i]);
+            if (entities[i] == nullptr) {
+                missingIds.push_back(ids[i]);
+                missingSources.push_back(std::move(sources[i]));
+                missingPositions.push_back(i);
+            }
+        }
+
+        if (missingIds.empty()) {
+            return entities;
+        }
+
+        auto read = ReadEntities(missingIds, missingSources);
+        for (size_t m = 0; m < read.size(); m++) {
+            auto position = missingPositions[m];
+            cache->Put(keys[position], generations[position], read[m]);
+            entities[position] = std::move(read[m]);
+        }
+        return entities;
+    }
+
+    vector<shared_ptr<string>> Store::ReadEntities(const vector<string> &ids, const vector<vector<shared_ptr<DataSet>>> &sources) {
+        // one batched read across the store column families of every (id, dataset) pair
+        vector<ColumnFamilyHandle *> columnFamilies;
+        vector<Slice> keys;
+        for (size_t i = 0; i < ids.size(); i++) {
+            for (auto const &ds : sources[i]) {
+                columnFamilies.push_back(ds->GetStoreColumnFamily());
+                keys.emplace_back(ids[i]);
+            }
+        }
+
+        auto count = keys.size();
+        vector<PinnableSlice> values(count);
+        vector<Status> statuses(count);
+        if (count > 0) {
+            _database->MultiGet(GetMultiGetReadOptions(), count, columnFamilies.data(), keys.data(), values.data(), statuses.data());
+        }
+
+        vector<shared_ptr<string>> entities;
+        entities.reserve(ids.size());
+        vector<Slice> partials;
+        vector<string> decoded;
+        size_t next = 0;
+        for (size_t i = 0; i < ids.size(); i++) {
+            auto const &id = ids[i];
+            partials.clear();
+            decoded.resize(std::max(decoded.size(), sources[i].size()));
+            for (size_t j = 0; j < sources[i].size(); j++, next++) {
+                if (statuses[next].ok()) {
+                    partials.push_back(DecodeEntity(values[next], decoded[j]));
+                } else if (!statuses[next].IsNotFound()) {
+                    throw StoreException("Unable to read entity " + id + ". Status: " + statuses[next].ToString());
+                }
+            }
+
+            if (partials.empty()) {
+                // if we havent found any then return the stub
+                entities.push_back(make_shared<string>("{ \"@id\" : \"" + id + "\" }"));
+            } else if (partials.size() == 1) {
+                entities.push_back(make_shared<string>(partials[0].data(), partials[0].size()));
+            } else {
+                auto merged = make_shared<string>();
+                if (!EntityMerger::Merge(partials, *merged)) {
+                    throw StoreException("Unable to merge entity " + id + ", a stored partial is not valid json");
+                }
+                entities.push_back(merged);
+            }
+        }
+        return entities;
+    }
+
+    void Store::WriteEntityToStream(string id, const vector<string> &datasets, EntityStreamWriter &stream) {
+        auto entityJson = this->GetEntity(id, datasets);
+        stream.WriteEntity(entityJson->data(), (int) entityJson->size());
+    }
+
+    void Store::WriteCompleteEntityToStream(string sid, const vector<string> &datasets, EntityStreamWriter &stream) {
+        auto rid = GetResourceId(sid);
+        auto entityJson = this->GetEntity(rid, datasets);
+        stream.WriteContext(*_namespacesJson);
+        stream.WriteEntity(entityJson->data(), (int) entityJson->size());
+        stream.WriteEnd();
+    }
 
-            // relatedidlen : relatedid
-            memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length() + sizeof(size_property) + propId.length(),
-                   (char *) &size_relatedEntityId, sizeof(size_relatedEntityId));
-            memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length() + sizeof(size_property) + propId.length() +
-                   sizeof(size_relatedEntityId),
-                   relatedEntityId.data(), relatedEntityId.length());
+    vector<bool> Store::HeldInEarlierDataSets(const vector<pair<string, string>> &refs, const vector<shared_ptr<DataSet>> &datasets,
+                                              size_t datasetIndex, bool inverse) {
+        vector<bool> held(refs.size(), false);
+        if (datasetIndex == 0 || refs.empty()) {
+            return held;
+        }
 
-            string key(refKeyBuffer.get(), refKeyBufferSize);
+        vector<ColumnFamilyHandle *> columnFamilies;
+        vector<Slice> keys;
+        for (auto const &ref : refs) {
+            for (size_t d = 0; d < datasetIndex; d++) {
+                columnFamilies.push_back(inverse ? datasets[d]->GetInRefsColumnFamily() : datasets[d]->GetOutRefsColumnFamily());
+                keys.emplace_back(ref.first);
+            }
+        }
 
-            // insert
-            writeBatch->Put(dataset->GetOutRefsColumnFamily(), key, relatedEntityId);
+        auto count = keys.size();
+        vector<PinnableSlice> values(count);
+        vector<Status> statuses(count);
+        _database->MultiGet(GetMultiGetReadOptions(), count, columnFamilies.data(), keys.data(), values.data(), statuses.data());
 
+        for (size_t i = 0; i < count; i++) {
+            if (statuses[i].ok()) {
+                held[i / datasetIndex] = true;
+            }
+        }
+        return held;
+    }
 
-            // AND the inverse key
-            // same size as the out key so reuse the buffer from above
+    bool Store::CanResumeRelatedEntities(const RelatedEntitiesQuery &query) {
+        if (query.cursorDataSet.empty()) {
+            return true;
+        }
 
-            memcpy(refKeyBuffer.get(), (char *) &size_relatedEntityId, sizeof(size_relatedEntityId));
-            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId), relatedEntityId.data(), relatedEntityId.length());
+        // the cursor is read from the index the query uses now, and from a dataset still asked for
+        auto datasets = ResolveDataSets(query.datasets);
+        auto fromStoreIndex = query.inverse && UseStoreInRefsIndex(datasets);
+        if (query.cursorDataSet == RelatedEntitiesQuery::StoreIndexCursor) {
+            return fromStoreIndex;
+        }
 
-            // proplen : prop
-            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length(),
-                   (char *) &size_property, sizeof(size_property));
-            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length() + sizeof(size_property),
-                   propId.data(), propId.length());
+        if (fromStoreIndex) {
+            return false;
+        }
+        for (auto const &ds : datasets) {
+            if (ds->GetName() == query.cursorDataSet) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-            // relatedidlen : relatedid
-            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length() +
-                   sizeof(size_property) + propId.length(),
-                   (char *) &size_id, sizeof(size_id));
-            memcpy(refKeyBuffer.get() + sizeof(size_relatedEntityId) + relatedEntityId.length() +
-                   sizeof(size_property) + propId.length() + sizeof(size_id),
-                   id.data(), id.length());
+    int Store::VisitRelatedEntities(const string &id, RelatedEntitiesQuery &query, int count,
+                                    const function<bool(const vector<shared_ptr<string>> &)> &handler) {
+        if (count == 0) {
+            return 0;
+        }
 
-            string invkey(refKeyBuffer.get(), refKeyBufferSize);
+        if (!CanResumeRelatedEntities(query)) {
+            throw StoreException("The continuation token is stale, its dataset is gone or the refs index in use has changed");
+        }
 
-            writeBatch->Put(dataset->GetInRefsColumnFamily(), invkey, id);
+        auto datasets = ResolveDataSets(query.datasets);
+        auto key = MakeRefKeyPrefix(id, query.property);
+
+        // resume in the dataset the last page ended in
+        size_t first = 0;
+        if (!query.cursorDataSet.empty()) {
+            while (first < datasets.size() && datasets[first]->GetName() != query.cursorDataSet) first++;
         }
-    }
 
-    string Store::GetResourceId(string resourceUri) {
-        std::string httpStart("http");
+        // ids are collected a block at a time and each block fetched with one batched read. a ref
+        // also held by an earlier dataset was returned with that dataset, so it is dropped here
+        unordered_set<string> seen;
+        vector<string> block;
+        block.reserve(RelatedEntityBlockSize);
+        vector<pair<string, string>> candidates;
+        int visited = 0;
+        bool stopped = false;
+
+        auto flush = [&]() {
+            if (block.empty()) return;
+            auto entities = GetEntities(block, query.datasets);
+            visited += (int) entities.size();
+            block.clear();
+            if (!handler(entities)) {
+                stopped = true;
+            }
+        };
+
+        auto take = [&](string relatedId) {
+            if (!seen.insert(relatedId).second) {
+                return;
+            }
 
-        if (resourceUri.compare(0, httpStart.length(), httpStart) == 0) {
-            // find last hash or slash
-            string name;
-            string prefix;
+            block.push_back(std::move(relatedId));
+            if (count > -1 && visited + (int) block.size() >= count) {
+                // paged result limit hit
+                flush();
+                stopped = true;
+            } else if (block.size() == RelatedEntityBlockSize) {
+                flush();
+            }
+        };
+
+        auto accept = [&](size_t datasetIndex) {
+            auto held = HeldInEarlierDataSets(candidates, datasets, datasetIndex, query.inverse);
+            for (size_t c = 0; c < candidates.size() && !stopped; c++) {
+                // the cursor only moves past refs that have been returned or dropped
+                query.cursorDataSet = datasets[datasetIndex]->GetName();
+                query.lastRefKey = candidates[c].first;
+                if (!held[c]) {
+                    take(std::move(candidates[c].second));
+                }
+            }
+            candidates.clear();
+        };
+
+        bool fromStoreIndex = query.cursorDataSet == RelatedEntitiesQuery::StoreIndexCursor;
+        if (query.inverse && UseStoreInRefsIndex(datasets)) {
+            // one scan over the refs from every dataset, those of datasets not asked for are skipped
+            unordered_set<int> datasetIds;
+            for (auto const &ds : datasets) {
+                datasetIds.insert(ds->GetId());
+            }
 
-            auto foundAt = resourceUri.find_last_of('#');
-            if (foundAt != std::string::npos) {
-                prefix = resourceUri.substr(0, foundAt + 1);
-                name = resourceUri.substr(foundAt + 1);
+            // a page ends on a ref it took, the same ref from the next dataset is not taken again on the next page
+            string previousRef;
+            unique_ptr<rocksdb::Iterator> it(_database->NewIterator(rocksdb::ReadOptions(), _storeInRefsColumnFamily));
+            if (fromStoreIndex) {
+                if (query.lastRefKey.size() >= sizeof(int)) {
+                    previousRef = query.lastRefKey.substr(0, query.lastRefKey.size() - sizeof(int));
+                }
+                it->Seek(query.lastRefKey);
+                if (it->Valid() && it->key() == Slice(query.lastRefKey)) {
+                    it->Next();
+                }
             } else {
-                foundAt = resourceUri.find_last_of('/');
-                if (foundAt != std::string::npos) {
-                    prefix = resourceUri.substr(0, foundAt + 1);
-                    name = resourceUri.substr(foundAt + 1);
-                } else {
-                    throw StoreException("No hash or slash found in URL");
+                it->Seek(key);
+            }
+
+            for (; !stopped && it->Valid() && it->key().starts_with(key); it->Next()) {
+                query.cursorDataSet = RelatedEntitiesQuery::StoreIndexCursor;
+                query.lastRefKey = it->key().ToString();
+                if (datasetIds.count(GetStoreRefDataSetId(it->key())) == 0) {
+                    continue;
+                }
+
+                // a ref held by several datasets is taken once
+                Slice ref(it->key().data(), it->key().size() - sizeof(int));
+                if (ref == Slice(previousRef)) {
+                    continue;
                 }
+                previousRef = ref.ToString();
+                take(it->value().ToString());
+            }
+
+            if (!stopped) {
+                flush();
             }
+            return visited;
+        }
 
-            // lookup expansion in namespace index
-            int nsid = -1;
-            auto iter = _namespaceToIdIndex.find(prefix);
-            if (iter != _namespaceToIdIndex.end()) {
-                nsid = iter->second;
+        for (size_t d = first; d < datasets.size() && !stopped; d++) {
+            auto const &ds = datasets[d];
+            auto refsColumnFamilyHandle = query.inverse ? ds->GetInRefsColumnFamily() : ds->GetOutRefsColumnFamily();
+            unique_ptr<rocksdb::Iterator> it(_database->NewIterator(rocksdb::ReadOptions(), refsColumnFamilyHandle));
+
+            if (ds->GetName() == query.cursorDataSet && !query.lastRefKey.empty()) {
+                it->Seek(query.lastRefKey);
+                if (it->Valid() && it->key() == Slice(query.lastRefKey)) {
+                    it->Next();
+                }
             } else {
-                throw StoreException("Namespace prefix not found. Prefix is: " + prefix);
+                it->Seek(key);
             }
 
-            return string("ns" + std::to_string(nsid) + string(":") + name);
+            for (; !stopped && it->Valid() && it->key().starts_with(key); it->Next()) {
+                candidates.emplace_back(it->key().ToString(), it->value().ToString());
+                if (candidates.size() == RelatedEntityBlockSize) {
+                    accept(d);
+                }
+            }
 
-        } else {
-            throw StoreException("Resource URL doesnt start with http ");
+            if (!stopped) {
+                accept(d);
+            }
+        }
+
+        if (!stopped) {
+            flush();
         }
+        return visited;
     }
 
-    int Store::AssertProperty(string ns_name) {
-        std::lock_guard<std::mutex> lock(assert_property_mutex);
+    shared_ptr<vector<shared_ptr<string>>> Store::GetRelatedEntities(string si, string property, bool inverse, int count, const vector<string> &datasetNames) {
+        auto results = make_shared<vector<shared_ptr<string>>>();
+        RelatedEntitiesQuery query;
+        query.property = property;
+        query.inverse = inverse;
+        query.datasets = datasetNames;
+        VisitRelatedEntities(GetResourceId(si), query, count,
+                             [&results](const vector<shared_ptr<string>> &entities) {
+                                 results->insert(results->end(), entities.begin(), entities.end());
+                                 return true;
+                             });
+        return results;
+    }
 
-        // wrap this in mutex or use Intel TBB concurrent map
-        auto iter = _propertyToIdIndex.find(ns_name);
-        if (iter != _propertyToIdIndex.end()) {
-            return iter->second;
-        }
+    void Store::WriteRelatedEntitiesToStream(RelatedEntitiesQuery query, EntityStreamWriter &stream) {
 
-        // lookup in rocksb
-        string value;
-        auto cf = AssertColumnFamily("property_index"); // this should just be a member variable
+        stream.WriteContext(*_namespacesJson);
 
-        auto status = _database->Get(ReadOptions(), cf, ns_name, &value);
-        if (status.ok()) {
-            int propertyId;
-            memcpy((char *) &propertyId, value.data(), sizeof(propertyId));
-            return propertyId;
-        } else if (status.kNotFound) {
-            // wrap this is write batch
-            _nextPropertyId++;
-            shared_ptr<char> buffer(new char[8], ArrayDeleter<char>());
-            memcpy(buffer.get(), (char *) &_nextPropertyId, sizeof(_nextPropertyId));
-            Slice val(buffer.get(), sizeof(_nextPropertyId));
+        // each block is streamed as soon as it has been read
+        auto written = VisitRelatedEntities(GetResourceId(query.subject), query, query.pageSize,
+                                            [&stream](const vector<shared_ptr<string>> &entities) {
+                                                for (auto const &entityJson : entities) {
+                                                    stream.WriteEntity(entityJson->data(), (int) entityJson->size());
+                                                }
+                                                return !stream.IsCancelled();
+                                            });
 
-            auto s = _database->Put(rocksdb::WriteOptions(), _globalStateColumnFamily, "_next_property_id", val);
-            if (!s.ok()) {
-                throw StoreException("Error writing _next_property_id to _globalStateColumnFamily " + s.ToString());
+        if (stream.IsCancelled()) {
+            return;
+        }
+
+        // a full page may have more after it, the token resumes after the last ref read. the count of refs
+        // goes with it while it can be read from the counters
+        if (written > 0 && written == query.pageSize) {
+            long count = -1;
+            if (_degreeCountersReady) {
+                count = 0;
+                for (auto const &byProperty : CountRelatedEntities(GetResourceId(query.subject), query.property, query.inverse, query.datasets)) {
+                    count += byProperty.second;
+                }
             }
+            stream.WriteContinuation(query.Encode(), count);
+        }
 
-            // add entry
-            s = _database->Put(rocksdb::WriteOptions(), cf, ns_name, val);
-            if (!s.ok()) {
-                throw StoreException("Error writing entry " + s.ToString());
+        stream.WriteEnd();
+    }
+
+    map<string, long> Store::CountRelatedEntities(const string &id, const string &property, bool inverse,
+                                                  const vector<string> &datasetNames) {
+        auto datasets = ResolveDataSets(datasetNames);
+        auto prefix = MakeRefKeyPrefix(id, property);
+        auto propertyAt = sizeof(int) + id.length();
+        map<string, long> counts;
+
+        auto addCount = [&](const Slice &group, long count) {
+            int propertyLength;
+            memcpy((char *) &propertyLength, group.data() + propertyAt, sizeof(propertyLength));
+            counts[string(group.data() + propertyAt + sizeof(propertyLength), propertyLength)] += count;
+        };
+
+        if (!_degreeCountersReady) {
+            // until the backfill is done the refs are counted
+            for (auto const &ds : datasets) {
+                auto cf = inverse ? ds->GetInRefsColumnFamily() : ds->GetOutRefsColumnFamily();
+                unique_ptr<rocksdb::Iterator> it(_database->NewIterator(rocksdb::ReadOptions(), cf));
+                for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+                    addCount(it->key(), 1);
+                }
             }
+            return counts;
+        }
 
-            // add inverse entry
-            s = _database->Put(rocksdb::WriteOptions(), cf, val, ns_name);
-            if (!s.ok()) {
-                throw StoreException("Error writing inverse entry " + s.ToString());
+        unordered_set<int> datasetIds;
+        for (auto const &ds : datasets) {
+            datasetIds.insert(ds->GetId());
+        }
+
+        // one counter per property and dataset, those of datasets not asked for are skipped
+        auto degreePrefix = string(1, inverse ? 'i' : 'o') + prefix;
+        unique_ptr<rocksdb::Iterator> it(_database->NewIterator(rocksdb::ReadOptions(), _degreeColumnFamily));
+        for (it->Seek(degreePrefix); it->Valid() && it->key().starts_with(degreePrefix); it->Next()) {
+            auto count = ReadCounter(it->value());
+            if (count != 0 && datasetIds.count(GetStoreRefDataSetId(it->key())) > 0) {
+                addCount(Slice(it->key().data() + 1, it->key().size() - 1), (long) count);
             }
+        }
+        return counts;
+    }
 
-            // update local cache
-            _propertyToIdIndex[ns_name] = _nextPropertyId;
+    string Store::GetRelatedCountsJson(const string &si, const string &property, bool inverse, const vector<string> &datasets) {
+        auto counts = CountRelatedEntities(GetResourceId(si), property, inverse, datasets);
+        long total = 0;
 
-            return _nextPropertyId;
-        } else {
-            throw StoreException("Error in assert property " + status.ToString());
+        StringBuffer buffer;
+        Writer<StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("@id");
+        writer.String(si.data(), (SizeType) si.size());
+        writer.Key("wod:incoming");
+        writer.Bool(inverse);
+        writer.Key("wod:counts");
+        writer.StartObject();
+        for (auto const &byProperty : counts) {
+            writer.Key(byProperty.first.data(), (SizeType) byProperty.first.size());
+            writer.Int64(byProperty.second);
+            total += byProperty.second;
         }
+        writer.EndObject();
+        writer.Key("wod:count");
+        writer.Int64(total);
+        writer.EndObject();
+        return string(buffer.GetString(), buffer.GetSize());
     }
 
-    shared_ptr<string> Store::GetEntity(string id, const vector<string> &datasets) {
-        string value;
+    string Store::GetPropertyId(const string &property, const string &base) {
+        auto trie = GetNamespaceTrie();
+        string id;
 
-        if (datasets.size() == 1) {
-            auto ds = GetDataSet(datasets[0]);
-            auto status = _database->Get(ReadOptions(), ds->GetStoreColumnFamily(), id, &value);
-            if (status.ok()) {
-                return make_shared<string>(value);
+        if (property.compare(0, 4, "http") == 0) {
+            // as when the property was stored, the separator stays with the name
+            auto match = trie->MatchLastSeparator(property.data(), property.length());
+            if (match.separator != string::npos && match.baseId != -1) {
+                WriteNamespacedId(id, match.baseId, property.data() + match.separator, property.length() - match.separator);
+                return id;
             }
+            return property;
+        }
 
-            return make_shared<string>("{ \"@id\" : \"" + id + "\" }");
+        if (property.find(':') != string::npos || base.empty()) {
+            return property;
         }
-        
-        vector<shared_ptr<string>> partials;
-        if (datasets.empty()) {
-            // look in all
-            for (auto const& ds: _datasets) {
-                // do this in parallel? - TODO: ADD NEW INDEX for this.
-                // auto p = _database->Get(ReadOptions(), ds.second->GetStoreColumnFamily()
-                shared_ptr<string> entityValue = make_shared<string>();
-                auto status = _database->Get(ReadOptions(), ds.second->GetStoreColumnFamily(), id, entityValue.get());
-                partials.push_back(entityValue);
-            }
-        } else {
-            for (auto const &dsname : datasets) {
-                auto ds = this->GetDataSet(dsname);
-                shared_ptr<string> entityValue = make_shared<string>();
-                auto status = _database->Get(ReadOptions(), ds->GetStoreColumnFamily(), id, entityValue.get());
-                partials.push_back(entityValue);
-            }
-        }
-
-        // merge partials
-        if (partials.size() > 0) {
-            // merge entities
-            Document result;
-            result.ParseInsitu((char*) partials[0]->data());
-            Value::AllocatorType& alloc = result.GetAllocator();
-
-            // we create each document and keep a reference to it
-            vector<shared_ptr<Document>> entityDocuments;
-            for (int i=1;i<partials.size(); i++) {
-                auto d = make_shared<Document>();
-                d->ParseInsitu((char*) partials[i]->data());
-
-                // iterate each property and see if it exists on the main result:
-                for (auto& m : d->GetObject()) {
-                    // m.name.GetString(), kTypeNames[m.value.GetType()]);
-                    auto iter = result.FindMember(m.name.GetString());
-                    if (iter != result.MemberEnd()) {
-                        // property with name exists so need to turn into array or add to array
-                        if (iter->value.GetType() == Type::kArrayType) {
-                            auto listMember = iter->value.FindMember(m.value);
-                            if (listMember == iter->value.MemberEnd()) {
-                                // it doesnt exist so add it
-                                iter->value.PushBack(m.value.Move(), alloc);
-                            }
-                        } else {
-                            // turn into array if values are different
-                            if (m.value != iter->value) {
-                                // create array add existing value, add new value, replace old value with array
-                                Value newArray;
-                                newArray.SetArray();
-                                newArray.PushBack(iter->value.Move(), alloc);
-                                newArray.PushBack(m.value.Move(), alloc);
-                                result.RemoveMember(m.name);
-                                result.AddMember(m.name, newArray.Move(), alloc);
-                            }
-                        }
-                    } else {
-                        // no existing property so just add
-                        result.AddMember(m.name, m.value.Move(), alloc);
-                    }
-                }
-            }
 
-            // write it out to a string
-            StringBuffer buffer;
-            Writer<StringBuffer> writer(buffer);
-            result.Accept(writer);
-            return make_shared<string>(buffer.GetString(), buffer.GetLength());        
-        } else {
-            // if we havent found any then return the stub        
-            return make_shared<string>("{ \"@id\" : \"" + id + "\" }");
+        auto nsid = trie->Find(base.data(), base.length());
+        if (nsid == -1) {
+            return property;
         }
+        WriteNamespacedId(id, nsid, property.data(), property.length());
+        return id;
     }
 
-    void Store::WriteEntityToStream(string id, const vector<string> &datasets, EntityStreamWriter &stream) {
-        auto entityJson = this->GetEntity(id, datasets);
-        stream.WriteJson(",");
-        stream.WriteJson(entityJson->data(), entityJson->size());
+    bool Store::ParseFilterCondition(const string &expression, PropertyCondition &condition) {
+        string property;
+        if (!EntityFilter::ParseCondition(expression, property, condition)) return false;
+        condition.property = GetPropertyId(property, "");
+
+        // refs are stored as <resource id>, so a ref value is compared as one
+        if (condition.op != PropertyCondition::Exists && condition.type == IndexValueType::String) {
+            auto value = expression.substr(expression.find_first_of("=<>") + 1);
+            if (condition.op != PropertyCondition::Equals && !value.empty() && value[0] == '=') value.erase(0, 1);
+            if (value.length() > 2 && value.front() == '<' && value.back() == '>' && value.compare(1, 4, "http") == 0) {
+                // a uri outside every namespace was never stored as a ref, it is left to match nothing
+                try {
+                    auto ref = "<" + GetResourceId(value.substr(1, value.length() - 2)) + ">";
+                    condition.encoded.clear();
+                    PropertyIndex::EncodeValue(IndexValueType::String, ref, condition.encoded);
+                } catch (const StoreException &) {
+                }
+            }
+        }
+        return true;
     }
 
-    void Store::WriteCompleteEntityToStream(string sid, const vector<string> &datasets, EntityStreamWriter &stream) {
-        auto rid = GetResourceId(sid);
-        auto entityJson = this->GetEntity(rid, datasets);
-        stream.WriteJson("[ { \"@id\" : \"@context\", \"namespaces\" : ");
-        stream.WriteJson(_namespacesJson->data(), (int) _namespacesJson->length());
-        stream.WriteJson("},");
-        stream.WriteJson(entityJson->data(), entityJson->size());
-        stream.WriteJson("]");
+    string Store::AssertPropertyId(const string &property) {
+        if (property.compare(0, 4, "http") != 0) {
+            return property;
+        }
+
+        // as EntityHandler stores it, the separator stays with the name
+        auto match = GetNamespaceTrie()->MatchLastSeparator(property.data(), property.length());
+        if (match.separator == string::npos) {
+            return property;
+        }
+        int nsid = match.baseId;
+        if (nsid == -1) {
+            nsid = AssertNamespace(property.substr(0, match.separator));
+        }
+
+        string id;
+        WriteNamespacedId(id, nsid, property.data() + match.separator, property.length() - match.separator);
+        return id;
     }
 
-    shared_ptr<vector<shared_ptr<string>>> Store::GetRelatedEntities(string si, string property, bool inverse, int count, const vector<string> &datasetNames) {
+    vector<string> Store::QueryPropertyIndex(string dataset, const string &property, const PropertyIndexRange &range,
+                                             const string &cursor, int count, string &nextCursor) {
+        auto ds = GetDataSet(dataset);
+        if (ds == nullptr) {
+            throw StoreException("No dataset named " + dataset);
+        }
 
-        vector<shared_ptr<DataSet>> datasets;
-        string id = GetResourceId(si);
-        auto results = make_shared<vector<shared_ptr<string>>>();
-        int written = 0;
+        auto indexed = ds->GetIndexedProperties();
+        auto found = indexed->find(property);
+        if (found == indexed->end()) {
+            throw StoreException("Property " + property + " is not indexed in " + dataset);
+        }
+        if (!found->second) {
+            throw StoreException("The index of " + property + " in " + dataset + " is still being built");
+        }
 
-        // this can be optimised
-        if (datasetNames.empty()) {
-            for (auto const &ds : GetDataSets()) {
-                datasets.push_back(ds);
+        // keys of the values at the bounds, open bounds take in every value of the type
+        auto propertyPrefix = PropertyIndex::MakePropertyPrefix(property);
+        auto typePrefix = propertyPrefix + (char) range.type;
+        auto lower = typePrefix + range.lower;
+        auto upper = typePrefix + range.upper;
+
+        // a page resumes after the key the last one ended at
+        string after;
+        if (!cursor.empty()) {
+            if (!PropertyIndex::DecodeCursor(cursor, after)) {
+                throw StoreException("Invalid property index continuation token");
             }
-        } else {
-            // lookup datasets
-            for (auto const &name : datasetNames) {
-                auto ds = GetDataSet(name);
-                if (ds != nullptr) {
-                    datasets.push_back(ds);
-                }
+            after.insert(0, propertyPrefix);
+        }
+        auto start = after > lower ? after : lower;
+
+        unique_ptr<rocksdb::Iterator> it(_database->NewIterator(ReadOptions(), ds->GetPropertyIndexColumnFamily()));
+        vector<string> ids;
+        string id;
+        string lastKey;
+        for (it->Seek(start); it->Valid() && it->key().starts_with(typePrefix); it->Next()) {
+            auto key = it->key();
+            if (!range.upper.empty() && key.compare(upper) >= 0 && !(range.upperInclusive && key.starts_with(upper))) break;
+            if (!range.lower.empty() && !range.lowerInclusive && key.starts_with(lower)) continue;
+            if (!after.empty() && key == Slice(after)) continue;
+            if (count > 0 && (int) ids.size() == count) break;
+
+            if (!PropertyIndex::GetId(key, propertyPrefix.size(), id)) {
+                throw StoreException("Malformed property index key for " + property + " in " + dataset);
             }
+            ids.push_back(id);
+            lastKey.assign(key.data(), key.size());
         }
 
-        std::set<shared_ptr<string>,bool(*)(shared_ptr<string> , shared_ptr<string>)> hits(Store::StrPtrComp);
-
-        for (auto const &ds : datasets) {
+        nextCursor.clear();
+        if (count > 0 && (int) ids.size() == count) {
+            nextCursor = PropertyIndex::EncodeCursor(lastKey, propertyPrefix.size());
+        }
+        return ids;
+    }
 
-            ColumnFamilyHandle* refsColumnFamilyHandle = nullptr;
-            if (inverse) {
-                refsColumnFamilyHandle = ds->GetInRefsColumnFamily();
-            } else {
-                refsColumnFamilyHandle = ds->GetOutRefsColumnFamily();
-            }
-
-            string key; // index search value
-            if (property.empty()) {
-                // make prefix for search
-                int size_id = id.length();
-                auto refKeyBufferSize = sizeof(size_id) + size_id;
-                shared_ptr<char> refKeyBuffer(new char[refKeyBufferSize], ArrayDeleter<char>());
-                // idlen : id
-                memcpy(refKeyBuffer.get(), (char *) &size_id, sizeof(size_id));
-                memcpy(refKeyBuffer.get() + sizeof(size_id), id.data(), id.length());
-                key = string(refKeyBuffer.get(), refKeyBufferSize);
-            } else {
-                // make prefix for search including property
-                int size_id = id.length();
-                int size_prop = property.length();
-                auto refKeyBufferSize = sizeof(size_id) + size_id + sizeof(size_prop) + size_prop;
-                shared_ptr<char> refKeyBuffer(new char[refKeyBufferSize], ArrayDeleter<char>());
+    void Store::WritePropertyIndexQueryToStream(string dataset, const string &property, const PropertyIndexRange &range,
+                                                const string &cursor, int count, EntityStreamWriter &stream) {
+        string nextCursor;
+        auto ids = QueryPropertyIndex(dataset, property, range, cursor, count, nextCursor);
+        stream.WriteContext(*_namespacesJson);
+
+        vector<string> datasets{dataset};
+        vector<string> block;
+        for (size_t i = 0; i < ids.size() && !stream.IsCancelled(); i += RelatedEntityBlockSize) {
+            block.assign(ids.begin() + i, ids.begin() + std::min(ids.size(), i + RelatedEntityBlockSize));
+            for (auto const &entityJson : GetEntities(block, datasets)) {
+                stream.WriteEntity(entityJson->data(), (int) entityJson->size());
+            }
+        }
 
-                // idlen : id : proplen : property
-                memcpy(refKeyBuffer.get(), (char *) &size_id, sizeof(size_id));
-                memcpy(refKeyBuffer.get() + sizeof(size_id), id.data(), id.length());
+        if (stream.IsCancelled()) {
+            return;
+        }
 
-                memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length(), (char *) &size_prop, sizeof(size_prop));
-                memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length() + sizeof(size_prop), property.data(), property.length());
+        // a full page may have more after it
+        if (!nextCursor.empty()) {
+            stream.WriteContinuation(nextCursor);
+        }
+        stream.WriteEnd();
+    }
 
-                key = string(refKeyBuffer.get(), refKeyBufferSize);
+    vector<TraversalStep> Store::ParseTraversalPath(const string &path, const string &base) {
+        vector<TraversalStep> steps;
+        size_t pos = 0;
+
+        while (pos < path.length()) {
+            TraversalStep step;
+            if (path.compare(pos, 4, "out:") == 0) {
+                pos += 4;
+            } else if (path.compare(pos, 3, "in:") == 0) {
+                step.inverse = true;
+                pos += 3;
+            } else {
+                throw StoreException("Traversal step must start with out: or in: at " + path.substr(pos));
             }
 
-            // search and iterate keys
-            rocksdb::Iterator *it = _database->NewIterator(rocksdb::ReadOptions(), refsColumnFamilyHandle);
-
-            for (it->Seek(key);
-                    it->Valid() && it->key().starts_with(key);
-                    it->Next()) {
-
-                shared_ptr<string> val = make_shared<string>(it->value().data(), it->value().size());
+            // property uris contain slashes, so a step only ends at a slash followed by the next direction
+            auto end = pos;
+            while ((end = path.find('/', end)) != string::npos) {
+                if (path.compare(end + 1, 4, "out:") == 0 || path.compare(end + 1, 3, "in:") == 0) break;
+                end++;
+            }
 
-                // if we can insert the result id into the hits set then add the entity to result
-                if (hits.insert(val).second) {                        
-                    // this adds the merged entity into the result
-                    results->push_back(this->GetEntity(*val, datasetNames)); // TODO: optimise this to not copy the string id, use shared pointer?
-                    if (count > -1 && written == count) {
-                        // paged result limit hit so break iterator loop
-                        break;
-                    }
-                }
+            auto property = path.substr(pos, end == string::npos ? string::npos : end - pos);
+            if (!property.empty() && property != "*") {
+                step.property = GetPropertyId(property, base);
             }
-            delete it;
+            steps.push_back(step);
+
+            if (end == string::npos) break;
+            pos = end + 1;
         }
 
-        return results;
+        if (steps.empty()) {
+            throw StoreException("Traversal path is empty");
+        }
+        if (steps.size() > MaxTraversalSteps) {
+            throw StoreException("Traversal path has more than " + to_string(MaxTraversalSteps) + " steps");
+        }
+        return steps;
     }
 
-    void
-    Store::WriteRelatedEntitiesToStream(string si, string property, bool inverse, long skip, int count, const vector<string> &datasetNames,
-                                        EntityStreamWriter &stream) {
+    vector<string> Store::Traverse(const string &si, const vector<TraversalStep> &steps, const vector<string> &datasetNames,
+                                   size_t maxFrontier, bool &truncated) {
+        auto datasets = ResolveDataSets(datasetNames);
+        vector<string> frontier{GetResourceId(si)};
+        truncated = false;
 
-        stream.WriteJson("[ { \"@id : \"@context\", \"namespaces\" : ");
-        stream.WriteJson(_namespacesJson->data(), (int) _namespacesJson->length());
-        stream.WriteJson("},");
+        auto useStoreIndex = UseStoreInRefsIndex(datasets);
+        unordered_set<int> datasetIds;
+        for (auto const &ds : datasets) {
+            datasetIds.insert(ds->GetId());
+        }
 
-        vector<shared_ptr<DataSet>> datasets;
-        string id = GetResourceId(si);
-        auto results = make_shared<vector<shared_ptr<string>>>();
-        int written = 0;
+        for (auto const &step : steps) {
+            // each worker expands a slice of the frontier with its own iterators
+            vector<vector<string>> found(TraversalWorkers);
+            atomic<bool> capped(false);
+            auto fromStoreIndex = step.inverse && useStoreIndex;
+            ParallelForEach(frontier.size(), TraversalWorkers, TraversalIdsPerWorker,
+                            [&](size_t begin, size_t end, int worker) {
+                vector<unique_ptr<rocksdb::Iterator>> iterators;
+                if (fromStoreIndex) {
+                    iterators.emplace_back(_database->NewIterator(rocksdb::ReadOptions(), _storeInRefsColumnFamily));
+                } else {
+                    for (auto const &ds : datasets) {
+                        auto cf = step.inverse ? ds->GetInRefsColumnFamily() : ds->GetOutRefsColumnFamily();
+                        iterators.emplace_back(_database->NewIterator(rocksdb::ReadOptions(), cf));
+                    }
+                }
 
-        // this can be optimised
-        if (datasetNames.empty()) {
-            for (auto const &ds : GetDataSets()) {
-                datasets.push_back(ds);
-            }
-        } else {
-            // lookup datasets
-            for (auto const &name : datasetNames) {
-                auto ds = GetDataSet(name);
-                if (ds != nullptr) {
-                    datasets.push_back(ds);
+                unordered_set<string> seen;
+                auto &next = found[worker];
+                for (auto i = begin; i < end && !capped; i++) {
+                    auto key = MakeRefKeyPrefix(frontier[i], step.property);
+                    for (auto &it : iterators) {
+                        if (capped) break;
+                        for (it->Seek(key); it->Valid() && it->key().starts_with(key); it->Next()) {
+                            if (fromStoreIndex && datasetIds.count(GetStoreRefDataSetId(it->key())) == 0) {
+                                continue;
+                            }
+                            if (seen.emplace(it->value().data(), it->value().size()).second) {
+                                next.emplace_back(it->value().data(), it->value().size());
+                            }
+                            if (next.size() > maxFrontier) {
+                                // no worker alone may hold more than the level can keep
+                                capped = true;
+                                break;
+                            }
+                        }
+                    }
+                }
+            });
+
+            unordered_set<string> seen;
+            vector<string> next;
+            for (auto &ids : found) {
+                for (auto &id : ids) {
+                    if (!seen.insert(id).second) continue;
+                    if (next.size() == maxFrontier) {
+                        capped = true;
+                        break;
+                    }
+                    next.push_back(std::move(id));
                 }
             }
+
+            truncated = truncated || capped;
+            frontier = std::move(next);
+            if (frontier.empty()) {
+                break;
+            }
         }
 
-        std::set<shared_ptr<string>,bool(*)(shared_ptr<string> , shared_ptr<string>)> hits(Store::StrPtrComp);
+        return frontier;
+    }
 
-        for (auto const &ds : datasets) {
+    // maps entity ids to dense numbers so the search keeps its visited state in flat arrays
+    class IdInterner {
+    private:
+        unordered_map<string, uint32_t> _numbers;
+        vector<const string *> _ids;
+
+    public:
+        uint32_t Intern(const char *data, size_t length) {
+            auto inserted = _numbers.emplace(string(data, length), (uint32_t) _ids.size());
+            if (inserted.second) {
+                _ids.push_back(&inserted.first->first);
+            }
+            return inserted.first->second;
+        }
 
-            ColumnFamilyHandle* refsColumnFamilyHandle = nullptr;
-            if (inverse) {
-                refsColumnFamilyHandle = ds->GetInRefsColumnFamily();
-            } else {
-                refsColumnFamilyHandle = ds->GetOutRefsColumnFamily();
-            }
-
-            string key; // index search value
-            if (property.empty()) {
-                // make prefix for search
-                int size_id = id.length();
-                auto refKeyBufferSize = sizeof(size_id) + size_id;
-                shared_ptr<char> refKeyBuffer(new char[refKeyBufferSize], ArrayDeleter<char>());
-                // idlen : id
-                memcpy(refKeyBuffer.get(), (char *) &size_id, sizeof(size_id));
-                memcpy(refKeyBuffer.get() + sizeof(size_id), id.data(), id.length());
-                key = string(refKeyBuffer.get(), refKeyBufferSize);
-            } else {
-                // make prefix for search including property
-                int size_id = id.length();
-                int size_prop = property.length();
-                auto refKeyBufferSize = sizeof(size_id) + size_id + sizeof(size_prop) + size_prop;
-                shared_ptr<char> refKeyBuffer(new char[refKeyBufferSize], ArrayDeleter<char>());
+        const string &GetId(uint32_t number) const {
+            return *_ids[number];
+        }
 
-                // idlen : id : proplen : property
-                memcpy(refKeyBuffer.get(), (char *) &size_id, sizeof(size_id));
-                memcpy(refKeyBuffer.get() + sizeof(size_id), id.data(), id.length());
+        size_t Size() const {
+            return _ids.size();
+        }
+    };
+
+    vector<string> Store::FindShortestPath(const string &fromSi, const string &toSi, const vector<string> &datasetNames,
+                                           int maxDepth, size_t maxVisited, bool &truncated) {
+        static const uint32_t Unvisited = UINT32_MAX;
+
+        auto datasets = ResolveDataSets(datasetNames);
+        auto from = GetResourceId(fromSi);
+        auto to = GetResourceId(toSi);
+        truncated = false;
+        if (from == to) {
+            return vector<string>{from};
+        }
 
-                memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length(), (char *) &size_prop, sizeof(size_prop));
-                memcpy(refKeyBuffer.get() + sizeof(size_id) + id.length() + sizeof(size_prop), property.data(), property.length());
+        // parent[side][n] is the number the search on that side reached n from, a root is its own parent
+        IdInterner interner;
+        vector<uint32_t> parent[2];
+        vector<uint32_t> frontier[2];
+        vector<unique_ptr<rocksdb::Iterator>> iterators[2];
+        for (int side = 0; side < 2; side++) {
+            auto root = interner.Intern(side == 0 ? from.data() : to.data(), side == 0 ? from.length() : to.length());
+            parent[0].resize(interner.Size(), Unvisited);
+            parent[1].resize(interner.Size(), Unvisited);
+            parent[side][root] = root;
+            frontier[side].push_back(root);
+        }
 
-                key = string(refKeyBuffer.get(), refKeyBufferSize);
+        // the backward side reads the store wide inrefs index when it has one
+        auto backwardFromStoreIndex = UseStoreInRefsIndex(datasets);
+        unordered_set<int> datasetIds;
+        for (auto const &ds : datasets) {
+            datasetIds.insert(ds->GetId());
+            iterators[0].emplace_back(_database->NewIterator(rocksdb::ReadOptions(), ds->GetOutRefsColumnFamily()));
+            if (!backwardFromStoreIndex) {
+                iterators[1].emplace_back(_database->NewIterator(rocksdb::ReadOptions(), ds->GetInRefsColumnFamily()));
             }
+        }
+        if (backwardFromStoreIndex) {
+            iterators[1].emplace_back(_database->NewIterator(rocksdb::ReadOptions(), _storeInRefsColumnFamily));
+        }
 
-            // search and iterate keys
-            rocksdb::Iterator *it = _database->NewIterator(rocksdb::ReadOptions(), refsColumnFamilyHandle);
-
-            long skipped = skip;
-            for (it->Seek(key);
-                    it->Valid() && it->key().starts_with(key);
-                    it->Next()) {
+        auto pathLength = [&](uint32_t number, int side) {
+            int length = 0;
+            while (parent[side][number] != number) {
+                number = parent[side][number];
+                length++;
+            }
+            return length;
+        };
+
+        uint32_t meet = Unvisited;
+        int best = INT32_MAX;
+        for (int depth = 0; depth < maxDepth && meet == Unvisited; depth++) {
+            // grow the smaller side, the whole level so the shortest meeting point is found
+            int side = frontier[0].size() <= frontier[1].size() ? 0 : 1;
+            vector<uint32_t> next;
+
+            for (auto number : frontier[side]) {
+                if (interner.Size() > maxVisited) break;
+                auto key = MakeRefKeyPrefix(interner.GetId(number), "");
+                for (auto &it : iterators[side]) {
+                    for (it->Seek(key); it->Valid() && it->key().starts_with(key); it->Next()) {
+                        if (side == 1 && backwardFromStoreIndex && datasetIds.count(GetStoreRefDataSetId(it->key())) == 0) {
+                            continue;
+                        }
+                        auto neighbour = interner.Intern(it->value().data(), it->value().size());
+                        if (neighbour >= parent[0].size()) {
+                            parent[0].resize(interner.Size(), Unvisited);
+                            parent[1].resize(interner.Size(), Unvisited);
+                        }
+                        if (parent[side][neighbour] != Unvisited) {
+                            continue;
+                        }
 
-                if (skipped > 0) {
-                    skipped = skipped - 1;
-                } else {
-                    shared_ptr<string> relatedEntityId = make_shared<string>(it->value().data(), it->value().size());
-
-                    // if we can insert the result id into the hits set then add the entity to result
-                    if (hits.insert(relatedEntityId).second) {                        
-                        // this adds the merged entity into the result
-                        auto entityJson = this->GetEntity(*relatedEntityId, datasetNames);
-                        stream.WriteJson(",");
-                        stream.WriteJson(entityJson->data(), entityJson->size());
-
-                        if (count > -1 && written == count) {
-                            // paged result limit hit so break iterator loop
-                            break;
+                        parent[side][neighbour] = number;
+                        next.push_back(neighbour);
+                        if (parent[1 - side][neighbour] != Unvisited) {
+                            auto length = pathLength(neighbour, 0) + pathLength(neighbour, 1);
+                            if (length < best) {
+                                best = length;
+                                meet = neighbour;
+                            }
                         }
                     }
                 }
             }
-            delete it; // needs to be in finally
 
-            // write next token
-            if (written > 0 && written == count) {                
-                auto token = string("{ \"datasets\" : [ ");
+            if (interner.Size() > maxVisited && meet == Unvisited) {
+                truncated = true;
+                break;
+            }
 
-                bool first = true;
-                for (auto const &ds : datasetNames ){
-                    if (first) {
-                        token = token + "\"" + ds + "\"";
-                        first = false;
-                    } else {
-                        token = token + ", \"" + ds + "\"";
-                    }
-                }
-                token = token + "]";
+            frontier[side] = std::move(next);
+            if (frontier[side].empty()) {
+                break;
+            }
+        }
+
+        vector<string> path;
+        if (meet == Unvisited) {
+            return path;
+        }
+
+        for (auto n = meet; ; n = parent[0][n]) {
+            path.push_back(interner.GetId(n));
+            if (parent[0][n] == n) break;
+        }
+        std::reverse(path.begin(), path.end());
+        for (auto n = meet; parent[1][n] != n; ) {
+            n = parent[1][n];
+            path.push_back(interner.GetId(n));
+        }
+        return path;
+    }
+
+    void Store::WriteEntitiesByIdToStream(const vector<string> &ids, const vector<string> &datasets, EntityStreamWriter &stream) {
+        stream.WriteContext(*_namespacesJson);
 
-                 // to_string(shard) + "_" + lastId + "_1";
-                string tokenTemplate(", { \"@id\" : \"@continuation\" , \"wod:next-data\" : \"" + token + "\" }");
-                stream.WriteJson(tokenTemplate); 
+        vector<string> block;
+        for (size_t i = 0; i < ids.size() && !stream.IsCancelled(); i += RelatedEntityBlockSize) {
+            block.assign(ids.begin() + i, ids.begin() + std::min(ids.size(), i + RelatedEntityBlockSize));
+            for (auto const &entityJson : GetEntities(block, datasets)) {
+                stream.WriteEntity(entityJson->data(), (int) entityJson->size());
             }
+        }
 
-            stream.WriteJson("]");
+        if (stream.IsCancelled()) {
+            return;
         }
+        stream.WriteEnd();
     }
 
     shared_ptr<string> Store::GetEntities(string dataset, string lastId, int count, int shard, shared_ptr<vector<shared_ptr<string>>> result) {
@@ -1134,7 +3360,7 @@ namespace webofdata {
         // readOptions.fill_cache = false;
         auto cf = ds->GetStoreColumnFamily();
         rocksdb::Iterator *it = _database->NewIterator(rocksdb::ReadOptions(), cf);
-        Slice lastWrittenKey;
+        string lastWrittenKey; // copied, the iterator's key is only valid until it moves
 
         Slice lastIdSlice(lastId);
         if (lastId.empty()) {
@@ -1146,15 +3372,18 @@ namespace webofdata {
             }
         }
 
+        string decoded;
         for (; it->Valid(); it->Next()) {
             if (shard == -1) {
-                lastWrittenKey = it->key();
-                result->push_back(make_shared<string>(it->value().data(), it->value().size()));
+                lastWrittenKey.assign(it->key().data(), it->key().size());
+                auto entity = DecodeEntity(it->value(), decoded);
+                result->push_back(make_shared<string>(entity.data(), entity.size()));
                 written++;
             } else {
                 if (shard == XXH64(it->key().data(), it->key().size(), 0) % 4) {
-                    lastWrittenKey = it->key();
-                    result->push_back(make_shared<string>(it->value().data(), it->value().size()));
+                    lastWrittenKey.assign(it->key().data(), it->key().size());
+                    auto entity = DecodeEntity(it->value(), decoded);
+                    result->push_back(make_shared<string>(entity.data(), entity.size()));
                     written++;
                 }
             }
@@ -1166,7 +3395,7 @@ namespace webofdata {
 
         delete it;
 
-        lastId = lastWrittenKey.ToString();
+        lastId = lastWrittenKey;
         return make_shared<string>(lastId);
     }
 
@@ -1180,12 +3409,11 @@ namespace webofdata {
         return tokens;
     }
 
-    void Store::WriteEntitiesToStream(string dataset, string lastId, int count, int shard, EntityStreamWriter &stream) {
+    void Store::WriteEntitiesToStream(string dataset, string lastId, int count, int shard, EntityStreamWriter &stream,
+                                      EntityFilter *filter) {
         auto ds = GetDataSet(std::move(dataset)); // TODO: check it exists
 
-        stream.WriteJson("[ { \"@id\" : \"@context\", \"namespaces\" : ");
-        stream.WriteJson(_namespacesJson->data(), _namespacesJson->length());
-        stream.WriteJson("}");
+        stream.WriteContext(*_namespacesJson);
 
         int written = 0;
 
@@ -1194,7 +3422,7 @@ namespace webofdata {
         // readOptions.readahead_size = 256;
         auto cf = ds->GetStoreColumnFamily();
         rocksdb::Iterator *it = _database->NewIterator(readOptions, cf);
-        Slice lastWrittenKey;
+        string lastWrittenKey; // copied, the iterator's key is only valid until it moves
 
         Slice lastIdSlice(lastId);
         if (lastId.empty()) {
@@ -1206,21 +3434,14 @@ namespace webofdata {
             }
         }
 
+        Slice output;
+        string decoded;
         for (; it->Valid(); it->Next()) {
-            if (shard == -1) {
-                lastWrittenKey = it->key();
-                stream.WriteJson(",", 1);
-                auto data = it->value().data();
-                auto size = it->value().size();
-                stream.WriteJson(data, size); // TODO: check this size thing out
-                written++;
-            } else {
-                if (shard == XXH64(it->key().data(), it->key().size(), 0) % 4) {
-                    lastWrittenKey = it->key();
-                    stream.WriteJson(",", 1);
-                    auto data = it->value().data();
-                    auto size = it->value().size();
-                    stream.WriteJson(data, size); // TODO: check this size thing out
+            if (shard == -1 || shard == XXH64(it->key().data(), it->key().size(), 0) % 4) {
+                // entities the filter skips are never copied out of the iterator
+                if (FilterEntity(it->value(), filter, decoded, output)) {
+                    lastWrittenKey.assign(it->key().data(), it->key().size());
+                    stream.WriteEntity(output.data(), (int) output.size());
                     written++;
                 }
             }
@@ -1228,23 +3449,27 @@ namespace webofdata {
             if (count > 0 && written == count) {
                 break;
             }
+
+            // the consumer has gone, stop reading
+            if (stream.IsCancelled()) {
+                break;
+            }
         }
 
         delete it;
 
         // write continuation entity
         if (count > 0 && written == count) {
-            auto lastId = lastWrittenKey.ToString();
+            auto lastId = lastWrittenKey;
             if (!lastId.empty()) {
                 string nextContinuationToken(lastId + ":" + to_string(shard));
                 // write out continuation token entity
                 auto token = to_string(shard) + "_" + lastId;
-                string tokenTemplate(", { \"@id\" : \"@continuation\" , \"wod:next-data\" : \"" + token + "\" }");
-                stream.WriteJson(tokenTemplate); 
+                stream.WriteContinuation(token);
             }
         }
 
-        stream.WriteJson("]");
+        stream.WriteEnd();
     }
 
     shared_ptr<vector<string>> Store::GetChanges(string dataset, ulong sequence, int count) {
@@ -1311,6 +3536,7 @@ namespace webofdata {
         }
         auto storeColumnFamily = ds->GetStoreColumnFamily();
         ReadOptions readOptions;
+        string decoded;
 
         for (; it->Valid(); it->Next()) {
             long itemSequence = 0;
@@ -1321,7 +3547,8 @@ namespace webofdata {
                 PinnableSlice value;
                 auto status = _database->Get(readOptions, storeColumnFamily, it->value(), &value);
                 if (status.ok()) {
-                    auto entity = make_shared<string>(value.data(), value.size());
+                    auto json = DecodeEntity(value, decoded);
+                    auto entity = make_shared<string>(json.data(), json.size());
                     handler->ProcessEntity(entity);    
                     written++;
                 } else {
@@ -1334,7 +3561,8 @@ namespace webofdata {
                     PinnableSlice value;
                     auto status = _database->Get(readOptions, storeColumnFamily, it->value(), &value);
                     if (status.ok()) {
-                        auto entity = make_shared<string>(value.data(), value.size());
+                        auto json = DecodeEntity(value, decoded);
+                        auto entity = make_shared<string>(json.data(), json.size());
                         handler->ProcessEntity(entity);    
                         written++;
                     } else {
@@ -1352,7 +3580,8 @@ namespace webofdata {
         return lastWrittenSequence;
     }
 
-    void Store::WriteChangesToStream(string dataset, long from, int count, int shard, EntityStreamWriter &writer)
+    void Store::WriteChangesToStream(string dataset, long from, int count, int shard, EntityStreamWriter &writer,
+                                     EntityFilter *filter)
     {
         auto ds = GetDataSet(std::move(dataset));
 
@@ -1376,25 +3605,27 @@ namespace webofdata {
             }
         }
 
-        writer.WriteJson("[ { \"@id\" : \"@context\", \"namespaces\" : ");
-        writer.WriteJson(_namespacesJson->data(), _namespacesJson->length());
-        writer.WriteJson("}");
+        writer.WriteContext(*_namespacesJson);
 
         auto storeColumnFamily = ds->GetStoreColumnFamily();
         ReadOptions readOptions;
+        string decoded;
 
         for (; it->Valid(); it->Next()) {
             long itemSequence = 0;
             memcpy((char*)&itemSequence, it->key().data(), sizeof(itemSequence));
 
             if (shard == -1) {
+                // a filtered out change is still passed, so the token moves on past it
                 lastWrittenSequence = itemSequence;
                 PinnableSlice value;
                 auto status = _database->Get(readOptions, storeColumnFamily, it->value(), &value);
                 if (status.ok()) {
-                    writer.WriteJson(",");
-                    writer.WriteJson(value.data(), (int) value.size());
-                    written++;
+                    Slice output;
+                    if (FilterEntity(value, filter, decoded, output)) {
+                        writer.WriteEntity(output.data(), (int) output.size());
+                        written++;
+                    }
                 } else {
                     // do something...
                     throw StoreException("Error expected entity not found in dataset");
@@ -1402,20 +3633,23 @@ namespace webofdata {
             } else {
                 if (shard == itemSequence % 4) {
                     lastWrittenSequence = itemSequence;
-                    writer.WriteJson(",");
                     PinnableSlice value;
                     auto status = _database->Get(readOptions, storeColumnFamily, it->value(), &value);
                     if (status.ok()) {
-                        writer.WriteJson(value.data(), (int) value.size());
-                        written++;
-                    } else {
-                        // do something...
+                        Slice output;
+                        if (FilterEntity(value, filter, decoded, output)) {
+                            writer.WriteEntity(output.data(), (int) output.size());
+                            written++;
+                        }
                     }
                 }
             }
 
             // thats quite enough for now
             if (count > 0 && written == count) { break; }
+
+            // the consumer has gone, stop reading
+            if (writer.IsCancelled()) { break; }
         }
         delete it;
 
@@ -1424,11 +3658,10 @@ namespace webofdata {
         if (!lastId.empty()) {
             // shard, sequence, generation
             auto token = to_string(shard) + "_" + lastId + "_1";
-            string tokenTemplate(", { \"@id\" : \"@continuation\" , \"wod:next-data\" : \"" + token + "\" }");
-            writer.WriteJson(tokenTemplate); 
+            writer.WriteContinuation(token);
         }
 
-        writer.WriteJson("]");
+        writer.WriteEnd();
     }
 
     /* void Store::RegisterPipe(string dataset, shared_ptr<Pipe> livepipe) {
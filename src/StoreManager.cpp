@@ -11,6 +11,8 @@ namespace webofdata {
     StoreManager::StoreManager(string baseLocation) {
         _baseLocation = std::move(baseLocation);
         _logger = spdlog::get("wod_service_log");
+        _entityCacheBytes = Store::DefaultEntityCacheBytes;
+        _storeInRefsIndex = false;
         LoadStores();
     }
 
@@ -40,6 +42,10 @@ namespace webofdata {
             boost::filesystem::create_directories(dirName);
             auto store = make_shared<Store>(name, dirName);
             store->OpenRocksDb(dirName);
+            store->SetEntityCacheBytes(_entityCacheBytes);
+            if (_storeInRefsIndex) {
+                store->EnableStoreInRefsIndex();
+            }
 
             string md("{ \"id\" : \"wod:" + name + "\"}");
             store->StoreMetadataEntity(md);
@@ -72,6 +78,24 @@ namespace webofdata {
         }
     }
 
+    void StoreManager::SetEntityCacheBytes(size_t capacityBytes) {
+        _entityCacheBytes = capacityBytes;
+        for (auto const &store : _stores) {
+            store->SetEntityCacheBytes(capacityBytes);
+        }
+    }
+
+    void StoreManager::SetStoreInRefsIndex(bool enabled) {
+        _storeInRefsIndex = enabled;
+        for (auto const &store : _stores) {
+            if (enabled) {
+                store->EnableStoreInRefsIndex();
+            } else {
+                store->DisableStoreInRefsIndex();
+            }
+        }
+    }
+
     vector<shared_ptr<Store>> StoreManager::GetStores() {
         vector<shared_ptr<Store>> stores;
         for (auto const &s : _stores) {
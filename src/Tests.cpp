@@ -4,11 +4,13 @@
 
 #include <Store.h>
 #include "EntityHandler.h"
+#include "EntityCodec.h"
 #include <boost/uuid/uuid.hpp>            // uuid class
 #include <boost/uuid/uuid_generators.hpp> // generators
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
+#include <algorithm>
 #include <ctime>
 #include <chrono>
 #include <thread>
@@ -197,6 +199,40 @@ int testInsertEntityNoContext() {
     return 1;
 }
 
+int testInsertEntitiesNdJson() {
+
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    auto ds = s->AssertDataSet("people");
+
+    std::istringstream data(
+            "{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"http://things.myspace.com/\", \"foaf\" : \"http://foaf.com/\" }}\n"
+            "{ \"@id\" : \"gra\" , \"foaf:name\" : \"graham moore\", \"foaf:knows\" : [ \"<colin>\", \"<bob>\" ] }\n"
+            "\n"
+            "{ \"@id\" : \"colin\" , \"foaf:name\" : \"colin\" }\n"
+            "{ \"@id\" : \"@continuation\" , \"wod:next-data\" : \"0_ns2:colin\" }\n");
+
+    auto count = s->StoreEntitiesNdJson(data, "people");
+    assert(count == 2);
+
+    // the continuation's members are not asserted as properties
+    assert(s->GetNamespacesJson()->find("\"wod\"") == string::npos);
+
+    auto rid = s->GetResourceId("http://things.myspace.com/gra");
+    auto json = s->GetEntity(rid, vector<string>{"people"});
+    assert(json->find("graham moore") != string::npos);
+
+    auto result = make_shared<vector<shared_ptr<string>>>();
+    s->GetEntities("people", "", -1, -1, result);
+    assert(result->size() == 2);
+
+    s->Delete();
+    return 1;
+}
+
 int testTrySaveBadJson() {
     auto storeName = MakeGuid();
     auto storeLoc = string("/tmp/stores/store_") + storeName;
@@ -283,6 +319,906 @@ int testReplaceEntity() {
     return 1;
 }
 
+int testNamespaceTrie() {
+    NamespaceTrie trie;
+    string foaf("http://foaf.com/");
+    string foafBase("http://foaf.com");
+    trie.Insert(foaf.data(), foaf.length(), 1);
+    trie.Insert(foafBase.data(), foafBase.length(), 2);
+
+    string uri("http://foaf.com/name");
+    auto match = trie.MatchLastSeparator(uri.data(), uri.length());
+    assert(match.separator == 15);
+    assert(match.prefixId == 1);
+    assert(match.baseId == 2);
+
+    string unknown("http://example.org/people#gra");
+    match = trie.MatchLastSeparator(unknown.data(), unknown.length());
+    assert(match.separator == 25);
+    assert(match.prefixId == -1);
+
+    assert(trie.Find(foafBase.data(), foafBase.length()) == 2);
+    assert(trie.Find("http://foaf.co", 14) == -1);
+
+    string id;
+    WriteNamespacedId(id, 12, "gra", 3);
+    assert(id == "ns12:gra");
+    return 1;
+}
+
+class StringStreamWriter : public EntityStreamWriter {
+public:
+    string data;
+
+    void WriteJson(const string& json) {
+        data += json;
+    }
+
+    void WriteJson(const char *json, int length) {
+        data.append(json, length);
+    }
+
+    void Flush() {}
+};
+
+int testCompressionRoundTrip() {
+    string expected;
+    for (int i = 0; i < 10000; i++) {
+        expected += "{ \"@id\" : \"ns0:" + std::to_string(i) + "\" }\n";
+    }
+
+    for (auto coding : { ContentCoding::Gzip, ContentCoding::Zstd }) {
+        auto captured = new StringStreamWriter();
+        CompressingStreamWriter writer(unique_ptr<EntityStreamWriter>(captured), coding, 3);
+        writer.WriteJson(expected.substr(0, 1000));
+        writer.Flush();
+        writer.WriteJson(expected.substr(1000));
+        writer.Close();
+        assert(captured->data.size() < expected.size());
+
+        std::istringstream compressed(captured->data);
+        DecompressingStreamBuf buffer(compressed, coding, 1024);
+        std::istream in(&buffer);
+        std::stringstream plain;
+        plain << in.rdbuf();
+        assert(plain.str() == expected);
+    }
+
+    assert(NegotiateContentCoding("gzip, zstd;q=0", CompressionLevels()) == ContentCoding::Gzip);
+    assert(NegotiateContentCoding("br", CompressionLevels()) == ContentCoding::Identity);
+    assert(ParseContentCoding("compress") == ContentCoding::Unsupported);
+    return 1;
+}
+
+// a consumer that disconnects after the first few entities
+class DisconnectingStreamWriter : public StringStreamWriter {
+public:
+    bool IsCancelled() {
+        return data.size() > 200;
+    }
+};
+
+int testCancelledStreamStopsScan() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("people");
+
+    std::stringstream data;
+    data << "{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"http://things.myspace.com/\" }}\n";
+    for (int i = 0; i < 1000; i++) {
+        data << "{ \"@id\" : \"person" << i << "\" , \"name\" : \"person " << i << "\" }\n";
+    }
+    s->StoreEntitiesNdJson(data, "people");
+
+    DisconnectingStreamWriter writer;
+    writer.SetFormat(StreamFormat::NdJson);
+    s->WriteEntitiesToStream("people", "", -1, -1, writer);
+
+    // context plus a handful of entities, not all thousand
+    auto lines = std::count(writer.data.begin(), writer.data.end(), '\n');
+    assert(lines > 1 && lines < 20);
+
+    s->Delete();
+    return 1;
+}
+
+int testEntityCacheInvalidation() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("people");
+    s->AssertDataSet("places");
+
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"http://things.myspace.com/\" }}");
+    s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"gra\" , \"name\" : \"graham\" } ]"));
+    s->StoreEntity("places", make_shared<string>("[ " + context + ", { \"@id\" : \"gra\" , \"city\" : \"oslo\" } ]"));
+
+    auto rid = s->GetResourceId("http://things.myspace.com/gra");
+    vector<string> datasets{"people", "places"};
+    auto first = s->GetEntity(rid, datasets);
+    auto second = s->GetEntity(rid, datasets);
+    assert(first == second); // served from the cache
+    assert(s->GetStatsJson().find("\"hits\":1") != string::npos);
+
+    // a write to either dataset must be visible straight away
+    s->StoreEntity("places", make_shared<string>("[ " + context + ", { \"@id\" : \"gra\" , \"city\" : \"bergen\" } ]"));
+    auto third = s->GetEntity(rid, datasets);
+    assert(third->find("bergen") != string::npos);
+
+    s->Delete();
+    return 1;
+}
+
+int testPresenceIndex() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("people");
+    s->AssertDataSet("places");
+    s->AssertDataSet("things");
+
+    // a new store has nothing to backfill
+    while (s->GetStatsJson().find("\"presence-index\":{\"ready\":true}") == string::npos) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"http://things.myspace.com/\" }}");
+    s->StoreEntity("places", make_shared<string>("[ " + context + ", { \"@id\" : \"oslo\" , \"name\" : \"oslo\" } ]"));
+
+    // only the dataset holding the entity is read, so it comes back unmerged
+    auto rid = s->GetResourceId("http://things.myspace.com/oslo");
+    auto json = s->GetEntity(rid, vector<string>());
+    assert(json->find("\"oslo\"") != string::npos);
+
+    auto missing = s->GetEntity(s->GetResourceId("http://things.myspace.com/bergen"), vector<string>());
+    assert(missing->find("name") == string::npos);
+
+    // the bits of a deleted dataset are cleared in the background
+    s->DeleteDataSet("places");
+    while (s->GetStatsJson().find("\"dataset-purges\":{\"pending\":0}") == string::npos) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    json = s->GetEntity(rid, vector<string>());
+    assert(json->find("\"oslo\"") == string::npos);
+
+    s->Delete();
+    return 1;
+}
+
+int testEntityMerger() {
+    string people("{\"@id\":\"ns1:gra\",\"ns2:name\":\"graham\",\"ns2:knows\":[\"ns1:a\",\"ns1:b\"]}");
+    string places("{\"@id\":\"ns1:gra\",\"ns2:name\":\"graham\",\"ns2:knows\":[\"ns1:b\",\"ns1:c\"],\"ns2:city\":\"oslo\"}");
+    string work("{\"@id\":\"ns1:gra\",\"ns2:name\":\"graham moore\"}");
+
+    string merged;
+    assert(EntityMerger::Merge({ Slice(people), Slice(places), Slice(work) }, merged));
+
+    Document d;
+    d.Parse(merged.data());
+    assert(d["@id"] == "ns1:gra");
+    assert(d["ns2:city"] == "oslo");
+    assert(d["ns2:knows"].Size() == 3);
+    assert(d["ns2:name"].Size() == 2);
+
+    string broken("{\"@id\":\"ns1:gra\",\"ns2:name\":");
+    merged.clear();
+    assert(!EntityMerger::Merge({ Slice(people), Slice(broken) }, merged));
+    return 1;
+}
+
+int testRelatedEntitiesInBlocks() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("staff");
+    s->AssertDataSet("customers");
+
+    // more neighbours than fit in one block, each held in both datasets
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"http://things.myspace.com/\" }}");
+    for (int i = 0; i < 150; i++) {
+        auto entity = "[ " + context + ", { \"@id\" : \"p" + std::to_string(i) + "\" , \"name\" : \"person\", \"friend\" : \"<hub>\" } ]";
+        s->StoreEntity("staff", make_shared<string>(entity));
+        s->StoreEntity("customers", make_shared<string>(entity));
+    }
+
+    auto all = s->GetRelatedEntities("http://things.myspace.com/hub", "", true, -1, vector<string>());
+    assert(all->size() == 150);
+    for (auto const &entity : *all) {
+        assert(entity->find("[") == string::npos); // merged values were deduplicated
+    }
+
+    auto page = s->GetRelatedEntities("http://things.myspace.com/hub", "", true, 50, vector<string>());
+    assert(page->size() == 50);
+
+    // pages resume from the token, each neighbour is returned once across them
+    RelatedEntitiesQuery query;
+    query.subject = "http://things.myspace.com/hub";
+    query.inverse = true;
+    query.pageSize = 40;
+    size_t found = 0;
+    int pages = 0;
+    while (true) {
+        StringStreamWriter writer;
+        s->WriteRelatedEntitiesToStream(query, writer);
+        pages++;
+        for (auto at = writer.data.find("\"person\""); at != string::npos; at = writer.data.find("\"person\"", at + 1)) {
+            found++;
+        }
+
+        string marker("\"wod:next-data\" : \"");
+        auto tokenStart = writer.data.find(marker);
+        if (tokenStart == string::npos) break;
+        tokenStart += marker.size();
+        auto token = writer.data.substr(tokenStart, writer.data.find('"', tokenStart) - tokenStart);
+        assert(RelatedEntitiesQuery::Decode(token, query));
+    }
+    assert(found == 150);
+    assert(pages == 4);
+
+    // a token can't resume in a dataset that is not asked for or has been deleted
+    query.cursorDataSet = "customers";
+    assert(s->CanResumeRelatedEntities(query));
+    query.datasets = vector<string>{"staff"};
+    assert(!s->CanResumeRelatedEntities(query));
+    query.datasets.clear();
+    s->DeleteDataSet("customers");
+    assert(!s->CanResumeRelatedEntities(query));
+
+    s->Delete();
+    return 1;
+}
+
+int testTraversal() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("people");
+    s->AssertDataSet("companies");
+
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    s->StoreEntity("companies", make_shared<string>("[ " + context + ", { \"@id\" : \"acme\" , \"name\" : \"acme\" }, { \"@id\" : \"initech\" , \"name\" : \"initech\" } ]"));
+
+    // enough people that the second level is expanded on several threads
+    for (int i = 0; i < 200; i++) {
+        auto employer = i % 2 == 0 ? "acme" : "initech";
+        s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) +
+                                                     "\" , \"employer\" : \"<" + employer + ">\", \"knows\" : \"<p" + std::to_string((i + 1) % 200) + ">\" } ]"));
+    }
+
+    // colleagues of p0 are everyone at acme, including p0
+    bool truncated = false;
+    auto steps = s->ParseTraversalPath("out:employer/in:employer", base);
+    assert(steps.size() == 2 && !steps[0].inverse && steps[1].inverse);
+    auto colleagues = s->Traverse(base + "p0", steps, vector<string>(), 10000, truncated);
+    assert(colleagues.size() == 100 && !truncated);
+
+    // three hops over knows, and any property from there
+    auto knows = s->Traverse(base + "p0", s->ParseTraversalPath("out:knows/out:knows/out:knows", base), vector<string>(), 10000, truncated);
+    assert(knows.size() == 1 && knows[0] == s->GetResourceId(base + "p3"));
+    auto any = s->Traverse(base + "p3", s->ParseTraversalPath("out:*", base), vector<string>(), 10000, truncated);
+    assert(any.size() == 2);
+
+    // the frontier limit caps a level
+    s->Traverse(base + "p0", steps, vector<string>(), 10, truncated);
+    assert(truncated);
+
+    StringStreamWriter writer;
+    s->WriteEntitiesByIdToStream(colleagues, vector<string>(), writer);
+    assert(writer.data.find(s->GetResourceId(base + "p198")) != string::npos);
+
+    bool threw = false;
+    try {
+        s->ParseTraversalPath("sideways:knows", base);
+    } catch (const StoreException &) {
+        threw = true;
+    }
+    assert(threw);
+
+    s->Delete();
+    return 1;
+}
+
+int testShortestPath() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("people");
+
+    // a chain p0 -> p1 -> ... -> p9 with a shortcut p2 -> p7
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    for (int i = 0; i < 10; i++) {
+        string refs = i < 9 ? ", \"knows\" : \"<p" + std::to_string(i + 1) + ">\"" : "";
+        if (i == 2) refs = ", \"knows\" : [ \"<p3>\", \"<p7>\" ]";
+        s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) + "\"" + refs + " } ]"));
+    }
+
+    bool truncated = false;
+    auto path = s->FindShortestPath(base + "p0", base + "p9", vector<string>(), 6, 1000, truncated);
+    assert(path.size() == 6);
+    assert(path[0] == s->GetResourceId(base + "p0"));
+    assert(path[2] == s->GetResourceId(base + "p2"));
+    assert(path[3] == s->GetResourceId(base + "p7"));
+    assert(path[5] == s->GetResourceId(base + "p9"));
+
+    // paths are directed and limited by depth
+    assert(s->FindShortestPath(base + "p9", base + "p0", vector<string>(), 6, 1000, truncated).empty());
+    assert(s->FindShortestPath(base + "p0", base + "p9", vector<string>(), 4, 1000, truncated).empty());
+
+    s->Delete();
+    return 1;
+}
+
+int testStoreInRefsIndex() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("staff");
+    s->AssertDataSet("customers");
+    s->AssertDataSet("suppliers");
+
+    // refs written before the index is enabled are backfilled, those after are written with it
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    for (int i = 0; i < 20; i++) {
+        auto entity = "[ " + context + ", { \"@id\" : \"p" + std::to_string(i) + "\" , \"friend\" : \"<hub>\" } ]";
+        s->StoreEntity("staff", make_shared<string>(entity));
+        s->StoreEntity("customers", make_shared<string>(entity));
+    }
+
+    s->EnableStoreInRefsIndex();
+    while (s->GetStatsJson().find("\"store-inrefs-index\":{\"enabled\":true,\"ready\":true}") == string::npos) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    for (int i = 20; i < 30; i++) {
+        s->StoreEntity("suppliers", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) + "\" , \"friend\" : \"<hub>\" } ]"));
+    }
+
+    // a ref held by two datasets is returned once
+    auto all = s->GetRelatedEntities(base + "hub", "", true, -1, vector<string>());
+    assert(all->size() == 30);
+    auto named = s->GetRelatedEntities(base + "hub", "", true, -1, vector<string>{"customers", "suppliers"});
+    assert(named->size() == 30);
+    named = s->GetRelatedEntities(base + "hub", "", true, -1, vector<string>{"staff", "suppliers"});
+    assert(named->size() == 30);
+
+    // nor again on the next page when a page ends on it
+    RelatedEntitiesQuery query;
+    query.subject = base + "hub";
+    query.inverse = true;
+    query.pageSize = 1;
+    size_t found = 0;
+    while (true) {
+        StringStreamWriter writer;
+        s->WriteRelatedEntitiesToStream(query, writer);
+        for (auto at = writer.data.find("friend"); at != string::npos; at = writer.data.find("friend", at + 1)) {
+            found++;
+        }
+
+        string marker("\"wod:next-data\" : \"");
+        auto tokenStart = writer.data.find(marker);
+        if (tokenStart == string::npos) break;
+        tokenStart += marker.size();
+        auto token = writer.data.substr(tokenStart, writer.data.find('"', tokenStart) - tokenStart);
+        assert(RelatedEntitiesQuery::Decode(token, query));
+    }
+    assert(found == 30);
+
+    // a removed ref leaves the index with it
+    s->StoreEntity("suppliers", make_shared<string>("[ " + context + ", { \"@id\" : \"p29\" , \"name\" : \"gone\" } ]"));
+    assert(s->GetRelatedEntities(base + "hub", "", true, -1, vector<string>())->size() == 29);
+
+    // refs of a deleted dataset are skipped, and then purged from the index
+    s->DeleteDataSet("suppliers");
+    assert(s->GetRelatedEntities(base + "hub", "", true, -1, vector<string>())->size() == 20);
+    while (s->GetStatsJson().find("\"dataset-purges\":{\"pending\":0}") == string::npos) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(s->GetRelatedEntities(base + "hub", "", true, -1, vector<string>())->size() == 20);
+
+    bool truncated = false;
+    auto friends = s->Traverse(base + "hub", s->ParseTraversalPath("in:friend", base), vector<string>(), 10000, truncated);
+    assert(friends.size() == 20);
+    auto path = s->FindShortestPath(base + "p3", base + "hub", vector<string>(), 4, 1000, truncated);
+    assert(path.size() == 2);
+
+    s->Delete();
+    return 1;
+}
+
+int testDegreeCounters() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("staff");
+    s->AssertDataSet("customers");
+
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    for (int i = 0; i < 30; i++) {
+        // a ref listed twice is counted once
+        s->StoreEntity("staff", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) +
+                                                    "\" , \"friend\" : [ \"<hub>\", \"<hub>\" ], \"knows\" : \"<hub>\" } ]"));
+    }
+    s->StoreEntity("customers", make_shared<string>("[ " + context + ", { \"@id\" : \"p0\" , \"friend\" : \"<hub>\" } ]"));
+
+    // the refs are counted until the counters are ready, after which they are read
+    auto hub = s->GetResourceId(base + "hub");
+    auto counts = s->CountRelatedEntities(hub, "", true, vector<string>());
+    while (s->GetStatsJson().find("\"degree-counters\":{\"ready\":true}") == string::npos) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(s->CountRelatedEntities(hub, "", true, vector<string>()) == counts);
+    assert(counts.size() == 2);
+
+    string friendId, knowsId;
+    for (auto const &byProperty : counts) {
+        if (byProperty.first.find("friend") != string::npos) friendId = byProperty.first;
+        if (byProperty.first.find("knows") != string::npos) knowsId = byProperty.first;
+    }
+    assert(counts[friendId] == 31 && counts[knowsId] == 30);
+    assert(s->CountRelatedEntities(hub, friendId, true, vector<string>{"customers"})[friendId] == 1);
+    assert(s->CountRelatedEntities(s->GetResourceId(base + "p1"), "", false, vector<string>())[knowsId] == 1);
+
+    // an update moves the counts by the refs it adds and removes
+    s->StoreEntity("staff", make_shared<string>("[ " + context + ", { \"@id\" : \"p1\" , \"knows\" : [ \"<hub>\", \"<p2>\" ] } ]"));
+    counts = s->CountRelatedEntities(hub, "", true, vector<string>());
+    assert(counts[friendId] == 30 && counts[knowsId] == 30);
+    assert(s->CountRelatedEntities(s->GetResourceId(base + "p1"), knowsId, false, vector<string>())[knowsId] == 2);
+
+    // the count goes on the continuation entity
+    RelatedEntitiesQuery query;
+    query.subject = base + "hub";
+    query.property = knowsId;
+    query.inverse = true;
+    query.pageSize = 10;
+    StringStreamWriter writer;
+    s->WriteRelatedEntitiesToStream(query, writer);
+    assert(writer.data.find("\"wod:count\" : 30") != string::npos);
+
+    // the counters of a deleted dataset go with it
+    s->DeleteDataSet("customers");
+    while (s->GetStatsJson().find("\"dataset-purges\":{\"pending\":0}") == string::npos) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(s->CountRelatedEntities(hub, friendId, true, vector<string>())[friendId] == 30);
+
+    s->Delete();
+    return 1;
+}
+
+int testPropertyIndex() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("people");
+
+    // entities stored before the index is declared are backfilled, those after are written with it
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    for (int i = 0; i < 30; i++) {
+        auto name = i % 2 == 0 ? "alice" : "bob";
+        s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) +
+                                                     "\" , \"" + base + "name\" : \"" + name + "\" , \"" + base + "age\" : " +
+                                                     std::to_string(i - 10) + ".5 , \"" + base + "modified\" : \"2020-01-" +
+                                                     (i < 9 ? "0" : "") + std::to_string(i + 1) + "T12:00:00Z\" } ]"));
+    }
+
+    s->StoreDatasetMetadataEntity("people", "{ \"wod:indexes\" : [ \"" + base + "name\", \"" + base + "age\", \"" + base + "modified\" ] }");
+    auto name = s->AssertPropertyId(base + "name");
+    auto age = s->AssertPropertyId(base + "age");
+    auto modified = s->AssertPropertyId(base + "modified");
+    while (s->GetStatsJson().find("\"" + name + "\":false") != string::npos ||
+           s->GetStatsJson().find("\"" + name + "\":true") == string::npos) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    string token;
+    auto query = [&](const string &property, IndexValueType type, const string &lower, bool lowerInclusive,
+                     const string &upper, bool upperInclusive, const string &after, int count) {
+        PropertyIndexRange range;
+        range.type = type;
+        if (!lower.empty()) assert(PropertyIndex::EncodeValue(type, lower, range.lower));
+        if (!upper.empty()) assert(PropertyIndex::EncodeValue(type, upper, range.upper));
+        range.lowerInclusive = lowerInclusive;
+        range.upperInclusive = upperInclusive;
+        return s->QueryPropertyIndex("people", property, range, after, count, token);
+    };
+    auto equals = [&](const string &value) {
+        return query(name, IndexValueType::String, value, true, value, true, "", -1);
+    };
+    assert(equals("alice").size() == 15);
+
+    // pages follow on from the token
+    auto page = query(name, IndexValueType::String, "alice", true, "alice", true, "", 10);
+    assert(page.size() == 10 && !token.empty());
+    auto rest = query(name, IndexValueType::String, "alice", true, "alice", true, token, 10);
+    assert(rest.size() == 5 && rest.front() > page.back() && token.empty());
+
+    // numbers and dates are ordered by value, bounds open or closed
+    assert(query(age, IndexValueType::Number, "-1", true, "", true, "", -1).size() == 20);
+    assert(query(age, IndexValueType::Number, "-0.5", false, "2.5", false, "", -1).size() == 2);
+    assert(query(age, IndexValueType::Number, "", true, "-8.5", true, "", -1).size() == 2);
+    assert(query(modified, IndexValueType::Date, "2020-01-10", true, "2020-01-11T13:00:00+01:00", true, "", -1).size() == 2);
+    page = query(age, IndexValueType::Number, "0", true, "", true, "", 15);
+    rest = query(age, IndexValueType::Number, "0", true, "", true, token, 15);
+    assert(page.size() == 15 && rest.size() == 5 && token.empty());
+
+    // an update moves the entity between values, each value of an array is indexed
+    s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"p0\" , \"" + base + "name\" : [ \"bob\", \"carol\" ] } ]"));
+    s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"p30\" , \"" + base + "name\" : \"carol\" } ]"));
+    assert(equals("alice").size() == 14);
+    assert(equals("bob").size() == 16);
+    assert(equals("carol").size() == 2);
+    assert(query(age, IndexValueType::Number, "", true, "", true, "", -1).size() == 29);
+
+    // a full page ends with a continuation token
+    PropertyIndexRange carol;
+    PropertyIndex::EncodeValue(IndexValueType::String, "carol", carol.lower);
+    carol.upper = carol.lower;
+    StringStreamWriter writer;
+    s->WritePropertyIndexQueryToStream("people", name, carol, "", 1, writer);
+    assert(writer.data.find("@continuation") != string::npos);
+
+    // an undeclared property is not queryable
+    bool thrown = false;
+    try {
+        query(s->AssertPropertyId(base + "height"), IndexValueType::Number, "1", true, "1", true, "", -1);
+    } catch (const StoreException &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    s->Delete();
+    return 1;
+}
+
+static size_t CountOccurrences(const string &text, const string &part) {
+    size_t count = 0;
+    for (auto pos = text.find(part); pos != string::npos; pos = text.find(part, pos + part.length())) {
+        count++;
+    }
+    return count;
+}
+
+int testEntityFilter() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("things");
+
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    for (int i = 0; i < 20; i++) {
+        auto type = i % 4 == 0 ? "place" : "person";
+        auto kind = i % 2 == 0 ? "<even>" : "<odd>";
+        s->StoreEntity("things", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) + "\" , \"" +
+                                                     base + "type\" : \"" + type + "\" , \"" + base + "kind\" : \"" +
+                                                     kind + "\" , \"" + base + "age\" : " +
+                                                     std::to_string(i) + " , \"" + base + "marker\" : \"entity-marker\" , \"" +
+                                                     base + "note\" : \"a long note\" } ]"));
+    }
+
+    auto condition = [&](const string &expression) {
+        PropertyCondition parsed;
+        assert(s->ParseFilterCondition(expression, parsed));
+        return parsed;
+    };
+
+    // conditions are all met, numbers compare as numbers
+    EntityFilter places;
+    places.AddCondition(condition(base + "type=place"));
+    StringStreamWriter placesWriter;
+    s->WriteEntitiesToStream("things", "", -1, -1, placesWriter, &places);
+    assert(CountOccurrences(placesWriter.data, "entity-marker") == 5);
+
+    EntityFilter adults;
+    adults.AddCondition(condition(base + "type=person"));
+    adults.AddCondition(condition(base + "age>=10"));
+    adults.AddCondition(condition(base + "note"));
+    StringStreamWriter adultsWriter;
+    s->WriteEntitiesToStream("things", "", -1, -1, adultsWriter, &adults);
+    assert(CountOccurrences(adultsWriter.data, "entity-marker") == 8);
+
+    // a ref is matched by its uri
+    EntityFilter even;
+    even.AddCondition(condition(base + "kind=<" + base + "even>"));
+    StringStreamWriter evenWriter;
+    s->WriteEntitiesToStream("things", "", -1, -1, evenWriter, &even);
+    assert(CountOccurrences(evenWriter.data, "entity-marker") == 10);
+
+    // a projection keeps @ members and the fields
+    EntityFilter projected;
+    projected.AddField(s->GetPropertyId(base + "marker", ""));
+    StringStreamWriter projectedWriter;
+    s->WriteEntitiesToStream("things", "", -1, -1, projectedWriter, &projected);
+    assert(CountOccurrences(projectedWriter.data, "entity-marker") == 20);
+    assert(projectedWriter.data.find("a long note") == string::npos);
+
+    // a page of changes counts the entities written, and its token moves past those skipped
+    EntityFilter changes;
+    changes.AddCondition(condition(base + "age<4"));
+    StringStreamWriter changesWriter;
+    s->WriteChangesToStream("things", -1, 3, -1, changesWriter, &changes);
+    assert(CountOccurrences(changesWriter.data, "entity-marker") == 3);
+    auto next = changesWriter.data.find("\"wod:next-data\" : \"-1_");
+    assert(next != string::npos);
+    auto sequence = strtol(changesWriter.data.c_str() + next + strlen("\"wod:next-data\" : \"-1_"), nullptr, 10);
+    StringStreamWriter restWriter;
+    s->WriteChangesToStream("things", sequence, -1, -1, restWriter, &changes);
+    assert(CountOccurrences(restWriter.data, "entity-marker") == 1);
+
+    s->Delete();
+    return 1;
+}
+
+int testAggregation() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("things");
+
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    for (int i = 0; i < 1000; i++) {
+        auto type = i % 4 == 0 ? "place" : "person";
+        s->StoreEntity("things", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) + "\" , \"" +
+                                                     base + "type\" : \"" + type + "\" , \"" + base + "code\" : " +
+                                                     std::to_string(i % 500) + " } ]"));
+    }
+
+    AggregationSpec spec;
+    spec.groupBy.push_back(s->GetPropertyId(base + "type", ""));
+    spec.distinct.push_back(s->GetPropertyId(base + "code", ""));
+    auto job = s->GetAggregation(s->StartAggregation("things", spec, EntityFilter()));
+    while (job->GetState() == AggregationJob::Running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto status = job->GetStatusJson();
+    assert(job->GetState() == AggregationJob::Completed);
+    assert(status.find("\"entities\":1000") != string::npos);
+    assert(status.find("{\"value\":\"person\",\"count\":750},{\"value\":\"place\",\"count\":250}") != string::npos);
+
+    // the distinct estimate is within a few percent
+    Document result;
+    result.Parse(status.c_str());
+    auto codes = result["result"]["distinct"][spec.distinct[0].c_str()].GetUint64();
+    assert(codes > 480 && codes < 520);
+
+    // a filter narrows the entities counted
+    string property;
+    PropertyCondition places;
+    EntityFilter::ParseCondition(base + "type=place", property, places);
+    places.property = s->GetPropertyId(property, "");
+    EntityFilter filter;
+    filter.AddCondition(places);
+    job = s->GetAggregation(s->StartAggregation("things", spec, filter));
+    while (job->GetState() == AggregationJob::Running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(job->GetStatusJson().find("\"entities\":250") != string::npos);
+    assert(!s->CancelAggregation("999"));
+
+    s->Delete();
+    return 1;
+}
+
+int testBinaryEncoding() {
+    // the codec round trips an entity and finds a property without decoding the others
+    vector<string> names(1);
+    auto intern = [&](const char *name, size_t length) {
+        auto found = std::find(names.begin() + 1, names.end(), string(name, length));
+        if (found != names.end()) return (uint32_t) (found - names.begin());
+        names.emplace_back(name, length);
+        return (uint32_t) (names.size() - 1);
+    };
+    string json("{\"@id\":\"ns1:p0\",\"ns1:age\":-42,\"ns1:score\":0.25,\"ns1:tags\":[\"a\",true,null,{\"ns1:x\":1}],\"ns1:name\":\"bob\"}");
+    string encoded, decoded;
+    assert(EntityCodec::Encode(json.data(), json.size(), intern, encoded));
+    assert(EntityCodec::IsBinary(encoded) && encoded.size() < json.size());
+    assert(EntityCodec::ToJson(encoded, names, decoded) && decoded == json);
+    Slice value;
+    assert(EntityCodec::FindProperty(encoded, intern("ns1:name", 8), value));
+    decoded.clear();
+    assert(EntityCodec::ValueToJson(value, names, decoded) && decoded == "\"bob\"");
+    assert(!EntityCodec::FindProperty(encoded, intern("ns1:height", 10), value));
+    unordered_map<string, int> numbers;
+    for (size_t i = 1; i < names.size(); i++) numbers[names[i]] = (int) i;
+    vector<JsonMember> members;
+    string values;
+    assert(EntityCodec::FindMembers(encoded, vector<string>{"ns1:tags", "ns1:height", "ns1:age"}, names, numbers, values, members));
+    assert(members.size() == 2 && string(members[1].name.data, members[1].name.length) == "\"ns1:age\"");
+    assert(string(members[0].value.data, members[0].value.length) == "[\"a\",true,null,{\"ns1:x\":1}]");
+
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("things");
+
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    auto store = [&](int i) {
+        s->StoreEntity("things", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) + "\" , \"" +
+                                                     base + "name\" : \"n" + std::to_string(i) + "\" , \"" + base +
+                                                     "rank\" : " + std::to_string(i) + " } ]"));
+    };
+    auto converted = [&]() {
+        while (s->GetStatsJson().find("\"converting\":true") != string::npos) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    };
+    auto entity = [&](int i) {
+        return *s->GetEntity(s->GetResourceId(base + "p" + std::to_string(i)), vector<string>{"things"});
+    };
+
+    // entities from before the switch are converted, those after are written binary
+    for (int i = 0; i < 10; i++) store(i);
+    s->StoreDatasetMetadataEntity("things", "{ \"wod:encoding\" : \"binary\" }");
+    converted();
+    for (int i = 10; i < 20; i++) store(i);
+    assert(s->GetStatsJson().find("\"things\":{\"binary\":true,\"converting\":false}") != string::npos);
+    assert(entity(3).find("\"n3\"") != string::npos);
+    assert(entity(15).find("\"n15\"") != string::npos);
+
+    // a filter decodes only the values it tests, and converts the entities it keeps
+    PropertyCondition ranked;
+    assert(s->ParseFilterCondition(base + "rank>=15", ranked));
+    EntityFilter filter;
+    filter.AddCondition(ranked);
+    filter.AddField(s->GetPropertyId(base + "name", ""));
+    StringStreamWriter writer;
+    s->WriteEntitiesToStream("things", "", -1, -1, writer, &filter);
+    assert(CountOccurrences(writer.data, "\"n1") == 5 && writer.data.find("rank") == string::npos);
+
+    // an unchanged entity is not written again
+    auto sequence = s->GetDataSet("things")->GetCurrentSequenceId();
+    store(3);
+    store(15);
+    assert(s->GetDataSet("things")->GetCurrentSequenceId() == sequence);
+
+    // names are reloaded with the store
+    s->Close();
+    s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    assert(entity(15).find("\"n15\"") != string::npos);
+
+    // and back to json
+    s->StoreDatasetMetadataEntity("things", "{ \"wod:encoding\" : \"json\" }");
+    converted();
+    assert(entity(15).find("\"n15\"") != string::npos);
+    store(15);
+    assert(s->GetDataSet("things")->GetCurrentSequenceId() == sequence);
+
+    bool thrown = false;
+    try {
+        s->StoreDatasetMetadataEntity("things", "{ \"wod:encoding\" : \"zip\" }");
+    } catch (const StoreException &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    s->Delete();
+    return 1;
+}
+
+int testEntityCompression() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    auto ds = s->AssertDataSet("people");
+
+    // entities much like those of gendata.py
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    string data("[ " + context);
+    for (int i = 0; i < 2000; i++) {
+        data += ", { \"@id\" : \"obj" + std::to_string(i) + "\" , \"name\" : \"person " + std::to_string(i) +
+                "\" , \"address\" : \"oslo\" , \"type\" : \"person\"";
+        for (int d = 0; d < 8; d++) {
+            data += " , \"description" + std::to_string(d) + "\" : \"and the sun came up over the hills and it was nice\"";
+        }
+        data += " , \"friend\" : \"<obj" + std::to_string(i + 1) + ">\" , \"department\" : \"<dept1443>\" }";
+    }
+    s->StoreEntity("people", make_shared<string>(data + " ]"));
+    s->GetDatabase()->Flush(rocksdb::FlushOptions(), ds->GetStoreColumnFamily());
+
+    Document stats;
+    stats.Parse(s->GetStatsJson().c_str());
+    auto const &store = stats["compression"]["datasets"]["people"]["store"];
+    assert(store["files"].GetUint64() > 0);
+    assert(string(store["compression"].GetString()) == "ZSTD");
+    assert(store["ratio"].GetDouble() > 2);
+
+    // reading it back goes through the decompressor
+    assert(s->GetEntity(s->GetResourceId(base + "obj7"), vector<string>{"people"})->find("person 7") != string::npos);
+    stats.Parse(s->GetStatsJson().c_str());
+    assert(stats["compression"]["blocks-decompressed"].GetUint64() > 0);
+
+    s->Delete();
+    return 1;
+}
+
+int testGraphSnapshot() {
+    auto storeName = MakeGuid();
+    auto storeLoc = string("/tmp/stores/store_") + storeName;
+    boost::filesystem::create_directory(storeLoc.c_str());
+    auto s = make_shared<Store>(storeName, storeLoc);
+    s->OpenRocksDb(storeLoc);
+    s->AssertDataSet("people");
+
+    // a chain p0 -> p1 -> ... -> p9
+    string base("http://things.myspace.com/");
+    string context("{ \"@id\" : \"@context\" , \"namespaces\" : { \"_\" : \"" + base + "\" }}");
+    for (int i = 0; i < 9; i++) {
+        s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"p" + std::to_string(i) +
+                                                     "\" , \"knows\" : \"<p" + std::to_string(i + 1) + ">\" } ]"));
+    }
+
+    assert(s->StartGraphBuild(vector<string>()));
+    while (s->GetGraph() == nullptr) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto graph = s->GetGraph();
+    assert(graph->GetNodeCount() == 10 && graph->GetEdgeCount() == 9);
+    assert(graph->GetComponentsJson(2, 1).find("\"components\":1") != string::npos);
+
+    // a separate pair joins after a refresh, the earlier snapshot is unchanged
+    s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"q0\" , \"knows\" : \"<q1>\" } ]"));
+    size_t refreshed;
+    assert(s->RefreshGraph(refreshed) && refreshed == 1);
+    assert(s->GetGraph()->GetNodeCount() == 12 && s->GetGraph()->GetEdgeCount() == 10);
+    assert(s->GetGraph()->GetComponentsJson(2, 1).find("\"components\":2") != string::npos);
+    assert(graph->GetNodeCount() == 10);
+    assert(s->GetGraph()->GetPageRankJson(2, 10, 0.85, 1).find(s->GetResourceId(base + "p9")) != string::npos);
+
+    // a write still in an uncommitted batch holds the refresh below its sequence, the write
+    // committed after it is read once the batch lands
+    auto ds = s->GetDataSet("people");
+    auto pending = make_shared<rocksdb::WriteBatch>();
+    auto r0 = s->GetResourceId(base + "r0");
+    string json("{\"@id\":\"" + r0 + "\"}");
+    vector<pair<string, string>> refs;
+    s->WriteEntity(pending, ds, json, r0, refs);
+    s->StoreEntity("people", make_shared<string>("[ " + context + ", { \"@id\" : \"q2\" , \"knows\" : \"<q3>\" } ]"));
+    assert(s->RefreshGraph(refreshed) && refreshed == 0);
+    string name("people");
+    s->WriteBatch(name, 1, pending);
+    assert(s->RefreshGraph(refreshed) && refreshed == 2);
+    assert(s->GetGraph()->GetEdgeCount() == 11);
+
+    s->Delete();
+    return 1;
+}
+
 int TestStoreManagerCreateStore() {
     auto storeName = MakeGuid();
     auto sm = StoreManager("/tmp/stores");
@@ -811,8 +1747,26 @@ int main(int argc, char* argv[]) {
     // testDeleteDatasetWithData();
     // testCreateDeleteDataset();
     // testAssertNamespace();
+    // testNamespaceTrie();
+    // testCompressionRoundTrip();
+    // testCancelledStreamStopsScan();
+    // testEntityCacheInvalidation();
+    // testPresenceIndex();
+    // testEntityMerger();
+    // testRelatedEntitiesInBlocks();
+    // testTraversal();
+    // testShortestPath();
+    // testStoreInRefsIndex();
+    // testDegreeCounters();
+    // testPropertyIndex();
+    // testEntityFilter();
+    // testAggregation();
+    // testBinaryEncoding();
+    // testEntityCompression();
+    // testGraphSnapshot();
     // testInsertEntity();
     // testInsertEntityNoContext();
+    // testInsertEntitiesNdJson();
     // testTrySaveBadJson();
     // testReplaceEntity();
     // TestStoreManagerCreateStore();
@@ -0,0 +1,105 @@
+#ifndef WEBOFDATA_AGGREGATION_H
+#define WEBOFDATA_AGGREGATION_H
+
+#include "EntityFilter.h"
+#include "EntityMerger.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // Approximate distinct count in 2^precision one byte registers, about 1.6% standard error at the
+    // default precision. Sketches of the same precision merge by taking each register's maximum.
+    class HyperLogLog {
+    private:
+        int _precision;
+        vector<uint8_t> _registers;
+
+    public:
+        explicit HyperLogLog(int precision = 14);
+
+        void Add(uint64_t hash);
+
+        void Merge(const HyperLogLog &other);
+
+        double Estimate() const;
+    };
+
+    // what an aggregation computes over the entities of a dataset
+    struct AggregationSpec {
+        vector<string> groupBy;  // stored property ids, entities counted by each of their values
+        vector<string> distinct; // stored property ids, their distinct values counted approximately
+        size_t top = 100;        // largest groups reported for each grouped property
+    };
+
+    // one worker's counts, combined once the scan is over. values are kept as the raw json text, so a
+    // group's value goes into the result as written
+    class AggregationPartial {
+    private:
+        uint64_t _entities = 0;
+        vector<unordered_map<string, uint64_t>> _groups;
+        vector<HyperLogLog> _distinct;
+        vector<JsonSpan> _elements;
+        vector<string> _properties; // grouped then distinct, the values a binary entity has decoded
+        vector<JsonMember> _members;
+        string _values;
+
+    public:
+        explicit AggregationPartial(const AggregationSpec &spec);
+
+        // counts an entity from its top level members
+        void Add(const vector<JsonMember> &members, const AggregationSpec &spec);
+
+        // counts an entity in either form, a binary one read with the store's property names and numbers
+        void Add(const rocksdb::Slice &entity, const vector<string> &names, const unordered_map<string, int> &numbers,
+                 const AggregationSpec &spec);
+
+        void Merge(const AggregationPartial &other);
+
+        // entities, groups by property with the top values by count, and distinct estimates by property
+        string ToJson(const AggregationSpec &spec) const;
+    };
+
+    // an aggregation scanning in the background, read by status requests while its workers run
+    class AggregationJob {
+    public:
+        enum State { Running, Completed, Cancelled, Failed };
+
+        const string id;
+        const string dataset;
+        const AggregationSpec spec;
+        const EntityFilter filter; // copied by each worker, a filter is not thread safe
+
+        atomic<bool> cancelled;
+        atomic<size_t> ranges;
+        atomic<size_t> rangesScanned;
+        atomic<uint64_t> entitiesScanned;
+        std::thread worker;
+
+        AggregationJob(string id, string dataset, AggregationSpec spec, EntityFilter filter)
+                : id(std::move(id)), dataset(std::move(dataset)), spec(std::move(spec)), filter(std::move(filter)),
+                  cancelled(false), ranges(0), rangesScanned(0), entitiesScanned(0) {}
+
+        void Finish(State state, const string &resultOrError);
+
+        State GetState();
+
+        // state, progress and once completed the result
+        string GetStatusJson();
+
+    private:
+        std::mutex _mutex;
+        State _state = Running;
+        string _result;
+        string _error;
+    };
+}
+
+#endif //WEBOFDATA_AGGREGATION_H
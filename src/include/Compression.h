@@ -0,0 +1,107 @@
+#ifndef WEBOFDATA_COMPRESSION_H
+#define WEBOFDATA_COMPRESSION_H
+
+#include <istream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <zstd.h>
+#include "EntityStreamWriter.h"
+
+namespace webofdata {
+
+    using namespace std;
+
+    enum class ContentCoding { Identity, Gzip, Zstd, Unsupported };
+
+    class CompressionException : public std::runtime_error {
+    public:
+        explicit CompressionException(const string &msg) : std::runtime_error(msg) {}
+    };
+
+    // compression levels for one route, 0 disables that coding
+    struct CompressionLevels {
+        int gzip = 6;
+        int zstd = 3;
+    };
+
+    // maps a Content-Encoding header value, an empty value is identity
+    ContentCoding ParseContentCoding(const string &contentEncoding);
+
+    // picks the coding for a response from an Accept-Encoding header, zstd is preferred over gzip
+    ContentCoding NegotiateContentCoding(const string &acceptEncoding, const CompressionLevels &levels);
+
+    const char *ContentCodingName(ContentCoding coding);
+
+    // Decompresses a gzip or zstd encoded istream as it is read so the parser sees the
+    // plain entity json without the whole body being inflated up front.
+    class DecompressingStreamBuf : public std::streambuf {
+    private:
+        std::istream &_source;
+        ContentCoding _coding;
+        vector<char> _in;
+        vector<char> _out;
+        size_t _inAvailable;
+        size_t _inPosition;
+        bool _sourceEnded;
+        bool _frameEnded;
+        bool _outputPending;
+
+        z_stream _zstream;
+        ZSTD_DStream *_zstd;
+
+        bool FillInput();
+
+        size_t Decompress();
+
+    protected:
+        int_type underflow() override;
+
+    public:
+        DecompressingStreamBuf(std::istream &source, ContentCoding coding, size_t bufferSize = 64 * 1024);
+
+        ~DecompressingStreamBuf();
+    };
+
+    // Compresses everything written through it and passes the compressed bytes on to the
+    // wrapped writer. Set the stream format on this writer, not the inner one.
+    class CompressingStreamWriter : public EntityStreamWriter {
+    private:
+        unique_ptr<EntityStreamWriter> _inner;
+        ContentCoding _coding;
+        vector<char> _out;
+        bool _closed;
+
+        z_stream _zstream;
+        ZSTD_CStream *_zstd;
+
+        enum class Mode { Continue, Flush, End };
+
+        void Compress(const char *data, size_t length, Mode mode);
+
+    public:
+        CompressingStreamWriter(unique_ptr<EntityStreamWriter> inner, ContentCoding coding, int level);
+
+        ~CompressingStreamWriter();
+
+        void WriteJson(const string &json) override {
+            Compress(json.data(), json.length(), Mode::Continue);
+        }
+
+        void WriteJson(const char *json, int length) override {
+            Compress(json, (size_t) length, Mode::Continue);
+        }
+
+        void Flush() override;
+
+        void Close() override;
+
+        bool IsCancelled() override {
+            return _inner->IsCancelled();
+        }
+    };
+}
+
+#endif //WEBOFDATA_COMPRESSION_H
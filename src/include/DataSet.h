@@ -2,6 +2,8 @@
 #define WEBOFDATA_DATASET_H
 
 #include <mutex>
+#include <atomic>
+#include <set>
 #include <rocksdb/db.h>
 #include "Store.h"
 
@@ -24,7 +26,11 @@ namespace webofdata {
         int _id;
         ulong _nextSeqId;
         std::mutex log_seq_mutex;
+        std::set<ulong> _uncommittedSeqIds; // handed to a batch that has not been written yet
         vector<shared_ptr<Pipe>> _pipes;
+        std::atomic<int> _activeIngests;
+        std::atomic<ulong> _writeGeneration;
+        std::atomic<bool> _binaryEncoding; // entities written in the binary form rather than as json
 
         ColumnFamilyHandle *_resourceSizeColumnFamily;
         ColumnFamilyHandle *_resourceStoreColumnFamily;
@@ -32,6 +38,15 @@ namespace webofdata {
 
         ColumnFamilyHandle *_resourceOutRefsColumnFamily;
         ColumnFamilyHandle *_resourceInRefsColumnFamily;
+        ColumnFamilyHandle *_resourcePropertyIndexColumnFamily;
+
+        // indexed property -> true once its backfill has completed, copy on write
+        shared_ptr<const map<string, bool>> _indexedProperties;
+
+        // ids committed while a backfill runs, so it can bring the entities written during it up to date
+        std::mutex _recordingMutex;
+        bool _recordingWrites;
+        vector<string> _recordedWrites;
 
         void AssertColumnFamilies();
 
@@ -43,6 +58,11 @@ namespace webofdata {
             _name = name;
             _id = id;
             _store = store;
+            _activeIngests = 0;
+            _writeGeneration = 0;
+            _binaryEncoding = false;
+            _indexedProperties = make_shared<const map<string, bool>>();
+            _recordingWrites = false;
             AssertColumnFamilies();
             LookupNextSeqId();
         }
@@ -58,6 +78,7 @@ namespace webofdata {
             cfs.push_back(_resourceLogColumnFamily);
             cfs.push_back(_resourceOutRefsColumnFamily);
             cfs.push_back(_resourceInRefsColumnFamily);
+            cfs.push_back(_resourcePropertyIndexColumnFamily);
             return cfs;
         }
 
@@ -81,9 +102,54 @@ namespace webofdata {
             return _resourceInRefsColumnFamily;
         }
 
+        ColumnFamilyHandle *GetPropertyIndexColumnFamily() {
+            return _resourcePropertyIndexColumnFamily;
+        }
+
+        shared_ptr<const map<string, bool>> GetIndexedProperties() {
+            return std::atomic_load(&_indexedProperties);
+        }
+
+        void SetIndexedProperties(shared_ptr<const map<string, bool>> properties) {
+            std::atomic_store(&_indexedProperties, std::move(properties));
+        }
+
+        bool UsesBinaryEncoding() {
+            return _binaryEncoding;
+        }
+
+        void SetBinaryEncoding(bool binary) {
+            _binaryEncoding = binary;
+        }
+
+        void StartRecordingWrites() {
+            std::lock_guard<std::mutex> lock(_recordingMutex);
+            _recordingWrites = true;
+            _recordedWrites.clear();
+        }
+
+        vector<string> StopRecordingWrites() {
+            std::lock_guard<std::mutex> lock(_recordingMutex);
+            _recordingWrites = false;
+            return std::move(_recordedWrites);
+        }
+
+        bool IsRecordingWrites() {
+            std::lock_guard<std::mutex> lock(_recordingMutex);
+            return _recordingWrites;
+        }
+
+        void RecordWrites(const vector<string> &ids) {
+            std::lock_guard<std::mutex> lock(_recordingMutex);
+            if (_recordingWrites) {
+                _recordedWrites.insert(_recordedWrites.end(), ids.begin(), ids.end());
+            }
+        }
+
         ulong GetNextSequenceId() {
             std::lock_guard<std::mutex> lock(log_seq_mutex);
             _nextSeqId++;
+            _uncommittedSeqIds.insert(_nextSeqId);
             return _nextSeqId;
         }
 
@@ -91,10 +157,47 @@ namespace webofdata {
             return _nextSeqId;
         }
 
+        // the batch holding these sequences was written or dropped
+        void EndSequenceIds(const vector<ulong> &sequences) {
+            std::lock_guard<std::mutex> lock(log_seq_mutex);
+            for (auto sequence : sequences) {
+                _uncommittedSeqIds.erase(sequence);
+            }
+        }
+
+        // every log entry up to this sequence is committed. concurrent ingests commit out of order, so
+        // it can be below the current sequence
+        ulong GetCommittedSequenceId() {
+            std::lock_guard<std::mutex> lock(log_seq_mutex);
+            return _uncommittedSeqIds.empty() ? _nextSeqId : *_uncommittedSeqIds.begin() - 1;
+        }
+
         int GetId() {
             return _id;
         }
 
+        // bumped after every committed write, cached reads of the dataset older than this are stale
+        void MarkWritten() {
+            _writeGeneration++;
+        }
+
+        ulong GetWriteGeneration() {
+            return _writeGeneration;
+        }
+
+        // claims one of maxIngests concurrent ingest slots, false if they are all taken
+        bool TryBeginIngest(int maxIngests) {
+            if (++_activeIngests > maxIngests) {
+                _activeIngests--;
+                return false;
+            }
+            return true;
+        }
+
+        void EndIngest() {
+            _activeIngests--;
+        }
+
         string GetName() {
             return _name;
         }
@@ -0,0 +1,143 @@
+#ifndef WEBOFDATA_ENTITYCACHE_H
+#define WEBOFDATA_ENTITYCACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // Sharded LRU of serialised merged entities. A key is an entity id plus the datasets it was
+    // merged from, and each entry remembers the write generation of those datasets when it was
+    // read. A lookup only hits if the generations passed in still match, so any write to one of
+    // the datasets invalidates the entry without the writer having to find it.
+    class EntityCache {
+    private:
+        struct Entry {
+            string key;
+            vector<unsigned long> generations;
+            shared_ptr<string> value;
+        };
+
+        struct Shard {
+            mutex lock;
+            list<Entry> entries; // most recently used first
+            unordered_map<string, list<Entry>::iterator> index;
+            size_t bytes = 0;
+        };
+
+        vector<unique_ptr<Shard>> _shards;
+        size_t _shardCapacity;
+        hash<string> _hash;
+
+        atomic<unsigned long> _hits;
+        atomic<unsigned long> _misses;
+        atomic<unsigned long> _evictions;
+
+        static size_t EntrySize(const Entry &entry) {
+            return entry.key.size() + entry.value->size() + entry.generations.size() * sizeof(unsigned long) + 64;
+        }
+
+        Shard &GetShard(const string &key) {
+            return *_shards[_hash(key) % _shards.size()];
+        }
+
+        void Remove(Shard &shard, list<Entry>::iterator entry) {
+            shard.bytes -= EntrySize(*entry);
+            shard.index.erase(entry->key);
+            shard.entries.erase(entry);
+        }
+
+    public:
+        EntityCache(size_t capacityBytes, int shardCount = 16) {
+            for (int i = 0; i < shardCount; i++) {
+                _shards.emplace_back(new Shard());
+            }
+            _shardCapacity = capacityBytes / shardCount;
+            _hits = 0;
+            _misses = 0;
+            _evictions = 0;
+        }
+
+        // the cached entity or nullptr, the returned string must not be modified
+        shared_ptr<string> Get(const string &key, const vector<unsigned long> &generations) {
+            auto &shard = GetShard(key);
+            lock_guard<mutex> guard(shard.lock);
+
+            auto found = shard.index.find(key);
+            if (found == shard.index.end()) {
+                _misses++;
+                return nullptr;
+            }
+
+            if (found->second->generations != generations) {
+                // a dataset has been written since, the entry can never hit again
+                Remove(shard, found->second);
+                _misses++;
+                return nullptr;
+            }
+
+            shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+            _hits++;
+            return found->second->value;
+        }
+
+        // generations must have been read before the entity was, so a concurrent write leaves the entry stale
+        void Put(const string &key, const vector<unsigned long> &generations, shared_ptr<string> value) {
+            auto &shard = GetShard(key);
+            lock_guard<mutex> guard(shard.lock);
+
+            auto found = shard.index.find(key);
+            if (found != shard.index.end()) {
+                Remove(shard, found->second);
+            }
+
+            shard.entries.push_front(Entry{key, generations, std::move(value)});
+            shard.index[key] = shard.entries.begin();
+            shard.bytes += EntrySize(shard.entries.front());
+
+            while (shard.bytes > _shardCapacity && !shard.entries.empty()) {
+                Remove(shard, std::prev(shard.entries.end()));
+                _evictions++;
+            }
+        }
+
+        unsigned long GetHits() {
+            return _hits;
+        }
+
+        unsigned long GetMisses() {
+            return _misses;
+        }
+
+        unsigned long GetEvictions() {
+            return _evictions;
+        }
+
+        size_t GetBytes() {
+            size_t bytes = 0;
+            for (auto &shard : _shards) {
+                lock_guard<mutex> guard(shard->lock);
+                bytes += shard->bytes;
+            }
+            return bytes;
+        }
+
+        size_t GetCount() {
+            size_t count = 0;
+            for (auto &shard : _shards) {
+                lock_guard<mutex> guard(shard->lock);
+                count += shard->entries.size();
+            }
+            return count;
+        }
+    };
+}
+
+#endif //WEBOFDATA_ENTITYCACHE_H
@@ -0,0 +1,55 @@
+#ifndef WEBOFDATA_ENTITYCODEC_H
+#define WEBOFDATA_ENTITYCODEC_H
+
+#include "EntityMerger.h"
+#include <rocksdb/slice.h>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // Compact binary form of a stored entity, an alternative to its json text a dataset can opt in to.
+    // Member names are interned property numbers, scalars are typed and containers carry their element
+    // count and byte length, so a property is found by skipping over the members before it without
+    // decoding them. A value starts with Marker, which no json text starts with, so both forms can be
+    // read from the same column family while a dataset converts.
+    //
+    //   value  : Marker object
+    //   object : 'o' count:u32 length:u32 (name:varint value)*
+    //   array  : 'a' count:u32 length:u32 value*
+    //   scalar : 'n' | 't' | 'f' | 'i' zigzag:varint | 'd' double:8 | 's' length:varint bytes
+    class EntityCodec {
+    public:
+        static const char Marker = '\x01';
+
+        static bool IsBinary(const rocksdb::Slice &value) {
+            return value.size() > 0 && value.data()[0] == Marker;
+        }
+
+        // the binary form of an entity's json object, names numbered by intern. false if the json is not an object
+        static bool Encode(const char *json, size_t length, const function<uint32_t(const char *, size_t)> &intern,
+                           string &output);
+
+        // appends the json of a binary entity, names looked up by number. false if the value is malformed
+        static bool ToJson(const rocksdb::Slice &value, const vector<string> &names, string &json);
+
+        // the encoded value of a top level property, decoded by ValueToJson. false if the entity doesn't have it
+        static bool FindProperty(const rocksdb::Slice &value, uint32_t name, rocksdb::Slice &encodedValue);
+
+        // appends the json of one encoded value
+        static bool ValueToJson(const rocksdb::Slice &encodedValue, const vector<string> &names, string &json);
+
+        // the members of a binary entity's properties, found by their numbers and each value decoded alone,
+        // so a scan reads the few properties it tests without converting the entity. the quoted names and the
+        // values are written to json, which the members point into. false if a value is malformed
+        static bool FindMembers(const rocksdb::Slice &value, const vector<string> &properties, const vector<string> &names,
+                                const unordered_map<string, int> &numbers, string &json, vector<JsonMember> &members);
+    };
+}
+
+#endif //WEBOFDATA_ENTITYCODEC_H
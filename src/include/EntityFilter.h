@@ -0,0 +1,76 @@
+#ifndef WEBOFDATA_ENTITYFILTER_H
+#define WEBOFDATA_ENTITYFILTER_H
+
+#include "EntityMerger.h"
+#include "PropertyIndex.h"
+#include <rocksdb/slice.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // a test of one property, met if any of its values passes
+    struct PropertyCondition {
+        enum Operator { Exists, Equals, Less, LessOrEqual, Greater, GreaterOrEqual };
+
+        string property; // stored property id
+        Operator op = Exists;
+        IndexValueType type = IndexValueType::String;
+        string encoded; // the value in the property index encoding, compared by bytes
+    };
+
+    // Filter and projection of the stored json of entities in a scan. Conditions are evaluated over
+    // the member spans, so an entity that doesn't match is skipped without being parsed or copied,
+    // and a projection copies only the kept members. A binary entity has only the values of the
+    // conditions' properties decoded, and is converted to json once it meets them. Not thread safe,
+    // one per scan.
+    class EntityFilter {
+    private:
+        vector<PropertyCondition> _conditions;
+        vector<string> _conditionProperties;
+        vector<string> _fields;
+        vector<JsonMember> _members;
+        vector<JsonSpan> _elements;
+        string _encoded;
+        string _values;
+        string _decoded;
+        string _projected;
+
+        bool Meets(const PropertyCondition &condition, const JsonSpan &value);
+
+        bool MeetsConditions(const vector<JsonMember> &members);
+
+        bool Project(const vector<JsonMember> &members, rocksdb::Slice &output);
+
+    public:
+        // splits property, property=value, property<value, property<=value, property>value or
+        // property>=value. the value is compared as a number or a date when it reads as one
+        static bool ParseCondition(const string &expression, string &property, PropertyCondition &condition);
+
+        void AddCondition(const PropertyCondition &condition) {
+            _conditions.push_back(condition);
+            _conditionProperties.push_back(condition.property);
+        }
+
+        // keeps the property in the output, with no fields every property is kept. members starting with @ always are
+        void AddField(const string &property) { _fields.push_back(property); }
+
+        bool IsEmpty() const { return _conditions.empty() && _fields.empty(); }
+
+        // false if the entity doesn't meet every condition, otherwise output is the entity or its projection,
+        // valid until the next call
+        bool Apply(const rocksdb::Slice &entity, rocksdb::Slice &output);
+
+        // as Apply for an entity in either form, a binary one read with the store's property names and numbers
+        bool Apply(const rocksdb::Slice &entity, const vector<string> &names, const unordered_map<string, int> &numbers,
+                   rocksdb::Slice &output);
+
+        // true if the entity meets every condition, without converting a binary one
+        bool Meets(const rocksdb::Slice &entity, const vector<string> &names, const unordered_map<string, int> &numbers);
+    };
+}
+
+#endif //WEBOFDATA_ENTITYFILTER_H
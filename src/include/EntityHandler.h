@@ -4,6 +4,7 @@
 #include <rocksdb/db.h>
 #include <rocksdb/write_batch.h>
 #include <string>
+#include <unordered_set>
 #include <iostream>
 #include <sstream>
 #include <rapidjson/document.h>
@@ -29,26 +30,34 @@ namespace webofdata {
 		int _batchSize;
 		int _entityCount;
 
-		map<string, string> _localResourceToIdIndex; // used per run to keep local ids to hand
-		map<string, int> _localPrefixToIdIndex; // maps ns prefixes such as http://www.example.org => 1
-		map<string, string> _localPropertyToIdIndex; // maps ns prefixes such as http://www.example.org => 1
+		map<string, int> _localPrefixToIdIndex; // maps ns prefixes such as http://www.example.org => 1, only used when the store trie misses
 		map<string, int> _context;
 		string _contextDefaultPrefix = "http://test.webofdata.io/things/";
+		int _contextDefaultPrefixId = -1; // resolved lazily, reset when the context changes the default prefix
+
+		string _idBuffer; // reused for every resolved resource / property id
+		string _refBuffer; // reused for <ref> values
 
 		StringBuffer *_newJson;
 		Writer<StringBuffer> *_writer;
 
 		bool _inIdProperty = false;
 		bool _inContextEntity = false;
+		bool _inContinuationEntity = false;
 		bool _inNamespaceSection = false;
 		bool _inDatatypesSection = false;
 
-		string AssertResourceId(string uri);
+		// both resolve into _idBuffer and return a reference to it, valid until the next call
+		const string& AssertResourceId(const char *uri, size_t length);
 
-		string AssertPropertyId(string uri);
+		const string& AssertPropertyId(const char *uri, size_t length);
 
 		int AssertPrefixId(string prefix); // maps a uri such as http://example.org => 1
 
+		int ResolvePrefixId(const NamespaceTrie &trie, const char *prefix, size_t length);
+
+		int GetContextDefaultPrefixId();
+
 		int _state = 0; // used to indicate when we pass the opening '['
 		int _objDepth = 0; // used to know when we are on the top level for creating refs
 		string _currentKey; // current json key
@@ -61,20 +70,30 @@ namespace webofdata {
 
 		shared_ptr<WriteBatch> _writeBatch;
 		int _batchCount = 0;
+		unordered_set<string> _batchIds; // entities written to the batch, each diffs its refs against committed state
 
 		void WriteKey();
 
 	public:
-		EntityHandler(shared_ptr<Store> store, shared_ptr<DataSet> dataset, shared_ptr<WriteBatch> writeBatch) {
+		// lineDelimited handlers are fed one entity per parse (ndjson) so there is no outer array to skip
+		EntityHandler(shared_ptr<Store> store, shared_ptr<DataSet> dataset, shared_ptr<WriteBatch> writeBatch,
+		              bool lineDelimited = false) {
 			_store = store;
 			_dataset = dataset;
 			_newJson = new StringBuffer();
 			_writer = new Writer<StringBuffer>(*_newJson);
 			_writeBatch = writeBatch;
 			_entityCount = 0;
+			if (lineDelimited) {
+				_state = 1;
+			}
 		}
 
 		~EntityHandler() {
+			// a batch left over by a failed parse or write is not written
+			if (_batchCount > 0) {
+				_store->DiscardBatch(_dataset, *_writeBatch);
+			}
 			delete _writer;
 			delete _newJson;
 		}
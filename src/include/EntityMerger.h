@@ -0,0 +1,50 @@
+#ifndef WEBOFDATA_ENTITYMERGER_H
+#define WEBOFDATA_ENTITYMERGER_H
+
+#include <rocksdb/slice.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // a run of bytes inside one of the partial documents, nothing is copied out of them
+    struct JsonSpan {
+        const char *data;
+        size_t length;
+
+        bool operator==(const JsonSpan &other) const {
+            return length == other.length && memcmp(data, other.data, length) == 0;
+        }
+    };
+
+    // one top level member of an entity, name is the quoted key as written
+    struct JsonMember {
+        JsonSpan name;
+        JsonSpan value;
+    };
+
+    // Merges the partial documents of one entity held in several datasets. The partials are
+    // compact json objects as written by the store, so members are found by scanning the
+    // bytes and values are compared and copied as raw text rather than parsed into DOMs.
+    // Each partial's members are sorted by key and the partials merged k ways, so the output
+    // is written property by property in key order with array values deduplicated by hash.
+    //
+    // A property present in one partial keeps its value. Where partials disagree the values
+    // become an array holding each distinct value once, arrays contributing their elements.
+    class EntityMerger {
+    public:
+        // splits a top level json object into member spans, false if it is not well formed
+        static bool ScanMembers(const char *json, size_t length, vector<JsonMember> &members);
+
+        // splits a json array into element spans, false if it is not well formed
+        static bool ScanElements(const char *json, size_t length, vector<JsonSpan> &elements);
+
+        // appends the merged entity to output, false if a partial is not well formed
+        static bool Merge(const vector<rocksdb::Slice> &partials, string &output);
+    };
+}
+
+#endif //WEBOFDATA_ENTITYMERGER_H
@@ -4,12 +4,30 @@
 
 #include <simple-web-server/server_http.hpp>
 #include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace webofdata {
 
+    using namespace std;
+
     typedef SimpleWeb::Server<SimpleWeb::HTTP> HttpServer;
 
+    // JsonArray: [ context, entity, ..., continuation ]
+    // NdJson: one json object per line, the context first and the continuation last
+    enum class StreamFormat { JsonArray, NdJson };
+
     class EntityStreamWriter {
+    protected:
+        StreamFormat _format = StreamFormat::JsonArray;
+
     public:
         virtual ~EntityStreamWriter() {};
 
@@ -18,6 +36,68 @@ namespace webofdata {
         virtual void WriteJson(const char *json, int length) = 0;
 
         virtual void Flush() = 0;
+
+        // ends the stream, nothing may be written afterwards
+        virtual void Close() {
+            Flush();
+        }
+
+        // true once the consumer has gone away, scans writing to the stream should stop
+        virtual bool IsCancelled() {
+            return false;
+        }
+
+        void SetFormat(StreamFormat format) {
+            _format = format;
+        }
+
+        StreamFormat GetFormat() {
+            return _format;
+        }
+
+        // framing shared by all entity streams, the context is always the first entity written
+        void WriteContext(const string& namespacesJson) {
+            if (_format == StreamFormat::NdJson) {
+                WriteJson("{ \"@id\" : \"@context\", \"namespaces\" : ");
+                WriteJson(namespacesJson.data(), (int) namespacesJson.length());
+                WriteJson("}\n");
+            } else {
+                WriteJson("[ { \"@id\" : \"@context\", \"namespaces\" : ");
+                WriteJson(namespacesJson.data(), (int) namespacesJson.length());
+                WriteJson("}");
+            }
+        }
+
+        void WriteEntity(const char *json, int length) {
+            if (_format == StreamFormat::NdJson) {
+                WriteJson(json, length);
+                WriteJson("\n", 1);
+            } else {
+                WriteJson(",", 1);
+                WriteJson(json, length);
+            }
+        }
+
+        // count, when not negative, is the total the pages add up to
+        void WriteContinuation(const string& token, long count = -1) {
+            string entity("{ \"@id\" : \"@continuation\" , \"wod:next-data\" : \"" + token + "\"");
+            if (count >= 0) {
+                entity += " , \"wod:count\" : " + std::to_string(count);
+            }
+            entity += " }";
+
+            if (_format == StreamFormat::NdJson) {
+                WriteJson(entity + "\n");
+            } else {
+                WriteJson(", " + entity);
+            }
+        }
+
+        void WriteEnd() {
+            if (_format == StreamFormat::JsonArray) {
+                WriteJson("]");
+            }
+        }
     };
 
     class FileStreamWriter : public EntityStreamWriter {
@@ -43,56 +123,125 @@ namespace webofdata {
     };
 
 
+    // Assembles written json into chunks of up to chunkSize bytes for a chunked transfer encoded
+    // response. Values of at least directWriteSize bytes, typically entities still pinned by
+    // rocksdb, are not copied into the buffer but written straight to the response as a chunk
+    // of their own once the buffered data has gone out ahead of them.
+    //
+    // Every chunk is handed to the socket with an asynchronous send. When more than
+    // maxUnacknowledged bytes have been sent but not yet written to the socket the writing
+    // thread waits, which suspends the scan producing the stream until the client catches up.
+    // A failed send cancels the stream and everything written after it is dropped.
+    //
+    // The send callbacks run on the server's request threads, so a writer must only be written
+    // from another thread, such as the scan pool, or a slow client could hold every request thread.
     class HttpResponseStreamWriter : public EntityStreamWriter {
     private:
+        // shared with the send callbacks, which can complete after the writer is gone
+        struct SendState {
+            mutex lock;
+            condition_variable drained;
+            size_t unacknowledged = 0;
+            atomic<bool> cancelled{false};
+        };
+
         shared_ptr <HttpServer::Response> _response;
-        char* _buffer;
-        int _buffered;
-        int _bufferSize;
-        int _flushCount;
-    public:
-        ~HttpResponseStreamWriter() {} // nothing to do
+        shared_ptr <SendState> _sendState;
+        vector<char> _buffer;
+        size_t _buffered;
+        size_t _directWriteSize;
+        size_t _maxUnacknowledged;
+
+        void WriteChunk(const char *data, size_t length) {
+            // the length as a hex value followed by CRLF, the content and CRLF. formatted apart so the
+            // response stream is not left in hex
+            char header[24];
+            auto headerLength = snprintf(header, sizeof(header), "%zx\r\n", length);
+            _response->write(header, headerLength);
+            _response->write(data, length);
+            *_response << "\r\n";
+            Send(_maxUnacknowledged);
+        }
+
+        void Send(size_t waitUntilBelow) {
+            auto bytes = _response->size();
+            if (bytes > 0) {
+                auto state = _sendState;
+                {
+                    lock_guard<mutex> guard(state->lock);
+                    state->unacknowledged += bytes;
+                }
+
+                _response->send([state, bytes](const SimpleWeb::error_code &ec) {
+                    lock_guard<mutex> guard(state->lock);
+                    state->unacknowledged -= bytes;
+                    if (ec) state->cancelled = true;
+                    state->drained.notify_all();
+                });
+            }
+
+            unique_lock<mutex> guard(_sendState->lock);
+            _sendState->drained.wait(guard, [this, waitUntilBelow] {
+                return _sendState->cancelled || _sendState->unacknowledged <= waitUntilBelow;
+            });
+        }
 
-        HttpResponseStreamWriter(shared_ptr <HttpServer::Response> response) : _response(response) {
-            _buffer = new char[1024*50];
+    public:
+        static const size_t DefaultChunkSize = 64 * 1024;
+        static const size_t DefaultMaxUnacknowledged = 1024 * 1024;
+
+        explicit HttpResponseStreamWriter(shared_ptr <HttpServer::Response> response,
+                                          size_t chunkSize = DefaultChunkSize,
+                                          size_t maxUnacknowledged = DefaultMaxUnacknowledged)
+                : _response(response), _sendState(make_shared<SendState>()),
+                  _buffer(chunkSize > 0 ? chunkSize : DefaultChunkSize) {
             _buffered = 0;
-            _bufferSize = 1024*50;
-            _flushCount = 0;
+            _directWriteSize = _buffer.size() / 2;
+            _maxUnacknowledged = maxUnacknowledged;
         }
 
         void WriteJson(const string& json) {
-            // writing out chunked transfer encoded content.
-            // this means the length as a hex value (string representation) followed by CRLF,
-            // content and CRLF
-            *_response << std::hex << json.length() << "\r\n";
-            _response->write(json.data(), json.length());
-            *_response << "\r\n";
+            WriteJson(json.data(), (int) json.length());
         }
 
         void WriteJson(const char *json, int length) {
-            // add content to string
-            if (_buffered + length < _bufferSize) {
-                memcpy(_buffer, json, length);
-                _buffered += length;
-            } else {
-                _flushCount++;
-                *_response << std::hex << _buffered << "\r\n";
-                _response->write(_buffer, _buffered);
-                *_response << "\r\n";
-
-                // reset and add latest
-                _buffered = 0;
-                memcpy(_buffer, json, length);
-                _buffered += length;
+            if (length <= 0 || IsCancelled()) return;
+            auto size = (size_t) length;
+
+            if (size >= _directWriteSize) {
+                Flush();
+                WriteChunk(json, size);
+                return;
+            }
+
+            if (_buffered + size > _buffer.size()) {
+                Flush();
             }
+
+            memcpy(_buffer.data() + _buffered, json, size);
+            _buffered += size;
         }
 
         void Flush() {
-            *_response << std::hex << _buffered << "\r\n";
-            _response->write(_buffer, _buffered);
-            *_response << "\r\n";            
+            // an empty chunk would terminate the response
+            if (_buffered == 0 || IsCancelled()) return;
+
+            WriteChunk(_buffer.data(), _buffered);
+            _buffered = 0;
+        }
+
+        // sends the last chunk without waiting for it, the response is kept by its send callback
+        // until it has been written, so nothing holds the writing thread after the scan has ended
+        void Close() {
+            Flush();
+            if (IsCancelled()) return;
+            *_response << "0\r\n" << "\r\n";
+            Send(SIZE_MAX);
+        }
 
-            cout << "flush count : " << _flushCount;
+        // set when a send fails, which is how a closed or reset connection shows up
+        bool IsCancelled() {
+            return _sendState->cancelled;
         }
     };
 }
@@ -0,0 +1,116 @@
+#ifndef WEBOFDATA_GRAPHSNAPSHOT_H
+#define WEBOFDATA_GRAPHSNAPSHOT_H
+
+#include <rocksdb/db.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    class GraphException : public std::runtime_error {
+    public:
+        explicit GraphException(const string &msg) : std::runtime_error(msg) {}
+    };
+
+    // a dataset whose outrefs are in the graph and the last log sequence the graph includes
+    struct GraphSource {
+        string dataset;
+        unsigned long sequence = 0;
+        rocksdb::ColumnFamilyHandle *outRefs = nullptr; // resolved by the store, not saved with the graph
+        rocksdb::ColumnFamilyHandle *log = nullptr;
+    };
+
+    // keys [begin, end) of one source's outrefs for a build worker, an empty end runs to the last key
+    struct GraphScanRange {
+        size_t source;
+        string begin;
+        string end;
+    };
+
+    class GraphFile;
+
+    // Compressed sparse row adjacency of the outrefs of a set of datasets. Entity ids are interned to
+    // dense numbers in id order, so a number is found by binary search over the id table. Rows, targets
+    // and ids live in a memory mapped file and cost page cache rather than heap.
+    //
+    // A refresh reads the change logs since the snapshot and re-reads the outrefs of the changed entities.
+    // Their rows, and ids first seen since, are kept in an overlay above the file, and the whole graph is
+    // rewritten once the overlay passes a tenth of it. Snapshots are immutable, refresh returns a new one
+    // sharing the file so running analytics keep a consistent graph.
+    class GraphSnapshot {
+    private:
+        shared_ptr<const GraphFile> _file;
+        string _path;
+        vector<GraphSource> _sources;
+
+        // overlay, rows replaced since the file was written and ids numbered after the file's
+        unordered_map<uint32_t, shared_ptr<const vector<uint32_t>>> _rows;
+        vector<string> _extraIds;
+        unordered_map<string, uint32_t> _extraNumbers;
+        vector<const vector<uint32_t> *> _rowIndex; // by number, null where the file's row stands
+        size_t _overlayEdges = 0;
+        size_t _edgeCount = 0;
+
+        GraphSnapshot() = default;
+
+        // writes the file and opens the snapshot over it, sortedIds must be sorted and rows sorted and unique
+        static shared_ptr<GraphSnapshot> Write(const string &path, const vector<string> &sortedIds,
+                                               const vector<uint64_t> &offsets, const vector<uint32_t> &targets,
+                                               const vector<GraphSource> &sources);
+
+        // number of the id or NoNode
+        uint32_t FindNumber(const string &id) const;
+
+        // number of the id, numbering it in the overlay if it is new
+        uint32_t Intern(const string &id);
+
+        shared_ptr<GraphSnapshot> Compact() const;
+
+    public:
+        static const uint32_t NoNode = UINT32_MAX;
+
+        // scans the ranges on up to workers threads, stopping early if cancelled is set
+        static shared_ptr<GraphSnapshot> Build(rocksdb::DB *db, const vector<GraphSource> &sources,
+                                               const vector<GraphScanRange> &ranges, const string &path,
+                                               int workers, const atomic<bool> &cancelled);
+
+        // opens a graph written earlier, its sources have no column families until the store sets them
+        static shared_ptr<GraphSnapshot> Open(const string &path);
+
+        // a snapshot including every change logged since this one up to the sources' sequences, sources must
+        // carry their column families.
+        // refreshed is set to the number of entities whose rows were re-read
+        shared_ptr<GraphSnapshot> Refresh(rocksdb::DB *db, const vector<GraphSource> &sources, size_t &refreshed) const;
+
+        const vector<GraphSource> &GetSources() const { return _sources; }
+
+        size_t GetNodeCount() const;
+
+        size_t GetEdgeCount() const;
+
+        size_t GetOverlayEdgeCount() const { return _overlayEdges; }
+
+        string GetId(uint32_t number) const;
+
+        // targets of a node's outgoing edges
+        void GetRow(uint32_t number, const uint32_t *&begin, const uint32_t *&end) const;
+
+        // out and in degree distributions as json
+        string GetDegreeJson(int workers, size_t top) const;
+
+        // weakly connected components by parallel label propagation, as json
+        string GetComponentsJson(int workers, size_t top) const;
+
+        // pagerank with the given damping, dangling nodes spreading their rank evenly, as json
+        string GetPageRankJson(int workers, int iterations, double damping, size_t top) const;
+    };
+}
+
+#endif //WEBOFDATA_GRAPHSNAPSHOT_H
@@ -0,0 +1,82 @@
+#ifndef WEBOFDATA_MERGEOPERATORS_H
+#define WEBOFDATA_MERGEOPERATORS_H
+
+#include <rocksdb/merge_operator.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // bitmap with only the bit for the given dataset id set, bit n is (byte n / 8, bit n % 8)
+    inline string MakeDataSetBitmap(int datasetId) {
+        string bitmap((size_t) datasetId / 8 + 1, '\0');
+        bitmap[datasetId / 8] = (char) (1 << (datasetId % 8));
+        return bitmap;
+    }
+
+    inline bool DataSetBitmapContains(const rocksdb::Slice &bitmap, int datasetId) {
+        auto index = (size_t) datasetId / 8;
+        return index < bitmap.size() && (bitmap[index] & (1 << (datasetId % 8))) != 0;
+    }
+
+    // ORs dataset bitmaps together so marking an id present in a dataset is a blind merge
+    class PresenceMergeOperator : public rocksdb::AssociativeMergeOperator {
+    public:
+        bool Merge(const rocksdb::Slice &key, const rocksdb::Slice *existing_value, const rocksdb::Slice &value,
+                   std::string *new_value, rocksdb::Logger *logger) const override {
+            if (existing_value == nullptr) {
+                new_value->assign(value.data(), value.size());
+                return true;
+            }
+
+            new_value->assign(existing_value->data(), existing_value->size());
+            if (new_value->size() < value.size()) {
+                new_value->resize(value.size(), '\0');
+            }
+            for (size_t i = 0; i < value.size(); i++) {
+                (*new_value)[i] |= value[i];
+            }
+            return true;
+        }
+
+        const char *Name() const override {
+            return "wod.presence";
+        }
+    };
+
+    inline string MakeCounterDelta(int64_t delta) {
+        return string((const char *) &delta, sizeof(delta));
+    }
+
+    // a counter too short to hold a value, which no merge produces, reads as 0
+    inline int64_t ReadCounter(const rocksdb::Slice &value) {
+        int64_t count = 0;
+        if (value.size() == sizeof(count)) {
+            memcpy(&count, value.data(), sizeof(count));
+        }
+        return count;
+    }
+
+    // adds signed 64 bit deltas so a count can be moved without reading it first
+    class CounterMergeOperator : public rocksdb::AssociativeMergeOperator {
+    public:
+        bool Merge(const rocksdb::Slice &key, const rocksdb::Slice *existing_value, const rocksdb::Slice &value,
+                   std::string *new_value, rocksdb::Logger *logger) const override {
+            auto count = ReadCounter(value);
+            if (existing_value != nullptr) {
+                count += ReadCounter(*existing_value);
+            }
+            *new_value = MakeCounterDelta(count);
+            return true;
+        }
+
+        const char *Name() const override {
+            return "wod.counter";
+        }
+    };
+}
+
+#endif //WEBOFDATA_MERGEOPERATORS_H
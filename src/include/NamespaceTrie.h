@@ -0,0 +1,124 @@
+#ifndef WEBOFDATA_NAMESPACETRIE_H
+#define WEBOFDATA_NAMESPACETRIE_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // result of matching a uri against the namespace trie
+    struct NamespaceMatch {
+        size_t separator = string::npos; // position of the last '#', or the last '/' when there is no '#'
+        int prefixId = -1;               // namespace registered for uri[0, separator], separator included
+        int baseId = -1;                 // namespace registered for uri[0, separator), separator excluded
+    };
+
+    // Byte trie over the registered namespace prefixes. Nodes are kept in a single vector
+    // and linked first child / next sibling so lookups walk the uri once and never allocate.
+    class NamespaceTrie {
+    private:
+        struct Node {
+            char label;
+            int firstChild;
+            int nextSibling;
+            int value;
+        };
+
+        vector<Node> _nodes;
+
+        int FindChild(int node, char c) const {
+            for (int child = _nodes[node].firstChild; child != -1; child = _nodes[child].nextSibling) {
+                if (_nodes[child].label == c) return child;
+            }
+            return -1;
+        }
+
+    public:
+        NamespaceTrie() {
+            _nodes.push_back(Node{0, -1, -1, -1});
+        }
+
+        void Insert(const char *key, size_t length, int value) {
+            int node = 0;
+            for (size_t i = 0; i < length; i++) {
+                int child = FindChild(node, key[i]);
+                if (child == -1) {
+                    child = (int) _nodes.size();
+                    _nodes.push_back(Node{key[i], -1, _nodes[node].firstChild, -1});
+                    _nodes[node].firstChild = child;
+                }
+                node = child;
+            }
+            _nodes[node].value = value;
+        }
+
+        // exact lookup, returns -1 if the key is not a registered namespace
+        int Find(const char *key, size_t length) const {
+            int node = 0;
+            for (size_t i = 0; i < length && node != -1; i++) {
+                node = FindChild(node, key[i]);
+            }
+            return node == -1 ? -1 : _nodes[node].value;
+        }
+
+        // Single pass over the uri that follows the trie as far as it matches while noting the
+        // namespaces that end just before and just after each '#' and '/'. The local name of
+        // the uri starts after match.separator.
+        NamespaceMatch MatchLastSeparator(const char *uri, size_t length) const {
+            size_t lastHash = string::npos, lastSlash = string::npos;
+            int hashBase = -1, hashPrefix = -1, slashBase = -1, slashPrefix = -1;
+
+            int node = 0;
+            for (size_t i = 0; i < length; i++) {
+                char c = uri[i];
+                int base = node != -1 ? _nodes[node].value : -1;
+                if (node != -1) node = FindChild(node, c);
+
+                if (c == '#') {
+                    lastHash = i;
+                    hashBase = base;
+                    hashPrefix = node != -1 ? _nodes[node].value : -1;
+                } else if (c == '/') {
+                    lastSlash = i;
+                    slashBase = base;
+                    slashPrefix = node != -1 ? _nodes[node].value : -1;
+                }
+            }
+
+            NamespaceMatch match;
+            if (lastHash != string::npos) {
+                match.separator = lastHash;
+                match.baseId = hashBase;
+                match.prefixId = hashPrefix;
+            } else if (lastSlash != string::npos) {
+                match.separator = lastSlash;
+                match.baseId = slashBase;
+                match.prefixId = slashPrefix;
+            }
+            return match;
+        }
+    };
+
+    // writes "ns" + nsid + ":" + name into buffer, reusing its capacity
+    inline void WriteNamespacedId(string &buffer, int nsid, const char *name, size_t length) {
+        char digits[16];
+        char *end = digits + sizeof(digits);
+        char *p = end;
+        auto v = (unsigned int) nsid;
+        do {
+            *--p = (char) ('0' + v % 10);
+            v /= 10;
+        } while (v != 0);
+
+        buffer.clear();
+        buffer.append("ns", 2);
+        buffer.append(p, end - p);
+        buffer.push_back(':');
+        buffer.append(name, length);
+    }
+}
+
+#endif //WEBOFDATA_NAMESPACETRIE_H
@@ -0,0 +1,60 @@
+#ifndef WEBOFDATA_PARALLEL_H
+#define WEBOFDATA_PARALLEL_H
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // Splits [0, count) into contiguous ranges and calls body(begin, end, worker) for each on its own
+    // thread, the calling thread taking the first range. Small inputs run inline so short requests don't
+    // pay for thread start up. The first exception thrown by a body is rethrown once all have finished.
+    inline void ParallelForEach(size_t count, int maxWorkers, size_t minPerWorker,
+                                const function<void(size_t begin, size_t end, int worker)> &body) {
+        if (count == 0) {
+            return;
+        }
+
+        auto workers = (int) std::min<size_t>((size_t) std::max(maxWorkers, 1), (count + minPerWorker - 1) / std::max<size_t>(minPerWorker, 1));
+        if (workers <= 1) {
+            body(0, count, 0);
+            return;
+        }
+
+        exception_ptr failure;
+        mutex failureLock;
+        auto run = [&](size_t begin, size_t end, int worker) {
+            try {
+                body(begin, end, worker);
+            } catch (...) {
+                lock_guard<mutex> guard(failureLock);
+                if (!failure) failure = current_exception();
+            }
+        };
+
+        auto perWorker = (count + workers - 1) / workers;
+        vector<thread> threads;
+        for (int w = 1; w < workers; w++) {
+            auto begin = w * perWorker;
+            if (begin >= count) break;
+            threads.emplace_back(run, begin, std::min(count, begin + perWorker), w);
+        }
+        run(0, std::min(count, perWorker), 0);
+
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        if (failure) {
+            rethrow_exception(failure);
+        }
+    }
+}
+
+#endif //WEBOFDATA_PARALLEL_H
@@ -0,0 +1,81 @@
+#ifndef WEBOFDATA_PROPERTYINDEX_H
+#define WEBOFDATA_PROPERTYINDEX_H
+
+#include <rocksdb/slice.h>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // the kinds of value an index orders, each under its own tag so a range covers one kind
+    enum class IndexValueType : char {
+        String = 's',
+        Number = 'n',
+        Date = 'd'
+    };
+
+    // bounds of a scan over one kind of value, as encoded values. an empty bound is open
+    struct PropertyIndexRange {
+        IndexValueType type = IndexValueType::String;
+        string lower;
+        bool lowerInclusive = true;
+        string upper;
+        bool upperInclusive = true;
+    };
+
+    // Keys of a dataset's property value index, proplen : property : tag : value : id with an empty
+    // value. Values are encoded so byte order is value order and each is self delimiting, so one seek
+    // finds a value or the start of a range and the ids follow in id order:
+    //  - strings, and true and false, as their text with 0x00 escaped to 0x00 0xff, ending 0x00 0x01
+    //  - numbers as 8 byte big endian doubles with the sign bit flipped, negatives inverted
+    //  - ISO 8601 dates, also indexed as strings, as 8 byte big endian UTC milliseconds, sign bit flipped
+    // Each scalar of an array value is indexed. Objects, nested arrays and nulls are not.
+    class PropertyIndex {
+    public:
+        // bumped when the key layout changes, indexes written with another version are rebuilt
+        static const int FormatVersion = 2;
+
+        // ids read for one page of a query, so a broad range is never held in memory whole
+        static const int DefaultPageSize = 1000;
+        static const int MaxPageSize = 10000;
+
+        // prefix of every key of the property, and the key after the last of them
+        static string MakePropertyPrefix(const string &property);
+        static string MakePropertyEnd(const string &property);
+
+        // false if the text is not a value of the type
+        static bool EncodeValue(IndexValueType type, const string &text, string &encoded);
+
+        // encodes a json scalar as the type, strings by their text. false for nulls, objects, arrays and
+        // scalars that are not a value of the type
+        static bool EncodeJsonValue(const char *json, size_t length, IndexValueType type, string &encoded);
+
+        static string MakeKey(const string &property, IndexValueType type, const string &encoded, const string &id);
+
+        // the id of a key that follows the property prefix, false if the key is malformed
+        static bool GetId(const rocksdb::Slice &key, size_t prefixLength, string &id);
+
+        // milliseconds since the epoch of an ISO 8601 date or date time, a time without a zone is UTC
+        static bool ParseDate(const char *text, size_t length, int64_t &milliseconds);
+
+        // url safe tokens for the key a page ended at, without the property prefix
+        static string EncodeCursor(const rocksdb::Slice &key, size_t prefixLength);
+        static bool DecodeCursor(const string &token, string &cursor);
+
+        // appends the keys for the entity's values of the properties, sorted and without duplicates.
+        // false if the json is not a well formed object
+        static bool GetKeys(const char *json, size_t length, const vector<string> &properties, const string &id,
+                            vector<string> &keys);
+
+        // as GetKeys for an entity in either form, a binary one has only the values of the properties decoded
+        // with the store's property names and numbers
+        static bool GetKeys(const rocksdb::Slice &entity, const vector<string> &properties, const vector<string> &names,
+                            const unordered_map<string, int> &numbers, const string &id, vector<string> &keys);
+    };
+}
+
+#endif //WEBOFDATA_PROPERTYINDEX_H
@@ -0,0 +1,119 @@
+#ifndef WEBOFDATA_RELATEDENTITIESQUERY_H
+#define WEBOFDATA_RELATEDENTITIESQUERY_H
+
+#include "base64.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace webofdata {
+
+    using namespace std;
+
+    // A related entities query and where its next page starts. The whole query is carried in the
+    // wod:next-data token so a page can be requested with nothing but the token, and the cursor
+    // lets the page resume with a Seek to the last ref key rather than skipping from the start.
+    struct RelatedEntitiesQuery {
+        static const int DefaultPageSize = 50;
+        static const int MaxPageSize = 1000;
+
+        string subject;
+        string property;
+        bool inverse = false;
+        vector<string> datasets;
+        int pageSize = DefaultPageSize;
+
+        // cursorDataSet of a page read from the store wide inrefs index, a name no dataset is given
+        static constexpr const char *StoreIndexCursor = "*";
+
+        string cursorDataSet; // dataset the last page ended in, empty to start from the first
+        string lastRefKey;    // last ref key read from that dataset
+
+        // opaque url safe token
+        string Encode() const {
+            string bytes(1, (char) TokenVersion);
+            bytes.push_back(inverse ? 1 : 0);
+            AppendInt(bytes, (uint32_t) pageSize);
+            AppendString(bytes, subject);
+            AppendString(bytes, property);
+            AppendInt(bytes, (uint32_t) datasets.size());
+            for (auto const &ds : datasets) {
+                AppendString(bytes, ds);
+            }
+            AppendString(bytes, cursorDataSet);
+            AppendString(bytes, lastRefKey);
+
+            auto token = base64_encode((const unsigned char *) bytes.data(), (unsigned int) bytes.size());
+            while (!token.empty() && token.back() == '=') token.pop_back();
+            for (auto &c : token) {
+                if (c == '+') c = '-';
+                if (c == '/') c = '_';
+            }
+            return token;
+        }
+
+        // false if the token was not produced by Encode
+        static bool Decode(string token, RelatedEntitiesQuery &query) {
+            for (auto &c : token) {
+                if (c == '-') c = '+';
+                if (c == '_') c = '/';
+            }
+            auto bytes = base64_decode(token);
+            size_t offset = 0;
+
+            if (bytes.size() < 2 || bytes[0] != (char) TokenVersion) return false;
+            query.inverse = bytes[1] != 0;
+            offset = 2;
+
+            uint32_t pageSize, datasetCount;
+            if (!ReadInt(bytes, offset, pageSize)) return false;
+            if (!ReadString(bytes, offset, query.subject)) return false;
+            if (!ReadString(bytes, offset, query.property)) return false;
+            if (!ReadInt(bytes, offset, datasetCount) || datasetCount > bytes.size()) return false;
+            query.datasets.resize(datasetCount);
+            for (auto &ds : query.datasets) {
+                if (!ReadString(bytes, offset, ds)) return false;
+            }
+            if (!ReadString(bytes, offset, query.cursorDataSet)) return false;
+            if (!ReadString(bytes, offset, query.lastRefKey)) return false;
+
+            if (pageSize == 0 || pageSize > (uint32_t) MaxPageSize || offset != bytes.size()) return false;
+            query.pageSize = (int) pageSize;
+            return true;
+        }
+
+    private:
+        static const int TokenVersion = 1;
+
+        static void AppendInt(string &bytes, uint32_t value) {
+            for (int i = 0; i < 4; i++) {
+                bytes.push_back((char) ((value >> (8 * i)) & 0xff));
+            }
+        }
+
+        static void AppendString(string &bytes, const string &value) {
+            AppendInt(bytes, (uint32_t) value.size());
+            bytes.append(value);
+        }
+
+        static bool ReadInt(const string &bytes, size_t &offset, uint32_t &value) {
+            if (bytes.size() - offset < 4) return false;
+            value = 0;
+            for (int i = 0; i < 4; i++) {
+                value |= (uint32_t) (unsigned char) bytes[offset + i] << (8 * i);
+            }
+            offset += 4;
+            return true;
+        }
+
+        static bool ReadString(const string &bytes, size_t &offset, string &value) {
+            uint32_t length;
+            if (!ReadInt(bytes, offset, length) || bytes.size() - offset < length) return false;
+            value.assign(bytes, offset, length);
+            offset += length;
+            return true;
+        }
+    };
+}
+
+#endif //WEBOFDATA_RELATEDENTITIESQUERY_H
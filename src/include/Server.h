@@ -7,6 +7,10 @@
 #include "spdlog/spdlog.h"
 #include "spdlog/fmt/bundled/ostream.h"
 #include "Store.h"
+#include "Compression.h"
+#include <bosma/ctpl_stl.h>
+#include <atomic>
+#include <functional>
 
 namespace webofdata {
 
@@ -22,6 +26,8 @@ namespace webofdata {
         }
     };
 
+    typedef function<void(shared_ptr<HttpServer::Response>, shared_ptr<HttpServer::Request>)> RouteHandler;
+
     class WodServer {
     private:
         HttpServer _server;
@@ -29,6 +35,26 @@ namespace webofdata {
         shared_ptr<spdlog::logger> _logger;
         string _serviceId;
         string _subjectIdentifier;
+        map<string, CompressionLevels> _compressionLevels; // by route: entities, changes, query
+        size_t _responseChunkSize = HttpResponseStreamWriter::DefaultChunkSize;
+        size_t _maxUnacknowledgedBytes = HttpResponseStreamWriter::DefaultMaxUnacknowledged;
+
+        // long running scans run here rather than on the server's request threads
+        unique_ptr<ctpl::thread_pool> _scanPool;
+        atomic<int> _scansPending;
+        int _maxPendingScans;
+
+        int _maxStoreIngests;
+        int _maxDatasetIngests;
+
+        // wraps a route handler so it runs on the scan pool, rejecting with 503 when too many are queued
+        RouteHandler OnScanPool(RouteHandler handler);
+
+        // runs a route, answering 400 or 500 for an exception that escapes it, or cutting the connection
+        // when the response had already started
+        void RunRoute(const RouteHandler &handler,
+                      shared_ptr<HttpServer::Response> response,
+                      shared_ptr<HttpServer::Request> request);
 
     public:
 
@@ -39,6 +65,11 @@ namespace webofdata {
             _server.config.port = port;
             _server.config.thread_pool_size = 50;
             _storeManager = make_shared<StoreManager>(baseLocation);
+            _scanPool.reset(new ctpl::thread_pool(8));
+            _scansPending = 0;
+            _maxPendingScans = 64;
+            _maxStoreIngests = 8;
+            _maxDatasetIngests = 2;
         }
 
         WodServer(unsigned short port, shared_ptr<StoreManager> storeManager, string serviceId,
@@ -49,12 +80,48 @@ namespace webofdata {
             _serviceId = serviceId;
             _subjectIdentifier = subjectIdentifier;
             _storeManager = std::move(storeManager);
+            _scanPool.reset(new ctpl::thread_pool(8));
+            _scansPending = 0;
+            _maxPendingScans = 64;
+            _maxStoreIngests = 8;
+            _maxDatasetIngests = 2;
         }
 
         string MakeGuid();
 
         string GetRequestId(shared_ptr<HttpServer::Request> request);
 
+        void SetCompressionLevels(const string &route, CompressionLevels levels);
+
+        void SetResponseChunkSize(size_t chunkSize);
+
+        // bytes a stream may have in flight to a client before its scan waits for the socket
+        void SetMaxUnacknowledgedBytes(size_t maxUnacknowledgedBytes);
+
+        // threads serving requests directly, point reads and writes
+        void SetRequestThreads(int threads);
+
+        // threads running streaming scans and the number of scans that may be running or queued
+        void SetScanThreads(int threads, int maxPending);
+
+        shared_ptr<StoreManager> GetStoreManager() {
+            return _storeManager;
+        }
+
+        // concurrent POST /entities requests allowed per store and per dataset
+        void SetIngestLimits(int maxPerStore, int maxPerDataset);
+
+        // seconds an ingest client should wait before retrying, 0 if the store can take writes now
+        int GetIngestRetryAfter(const shared_ptr<Store> &store);
+
+        // the response writer for a streaming route, compressed when the client accepts gzip or zstd. a short
+        // response written on a request thread goes without backpressure, so it never waits on a send
+        unique_ptr<EntityStreamWriter> CreateResponseWriter(const string &route,
+                                                            shared_ptr<HttpServer::Response> response,
+                                                            shared_ptr<HttpServer::Request> request,
+                                                            SimpleWeb::CaseInsensitiveMultimap &headers,
+                                                            bool backpressure = true);
+
         void ConfigureRoutes();
 
         void Start();
@@ -15,8 +15,10 @@ struct ParseException : std::runtime_error, rapidjson::ParseResult {
 
 #include <rocksdb/db.h>
 #include <rocksdb/options.h>
+#include <rocksdb/version.h>
 #include <rocksdb/filter_policy.h>
 #include <rocksdb/table.h>
+#include <rocksdb/statistics.h>
 #include <string>
 #include <iostream>
 #include <sstream>
@@ -30,7 +32,22 @@ struct ParseException : std::runtime_error, rapidjson::ParseResult {
 #include "PipeLogic.h"
 #include "ChangeHandler.h"
 #include "IStoreUpdate.h"
+#include "NamespaceTrie.h"
+#include "EntityCache.h"
+#include "MergeOperators.h"
+#include "EntityMerger.h"
+#include "RelatedEntitiesQuery.h"
+#include "GraphSnapshot.h"
+#include "PropertyIndex.h"
+#include "EntityFilter.h"
+#include "Aggregation.h"
+#include <map>
+#include <shared_mutex>
+#include <unordered_set>
+#include <thread>
 #include <mutex>
+#include <atomic>
+#include <functional>
 #include <EntityStreamWriter.h>
 #include "spdlog/spdlog.h"
 
@@ -105,6 +122,20 @@ namespace webofdata {
         StoreException(string msg) : _msg(msg) {};
     };
 
+    // one hop of a traversal, property is a stored property id or empty to follow any property
+    struct TraversalStep {
+        bool inverse = false;
+        string property;
+    };
+
+    // rocksdb's view of how far compaction is behind, used to refuse ingest before writes stall
+    struct WritePressure {
+        bool writesStopped = false;
+        uint64_t delayedWriteRate = 0;          // non zero while rocksdb is slowing writes down
+        uint64_t pendingCompactionBytes = 0;
+        uint64_t softPendingCompactionLimit = 0; // writes are delayed once pending bytes reach this
+    };
+
     class Store : public std::enable_shared_from_this<Store>, public IStoreUpdate {
 
     private:
@@ -123,9 +154,13 @@ namespace webofdata {
 
         unordered_map<string, int> _namespaceToIdIndex;
         unordered_map<int, string> _idToNamespaceIndex;
+        shared_ptr<const NamespaceTrie> _namespaceTrie; // copy on write, swapped atomically when a namespace is added
 
+        // interned entity member names, numbered from 1, as used by the binary entity encoding.
+        // _propertyNamesLock guards both, lookups hold it shared
         unordered_map<string, int> _propertyToIdIndex;
-        unordered_map<int, string> _idToPropertyIndex;
+        vector<string> _propertyNames;
+        std::shared_timed_mutex _propertyNamesLock;
 
         rocksdb::DB *_database;
 
@@ -141,9 +176,192 @@ namespace webofdata {
         ColumnFamilyHandle* _globalStateColumnFamily;
         ColumnFamilyHandle* _namespacesColumnFamily;
         ColumnFamilyHandle* _pipeState;
+        ColumnFamilyHandle* _presenceColumnFamily; // id -> bitmap of the ids of the datasets holding it
+        ColumnFamilyHandle* _propertyColumnFamily; // name -> number and number -> name of interned properties
+
+        std::atomic<int> _activeIngests;
+
+        // the presence index is only used once it has been backfilled for data written before it existed
+        std::atomic<bool> _presenceIndexReady;
+        std::atomic<bool> _closing;
+        std::thread _presenceBackfill;
+
+        void BackfillPresenceIndex();
+
+        // the entries a deleted dataset leaves in the store wide column families are removed in the
+        // background, a purge_<dataset id> global key marks one not yet finished
+        std::mutex _purgeMutex;
+        vector<std::thread> _purges;
+        std::atomic<int> _pendingPurges {0};
+
+        void StartDataSetPurge(int datasetId);
+
+        void PurgeDataSet(int datasetId);
+
+        // scans a column family in chunks with commits held off, purge adds what to do about each entry
+        // to the batch. false if the store is closing
+        bool PurgeEntries(ColumnFamilyHandle *columnFamily,
+                          const function<void(const Slice &key, const Slice &value, rocksdb::WriteBatch &batch)> &purge);
+
+        ColumnFamilyHandle* _storeInRefsColumnFamily; // inrefs key : dataset id -> id, across all datasets
+
+        // commits hold the lock shared, so a backfill holding it exclusively sees data no batch is changing
+        std::shared_timed_mutex _commitLock;
+
+        // the store wide inrefs index is written while enabled and read once backfilled
+        std::atomic<bool> _storeInRefsIndexEnabled;
+        std::atomic<bool> _storeInRefsIndexReady;
+        std::thread _storeInRefsBackfill;
+
+        void BackfillStoreInRefsIndex();
+
+        // true if inbound refs of these datasets are better read from the store wide index
+        bool UseStoreInRefsIndex(const vector<shared_ptr<DataSet>> &datasets);
+
+        ColumnFamilyHandle* _degreeColumnFamily; // direction : id : property : dataset id -> number of refs
+
+        // counters are moved by every write, refs from before they existed are added by the backfill
+        std::atomic<bool> _degreeCountersReady;
+        std::thread _degreeBackfill;
+
+        void BackfillDegreeCounters();
+
+        // corrects one direction's counters of a dataset to its refs as of a snapshot, false if closing
+        bool ReconcileDegreeCounters(const shared_ptr<DataSet> &dataset, bool inverse);
+
+        // property index builds, at most one running per dataset. _indexBuildMutex also serialises
+        // changes to a dataset's indexed properties
+        std::mutex _indexBuildMutex;
+        unordered_set<string> _indexBuildsRunning;
+        vector<std::thread> _indexBuilds;
+
+        // applies the wod:indexes of a dataset metadata entity
+        void UpdatePropertyIndexes(const shared_ptr<DataSet> &dataset, const vector<string> &properties);
+
+        void SavePropertyIndexes(const shared_ptr<DataSet> &dataset, const map<string, bool> &properties);
+
+        // rebuild marks every index as not ready, for indexes written with an older key layout
+        void LoadPropertyIndexes(const shared_ptr<DataSet> &dataset, bool rebuild);
+
+        // starts a build unless one is running for the dataset, _indexBuildMutex must be held
+        void StartPropertyIndexBuild(const shared_ptr<DataSet> &dataset);
+
+        // builds the dataset's properties that are not ready until none are left
+        void BuildPropertyIndexes(string dataset);
+
+        // fills the index for the properties from a snapshot on several threads, then brings the entities
+        // written meanwhile up to date with commits held off. false if the store is closing
+        bool BuildPropertyIndex(const shared_ptr<DataSet> &dataset, const vector<string> &properties);
+
+        // encoding conversions, at most one running per dataset
+        std::mutex _encodingMutex;
+        unordered_set<string> _encodingConversionsRunning;
+        vector<std::thread> _encodingConversions;
+
+        void LoadPropertyNames();
+
+        // the number of an entity member name, interned on first use
+        uint32_t InternPropertyName(const char *name, size_t length);
+
+        // the json of a stored entity, transcoded into buffer if it is in the binary form
+        Slice DecodeEntity(const Slice &stored, string &buffer);
+
+        // held while a binary entity is read by property number, not taken for a json one
+        std::shared_lock<std::shared_timed_mutex> LockPropertyNames(const Slice &stored);
+
+        // the entity as json if it meets the filter or there is none. a binary entity has only the values the
+        // filter tests decoded and is converted once it passes. output is valid until the next call
+        bool FilterEntity(const Slice &stored, EntityFilter *filter, string &buffer, Slice &output);
+
+        // applies the wod:encoding of a dataset metadata entity
+        void UpdateEncoding(const shared_ptr<DataSet> &dataset, bool binary);
+
+        void SaveEncoding(const shared_ptr<DataSet> &dataset, bool binary, bool converted);
+
+        void LoadEncoding(const shared_ptr<DataSet> &dataset);
+
+        // starts a conversion unless one is running for the dataset, _encodingMutex must be held
+        void StartEncodingConversion(const shared_ptr<DataSet> &dataset);
+
+        // rewrites the dataset's entities into its encoding until it stops changing
+        void ConvertEncoding(string dataset);
+
+        // rewrites the entities not yet in the given form in chunks, each with commits held off.
+        // false if the store is closing or the encoding changed meanwhile
+        bool ConvertEntities(const shared_ptr<DataSet> &dataset, bool binary);
+
+        // aggregation jobs by number, finished ones dropped oldest first past MaxFinishedAggregations
+        static const size_t MaxFinishedAggregations = 16;
+        std::mutex _aggregationsMutex;
+        map<long, shared_ptr<AggregationJob>> _aggregations;
+        long _nextAggregationId;
+
+        // scans the dataset's ranges on several threads from a snapshot and combines their counts
+        void RunAggregation(shared_ptr<AggregationJob> job);
+
+        // graph snapshot for analytics, null until one is built or loaded, swapped atomically
+        shared_ptr<GraphSnapshot> _graph;
+        std::thread _graphBuild;
+        std::atomic<bool> _graphBuilding;
+        std::mutex _graphMutex; // serialises refreshes, and guards _graphError
+        string _graphError;
+
+        string GetGraphPath();
+
+        // the named datasets as graph sources with their column families, sequences as now
+        vector<GraphSource> GetGraphSources(const vector<string> &datasets);
+
+        // up to parts - 1 keys splitting the column family into ranges of similar size, from its sst file boundaries
+        vector<string> GetSplitKeys(ColumnFamilyHandle *columnFamily, size_t parts);
+
+        void StopBackgroundWork();
+
+        shared_ptr<EntityCache> _entityCache; // merged entities, null when caching is disabled
+
+        // the named datasets, or all of them when none are named
+        vector<shared_ptr<DataSet>> ResolveDataSets(const vector<string> &datasets);
+
+        // the datasets to read each id from, uses the presence index when no datasets are named
+        vector<vector<shared_ptr<DataSet>>> ResolveDataSets(const vector<string> &ids, const vector<string> &datasets);
+
+        // reads and merges the entities with one MultiGet across all the ids and their datasets
+        vector<shared_ptr<string>> ReadEntities(const vector<string> &ids, const vector<vector<shared_ptr<DataSet>>> &sources);
+
+        // neighbours of id are fetched in blocks of this many distinct ids
+        static const size_t RelatedEntityBlockSize = 64;
+
+        // true for each ref key that is also in the refs of one of the datasets before datasetIndex
+        vector<bool> HeldInEarlierDataSets(const vector<pair<string, string>> &refs, const vector<shared_ptr<DataSet>> &datasets,
+                                           size_t datasetIndex, bool inverse);
+
+        // hands the merged neighbours of id to handler a block at a time until it returns false, starting after
+        // the query's cursor and leaving it on the last ref read. returns how many were visited
+        int VisitRelatedEntities(const string &id, RelatedEntitiesQuery &query, int count,
+                                 const function<bool(const vector<shared_ptr<string>> &)> &handler);
+
+        // threads used to expand one traversal level, and the fewest frontier ids worth a thread
+        static const int TraversalWorkers = 4;
+        static const size_t TraversalIdsPerWorker = 32;
+
+        static ReadOptions GetMultiGetReadOptions();
+
+        // zstd dictionaries for the store and log column families of datasets. rocksdb trains one from a sample
+        // of each sst file it writes, so every flush and compaction retrains on the dataset's current data
+        static const int EntityDictionaryBytes = 16 * 1024;
+        static const int EntityDictionaryTrainingBytes = 100 * EntityDictionaryBytes;
+
+        // files not compacted for this long are rewritten, so quiet datasets get dictionaries of recent data too
+        static const uint64_t EntityDictionaryRetrainSeconds = 7 * 24 * 60 * 60;
+
+        shared_ptr<rocksdb::Statistics> _statistics; // block decompression timings for the stats
+
+        // compressed and raw sizes of a column family's sst files, from their table properties
+        void WriteCompressionStats(Writer<StringBuffer> &writer, ColumnFamilyHandle *columnFamily);
 
     public:
 
+        static const size_t DefaultEntityCacheBytes = 64 * 1024 * 1024;
+
         Store(string name, string location);
         ~Store();
 
@@ -152,6 +370,7 @@ namespace webofdata {
 
         string GetName() { return _name; }
         void OpenRocksDb(string location);
+        ColumnFamilyOptions GetColumnFamilyOptions(const string &name);
         ColumnFamilyHandle *AssertColumnFamily(string name);
         rocksdb::DB *GetDatabase();
         void StoreMetadataEntity(std::string data);
@@ -160,26 +379,26 @@ namespace webofdata {
         string GetDatasetMetadataEntity(string dataset);
         void StoreEntity(string dataset, shared_ptr<std::string> data);
         long StoreEntities(std::istream &data, string dataset);
+        long StoreEntitiesNdJson(std::istream &data, string dataset);
         void DeleteDataSet(string dataset);
         void ClearDataSet(string dataset);
         shared_ptr<vector<string>> GetChanges(string dataset, ulong sequence, int count);
 
-        void WriteChangesToStream(string dataset, long sequence, int count, int shard, EntityStreamWriter &stream);
+        // a filter skips the changed entities it doesn't match and projects those it does, count is of those written
+        void WriteChangesToStream(string dataset, long sequence, int count, int shard, EntityStreamWriter &stream,
+                                  EntityFilter *filter = nullptr);
 
         ulong WriteChangesToHandler(string dataset, ulong from, int count, int shard, shared_ptr<ChangeHandler> handler) override;
 
         shared_ptr<string> GetEntities(string dataset, string lastId, int count, int shard, shared_ptr<vector<shared_ptr<string>>> result);
 
-        void WriteEntitiesToStream(string dataset, string lastId, int count, int shard, EntityStreamWriter &stream);
+        void WriteEntitiesToStream(string dataset, string lastId, int count, int shard, EntityStreamWriter &stream,
+                                   EntityFilter *filter = nullptr);
 
         shared_ptr<vector<string>> GetDataSetShardTokens(string dataset, int shardCount);
 
         shared_ptr<vector<string>> GetChangesShardTokens(string dataset, int shardCount);
 
-        static bool StrPtrComp (shared_ptr<string> lhs, shared_ptr<string> rhs) {
-            return lhs->compare(*rhs);
-        }
-
         // Methods for getting and writing entities and merged entities
         void WriteEntityToStream(string si, const vector<string> &datasets, EntityStreamWriter &stream);
 
@@ -187,18 +406,81 @@ namespace webofdata {
 
         shared_ptr<string> GetEntity(string si, const vector<string> &datasets);
 
-        void WriteRelatedEntitiesToStream(string si, string property, bool inverse, long skip, int count, const vector<string> &datasets, EntityStreamWriter &stream);
+        // merged entities for resource ids, in the order given
+        vector<shared_ptr<string>> GetEntities(const vector<string> &ids, const vector<string> &datasets);
+
+        // false when the query's cursor is in a dataset that is gone or not asked for, or in a refs index no longer used
+        bool CanResumeRelatedEntities(const RelatedEntitiesQuery &query);
+
+        // one page of the query, ending with a continuation token when the page is full
+        void WriteRelatedEntitiesToStream(RelatedEntitiesQuery query, EntityStreamWriter &stream);
 
         shared_ptr<vector<shared_ptr<string>>> GetRelatedEntities(string si, string property, bool inverse, int count, const vector<string> &datasets);
 
+        static const size_t MaxTraversalSteps = 8;
+
+        // the stored id of a property uri, a stored id is returned as is and a bare name is resolved against
+        // the base namespace. a property that cannot be resolved is returned unchanged and matches no refs
+        string GetPropertyId(const string &property, const string &base);
+
+        // a filter expression with its property and any <uri> value resolved to the ids they are stored as
+        bool ParseFilterCondition(const string &expression, PropertyCondition &condition);
+
+        // parses a path such as out:employer/in:member, throws StoreException if it is malformed
+        vector<TraversalStep> ParseTraversalPath(const string &path, const string &base);
+
+        // ids reached from the subject by following the steps. each level is expanded in parallel,
+        // deduplicated and capped at maxFrontier ids, truncated is set if any level was capped
+        vector<string> Traverse(const string &si, const vector<TraversalStep> &steps, const vector<string> &datasets,
+                                size_t maxFrontier, bool &truncated);
+
+        // ids on a shortest directed path from one subject to another, both ends included, empty if there is none
+        // within maxDepth hops. a bidirectional bfs over outrefs from the start and inrefs from the end, truncated
+        // is set if it gave up because more than maxVisited ids had been seen
+        vector<string> FindShortestPath(const string &fromSi, const string &toSi, const vector<string> &datasets,
+                                        int maxDepth, size_t maxVisited, bool &truncated);
+
+        // the number of refs from the entity, or to it with inverse, by property and summed over the datasets
+        // so a ref held by two datasets counts twice. an empty property counts them for every property
+        map<string, long> CountRelatedEntities(const string &id, const string &property, bool inverse, const vector<string> &datasets);
+
+        // the counts for a subject uri as json, the total and each property's
+        string GetRelatedCountsJson(const string &si, const string &property, bool inverse, const vector<string> &datasets);
+
+        // the stored id of a property uri, adding its namespace if it is new, a stored id is returned as is
+        string AssertPropertyId(const string &property);
+
+        // ids of the dataset's entities with a value in the range for an indexed property, in value then id
+        // order from after a continuation token. nextCursor is the token of the next page when count ids were
+        // found. throws StoreException if the property is not indexed or its index is still being built
+        vector<string> QueryPropertyIndex(string dataset, const string &property, const PropertyIndexRange &range,
+                                          const string &cursor, int count, string &nextCursor);
+
+        // a page of the dataset's entities with a value in the range, ending with a continuation token when it is full
+        void WritePropertyIndexQueryToStream(string dataset, const string &property, const PropertyIndexRange &range,
+                                             const string &cursor, int count, EntityStreamWriter &stream);
+
+        // writes the merged entities for the ids, fetched a block at a time
+        void WriteEntitiesByIdToStream(const vector<string> &ids, const vector<string> &datasets, EntityStreamWriter &stream);
+
+        // maintains a store wide inrefs index, so inbound refs across datasets are one prefix scan. existing
+        // refs are backfilled in the background. the setting is kept with the store, change it before writes start
+        void EnableStoreInRefsIndex();
+        void DisableStoreInRefsIndex();
+
         // internal use
         void WriteBatch(string& dataset, long lastOffset, shared_ptr<rocksdb::WriteBatch> writeBatch);
 
+        // a batch given up on without being written, releases the log sequences it was given
+        void DiscardBatch(const shared_ptr<DataSet> &dataset, rocksdb::WriteBatch &writeBatch);
+
         void WriteEntity(shared_ptr<rocksdb::WriteBatch> writeBatch, const shared_ptr<DataSet> &dataset, string &json,
                          string id, vector<pair<string, string>> &outrefs);
 
         int AssertNamespace(string ns);
 
+        shared_ptr<const NamespaceTrie> GetNamespaceTrie() { return std::atomic_load(&_namespaceTrie); }
+
         int AssertProperty(string ns_name);
 
         shared_ptr<DataSet> AssertDataSet(string name);
@@ -215,6 +497,51 @@ namespace webofdata {
 
         void Compact();
 
+        WritePressure GetWritePressure();
+
+        // replaces the merged entity cache, 0 disables it
+        void SetEntityCacheBytes(size_t capacityBytes);
+
+        // counters for the stats route as a json object
+        string GetStatsJson();
+
+        // threads used by graph builds and analytics
+        static int GetGraphWorkers();
+
+        // starts building a graph snapshot of the datasets in the background, all when none are named. false if one is building
+        bool StartGraphBuild(const vector<string> &datasets);
+
+        // brings the graph up to date with the change logs, setting how many entities changed. false while a build
+        // is running, throws if there is no graph
+        bool RefreshGraph(size_t &refreshed);
+
+        shared_ptr<GraphSnapshot> GetGraph() { return std::atomic_load(&_graph); }
+
+        string GetGraphStatusJson();
+
+        // starts aggregating the dataset's entities that pass the filter in the background, returns the job id.
+        // throws StoreException if there is no such dataset
+        string StartAggregation(const string &dataset, const AggregationSpec &spec, const EntityFilter &filter);
+
+        // the job or null if there is none by the id
+        shared_ptr<AggregationJob> GetAggregation(const string &id);
+
+        // asks a running job to stop, false if there is none by the id
+        bool CancelAggregation(const string &id);
+
+        // claims one of maxIngests concurrent ingest slots, false if they are all taken
+        bool TryBeginIngest(int maxIngests) {
+            if (++_activeIngests > maxIngests) {
+                _activeIngests--;
+                return false;
+            }
+            return true;
+        }
+
+        void EndIngest() {
+            _activeIngests--;
+        }
+
         shared_ptr<string> GetNamespacesJson();
 
         // void CreatePipe(string id, string dataset, shared_ptr<Pipe> pipe);
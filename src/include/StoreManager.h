@@ -14,6 +14,8 @@ namespace webofdata {
         string _baseLocation;
         vector<shared_ptr<Store>> _stores;
         shared_ptr<spdlog::logger> _logger;
+        size_t _entityCacheBytes;
+        bool _storeInRefsIndex;
     public:
         StoreManager(string baseLocation);
         void LoadStores();
@@ -22,6 +24,10 @@ namespace webofdata {
         void DeleteStore(string name);
         void Close();
         vector<shared_ptr<Store>> GetStores();
+        // merged entity cache size for each open store and any created later
+        void SetEntityCacheBytes(size_t capacityBytes);
+        // store wide inrefs index for each open store and any created later, before the server starts
+        void SetStoreInRefsIndex(bool enabled);
     };
 }
 
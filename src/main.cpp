@@ -8,6 +8,17 @@ namespace spd = spdlog;
 using namespace std;
 using namespace webofdata;
 
+// "gzipLevel:zstdLevel", a level of 0 disables that coding for the route
+CompressionLevels parseCompressionLevels(const string& value) {
+    CompressionLevels levels;
+    auto separator = value.find(':');
+    levels.gzip = (int) strtol(value.substr(0, separator).data(), nullptr, 10);
+    if (separator != string::npos) {
+        levels.zstd = (int) strtol(value.data() + separator + 1, nullptr, 10);
+    }
+    return levels;
+}
+
 void printHelp() {
     cout << "Usage: wodserver" << endl << "\t options: " << endl;
     cout << "\t\t" << "--storeslocation \"/tmp/stores\"" << endl;
@@ -18,6 +29,18 @@ void printHelp() {
     cout << "\t\t" << "--loglevel \"INFO\"" << endl;
     cout << "\t\t" << "--name \"node1\"" << endl;
     cout << "\t\t" << "--subjectidentifier \"http://unknown.webofdata.io/node1\"" << endl;
+    cout << "\t\t" << "--entitiescompression \"6:3\"" << endl;
+    cout << "\t\t" << "--changescompression \"6:3\"" << endl;
+    cout << "\t\t" << "--querycompression \"6:3\"" << endl;
+    cout << "\t\t" << "--responsechunksize 65536" << endl;
+    cout << "\t\t" << "--maxunacknowledgedbytes 1048576" << endl;
+    cout << "\t\t" << "--requestthreads 50" << endl;
+    cout << "\t\t" << "--scanthreads 8" << endl;
+    cout << "\t\t" << "--maxpendingscans 64" << endl;
+    cout << "\t\t" << "--maxstoreingests 8" << endl;
+    cout << "\t\t" << "--maxdatasetingests 2" << endl;
+    cout << "\t\t" << "--entitycachebytes 67108864" << endl;
+    cout << "\t\t" << "--storeinrefsindex false" << endl;
     cout << "\t\t" << "--help" << endl << endl;
     cout.flush();
 }
@@ -33,6 +56,13 @@ int main(int argc, char *argv[]) {
     // --help
     // --name []
     // --subjectidentifier []
+    // --entitiescompression | --changescompression | --querycompression gzipLevel:zstdLevel
+    // --responsechunksize []
+    // --maxunacknowledgedbytes []
+    // --requestthreads [] --scanthreads [] --maxpendingscans []
+    // --maxstoreingests [] --maxdatasetingests []
+    // --entitycachebytes [] per store, 0 disables the merged entity cache
+    // --storeinrefsindex true | false, left as each store has it when not given
 
     string storesLocation("/tmp/stores");
     string subjectIdentifier("http://undefined.webofdata.io/node1");
@@ -42,6 +72,16 @@ int main(int argc, char *argv[]) {
     bool logToStdOut = true;
     string loglevel = "INFO";
     string nodename = "node1";
+    map<string, CompressionLevels> compressionLevels;
+    size_t responseChunkSize = HttpResponseStreamWriter::DefaultChunkSize;
+    size_t maxUnacknowledgedBytes = HttpResponseStreamWriter::DefaultMaxUnacknowledged;
+    int requestThreads = 50;
+    int scanThreads = 8;
+    int maxPendingScans = 64;
+    int maxStoreIngests = 8;
+    int maxDatasetIngests = 2;
+    size_t entityCacheBytes = Store::DefaultEntityCacheBytes;
+    string storeInRefsIndex;
 
     for (int i = 1; i < argc; i += 2) {
         string argName(argv[i]);
@@ -84,6 +124,62 @@ int main(int argc, char *argv[]) {
         if (argName == "loglevel") {
             loglevel = argValue;
         }
+
+        if (argName == "entitiescompression") {
+            compressionLevels["entities"] = parseCompressionLevels(argValue);
+        }
+
+        if (argName == "changescompression") {
+            compressionLevels["changes"] = parseCompressionLevels(argValue);
+        }
+
+        if (argName == "querycompression") {
+            compressionLevels["query"] = parseCompressionLevels(argValue);
+        }
+
+        if (argName == "responsechunksize") {
+            responseChunkSize = (size_t) strtoul(argValue.data(), nullptr, 0);
+        }
+
+        if (argName == "maxunacknowledgedbytes") {
+            maxUnacknowledgedBytes = (size_t) strtoul(argValue.data(), nullptr, 0);
+        }
+
+        if (argName == "requestthreads") {
+            requestThreads = (int) strtol(argValue.data(), nullptr, 0);
+        }
+
+        if (argName == "scanthreads") {
+            scanThreads = (int) strtol(argValue.data(), nullptr, 0);
+            if (scanThreads <= 0) {
+                cout << "scanthreads must be greater than 0" << endl;
+                exit(1);
+            }
+        }
+
+        if (argName == "maxpendingscans") {
+            maxPendingScans = (int) strtol(argValue.data(), nullptr, 0);
+            if (maxPendingScans <= 0) {
+                cout << "maxpendingscans must be greater than 0" << endl;
+                exit(1);
+            }
+        }
+
+        if (argName == "maxstoreingests") {
+            maxStoreIngests = (int) strtol(argValue.data(), nullptr, 0);
+        }
+
+        if (argName == "maxdatasetingests") {
+            maxDatasetIngests = (int) strtol(argValue.data(), nullptr, 0);
+        }
+
+        if (argName == "entitycachebytes") {
+            entityCacheBytes = (size_t) strtoull(argValue.data(), nullptr, 0);
+        }
+
+        if (argName == "storeinrefsindex") {
+            storeInRefsIndex = argValue;
+        }
     }
 
     // TODO: check that storeslocation exists
@@ -108,6 +204,18 @@ int main(int argc, char *argv[]) {
 
     // start server
     WodServer s(port, storesLocation, nodename, subjectIdentifier);
+    for (auto& route : compressionLevels) {
+        s.SetCompressionLevels(route.first, route.second);
+    }
+    s.SetResponseChunkSize(responseChunkSize);
+    s.SetMaxUnacknowledgedBytes(maxUnacknowledgedBytes);
+    s.SetRequestThreads(requestThreads);
+    s.SetScanThreads(scanThreads, maxPendingScans);
+    s.SetIngestLimits(maxStoreIngests, maxDatasetIngests);
+    s.GetStoreManager()->SetEntityCacheBytes(entityCacheBytes);
+    if (!storeInRefsIndex.empty()) {
+        s.GetStoreManager()->SetStoreInRefsIndex(storeInRefsIndex == "true");
+    }
     s.ConfigureRoutes();
     s.Start();
     return 0;